@@ -0,0 +1,265 @@
+#include "sefil.h"
+
+// Native file systems read the partition through BlockIo themselves, in
+// transfers as large as the layout on disk allows, instead of the one
+// sector or cluster per call many firmware drivers issue. Metadata goes
+// through a small LRU cache of BLOCK_UNIT pieces, file data straight into
+// the caller's buffer.
+efi_guid_t block_io_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+
+int block_native = 1;
+struct block_stats block_stats;
+
+struct {
+    int count;
+    struct block_dev dev[BLOCK_DEVS_MAX];
+} block_devs;
+
+struct block_unit {
+    struct block_dev *dev;
+    uint64_t offset;
+    uint64_t used;      // LRU stamp, 0 if empty
+    uint8_t *data;
+};
+
+struct {
+    uint64_t clock;
+    struct block_unit unit[BLOCK_UNITS];
+} block_cache;
+
+// The block device on handle, NULL without BlockIo or media.
+struct block_dev *block_get(efi_handle_t handle) {
+    for(int i = 0; i<block_devs.count; ++i)
+        if(block_devs.dev[i].handle==handle)
+            return &block_devs.dev[i];
+    efi_block_io_t *bio;
+    if(block_devs.count==BLOCK_DEVS_MAX
+       || EFI_ERROR(BS->HandleProtocol(handle, &block_io_guid, (void **)&bio))
+       || !bio->Media->MediaPresent || bio->Media->BlockSize<512
+       || bio->Media->BlockSize & (bio->Media->BlockSize-1))
+        return NULL;
+    struct block_dev *dev = &block_devs.dev[block_devs.count++];
+    *dev = (struct block_dev){
+        .handle = handle, .bio = bio, .media_id = bio->Media->MediaId,
+        .block_size = bio->Media->BlockSize, .io_align = max(bio->Media->IoAlign, 1),
+        .size = (bio->Media->LastBlock+1)*bio->Media->BlockSize,
+    };
+    return dev;
+}
+
+static int block_transfer(struct block_dev *dev, uint64_t lba, uintn_t size, void *buffer) {
+    ++block_stats.reads;
+    block_stats.bytes += size;
+    EE(dev->bio->ReadBlocks(dev->bio, dev->media_id, lba, size, buffer))
+        return 0;
+    return 1;
+}
+
+// size bytes at offset into buffer. Whole aligned blocks go in one
+// ReadBlocks, partial blocks at either end and buffers the device cannot
+// take through a page-aligned bounce buffer.
+int block_read(struct block_dev *dev, uint64_t offset, uint64_t size, void *buffer) {
+    static uint8_t *bounce;
+    if(!bounce) {
+        efi_physical_address_t pages;
+        EE(BS->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(BLOCK_BOUNCE), &pages))
+            return 0;
+        bounce = (uint8_t *)(uintn_t)pages;
+    }
+    if(offset>dev->size || size>dev->size-offset)
+        return 0;
+    uint8_t *out = buffer;
+    uint32_t block = dev->block_size;
+    while(size) {
+        uint64_t lba = offset/block, skip = offset%block;
+        if(!skip && size>=block && !((uintn_t)out%dev->io_align)) {
+            uint64_t length = size/block*block;
+            if(!block_transfer(dev, lba, length, out))
+                return 0;
+            out += length, offset += length, size -= length;
+            continue;
+        }
+        uint64_t length = min((skip+size+block-1)/block*block, BLOCK_BOUNCE);
+        if(!block_transfer(dev, lba, length, bounce))
+            return 0;
+        length = min(length-skip, size);
+        memcpy(out, bounce+skip, length);
+        out += length, offset += length, size -= length;
+    }
+    return 1;
+}
+
+// size bytes at offset from the cache, which must not cross a BLOCK_UNIT
+// boundary. Valid until the next call.
+const void *block_cached(struct block_dev *dev, uint64_t offset, uintn_t size) {
+    uint64_t base = offset/BLOCK_UNIT*BLOCK_UNIT;
+    if(offset-base+size>BLOCK_UNIT || base>=dev->size)
+        return NULL;
+    struct block_unit *unit = NULL, *oldest = &block_cache.unit[0];
+    for(int i = 0; i<BLOCK_UNITS && !unit; ++i) {
+        struct block_unit *u = &block_cache.unit[i];
+        if(u->used && u->dev==dev && u->offset==base)
+            unit = u;
+        else if(u->used<oldest->used)
+            oldest = u;
+    }
+    if(unit)
+        ++block_stats.hits;
+    else {
+        ++block_stats.misses;
+        unit = oldest;
+        if(!unit->data && !(unit->data = malloc(BLOCK_UNIT)))
+            return NULL;
+        unit->used = 0;
+        if(!block_read(dev, base, min(BLOCK_UNIT, dev->size-base), unit->data))
+            return NULL;
+        unit->dev = dev, unit->offset = base;
+    }
+    unit->used = ++block_cache.clock;
+    return unit->data+(offset-base);
+}
+
+// EFI_FILE_PROTOCOL over a file system's extent map. Read asks map for the
+// run at the position and reads all of it that is wanted in one go.
+static efi_status_t EFIAPI block_file_open(efi_file_handle_t *This, efi_file_handle_t **NewHandle,
+                                           wchar_t *FileName, uint64_t OpenMode, uint64_t Attributes) {
+    (void)This, (void)NewHandle, (void)FileName, (void)OpenMode, (void)Attributes;
+    return EFI_UNSUPPORTED;
+}
+
+static efi_status_t EFIAPI block_file_close(efi_file_handle_t *This) {
+    struct block_file *file = (struct block_file *)This;
+    if(file->reads)
+        log_printf(LOG_DEBUG, "block: %d bytes in %d transfers", file->bytes, (uint64_t)file->reads);
+    free(file);
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI block_file_delete(efi_file_handle_t *This) {
+    block_file_close(This);
+    return EFI_WARN_DELETE_FAILURE;
+}
+
+static efi_status_t EFIAPI block_file_read(efi_file_handle_t *This, uintn_t *BufferSize, void *Buffer) {
+    struct block_file *file = (struct block_file *)This;
+    uint64_t left = file->position<file->size ? min(*BufferSize, file->size-file->position) : 0;
+    uint8_t *out = Buffer;
+    efi_status_t status = EFI_SUCCESS;
+    while(left) {
+        uint64_t disk, length;
+        if(!file->map(file, file->position, left, &disk, &length) || !length) {
+            status = EFI_DEVICE_ERROR;
+            break;
+        }
+        length = min(length, left);
+        if(disk==BLOCK_HOLE)
+            memset(out, 0, length);
+        else if(!block_read(file->dev, disk, length, out)) {
+            status = EFI_DEVICE_ERROR;
+            break;
+        }
+        else ++file->reads, file->bytes += length;
+        out += length, file->position += length, left -= length;
+    }
+    *BufferSize = out-(uint8_t *)Buffer;
+    return status;
+}
+
+static efi_status_t EFIAPI block_file_write(efi_file_handle_t *This, uintn_t *BufferSize, void *Buffer) {
+    (void)This, (void)BufferSize, (void)Buffer;
+    return EFI_WRITE_PROTECTED;
+}
+
+static efi_status_t EFIAPI block_file_get_position(efi_file_handle_t *This, uint64_t *Position) {
+    *Position = ((struct block_file *)This)->position;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI block_file_set_position(efi_file_handle_t *This, uint64_t Position) {
+    struct block_file *file = (struct block_file *)This;
+    file->position = Position==~0ull ? file->size : Position;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI block_file_get_info(efi_file_handle_t *This, efi_guid_t *InformationType,
+                                               uintn_t *BufferSize, void *Buffer) {
+    struct block_file *file = (struct block_file *)This;
+    efi_guid_t info_guid = EFI_FILE_INFO_GUID;
+    if(memcmp(InformationType, &info_guid, sizeof(info_guid)))
+        return EFI_UNSUPPORTED;
+    uintn_t name_length = 0;
+    while(file->name[name_length]) ++name_length;
+    uintn_t size = sizeof(efi_file_info_t)-sizeof(((efi_file_info_t *)0)->FileName)
+                   +(name_length+1)*sizeof(wchar_t);
+    if(*BufferSize<size) {
+        *BufferSize = size;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+    efi_file_info_t *info = Buffer;
+    info->Size = size;
+    info->FileSize = file->size;
+    info->PhysicalSize = file->size;
+    info->CreateTime = file->ctime;
+    info->LastAccessTime = file->mtime;
+    info->ModificationTime = file->mtime;
+    info->Attribute = EFI_FILE_READ_ONLY;
+    memcpy(info->FileName, file->name, (name_length+1)*sizeof(wchar_t));
+    *BufferSize = size;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI block_file_set_info(efi_file_handle_t *This, efi_guid_t *InformationType,
+                                               uintn_t BufferSize, void *Buffer) {
+    (void)This, (void)InformationType, (void)BufferSize, (void)Buffer;
+    return EFI_WRITE_PROTECTED;
+}
+
+static efi_status_t EFIAPI block_file_flush(efi_file_handle_t *This) {
+    (void)This;
+    return EFI_SUCCESS;
+}
+
+// A zeroed file of size bytes, the file system's struct beginning with
+// struct block_file, with the protocol filled in.
+struct block_file *block_file_new(struct block_dev *dev, uintn_t size) {
+    struct block_file *file = calloc(1, size);
+    if(!file)
+        return NULL;
+    file->file = (efi_file_handle_t){
+        EFI_FILE_PROTOCOL_REVISION, block_file_open, block_file_close, block_file_delete,
+        block_file_read, block_file_write, block_file_get_position, block_file_set_position,
+        block_file_get_info, block_file_set_info, block_file_flush
+    };
+    file->dev = dev;
+    return file;
+}
+
+// Open name on the file system of the volume handle, NULL if it is not one
+// sefil reads itself or the file is not there.
+efi_file_handle_t *block_open(efi_handle_t volume, const wchar_t *name) {
+    struct block_dev *dev = block_native ? block_get(volume) : NULL;
+    if(!dev)
+        return NULL;
+    if(dev->fs==FS_UNKNOWN)
+        dev->fs = fat_mount(dev) ? FS_FAT : ext4_mount(dev) ? FS_EXT4 : FS_NONE;
+    struct block_file *file = NULL;
+    if(dev->fs==FS_FAT)
+        file = fat_open(dev, name);
+    else if(dev->fs==FS_EXT4)
+        file = ext4_open(dev, name);
+    return file ? &file->file : NULL;
+}
+
+// Forget cached blocks and mounts after the firmware wrote to a volume.
+void block_flush() {
+    for(int i = 0; i<BLOCK_UNITS; ++i)
+        block_cache.unit[i].used = 0;
+    for(int i = 0; i<block_devs.count; ++i) {
+        struct block_dev *dev = &block_devs.dev[i];
+        if(dev->fs==FS_FAT)
+            fat_unmount(dev);
+        else if(dev->fs==FS_EXT4)
+            ext4_unmount(dev);
+        dev->fs = FS_UNKNOWN;
+    }
+}
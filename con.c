@@ -0,0 +1,220 @@
+#include "sefil.h"
+
+/*** Text backend, plain SimpleTextOutput ***/
+// Attribute last set in firmware, so redundant SetAttribute calls are skipped.
+static int text_attr = -1;
+
+static int text_init(int *cols, int *rows, int *col, int *row) {
+    uintn_t c, r;
+    if(EFI_ERROR(ST->ConOut->QueryMode(ST->ConOut, ST->ConOut->Mode->Mode, &c, &r)))
+        c = 80, r = 25;
+    ++con_stats.calls;
+    *cols = c, *rows = r;
+    *col = ST->ConOut->Mode->CursorColumn;
+    *row = ST->ConOut->Mode->CursorRow;
+    text_attr = ST->ConOut->Mode->Attribute;
+    return 1;
+}
+
+static void text_set_attr(int attr) {
+    if(attr==text_attr)
+        return;
+    ST->ConOut->SetAttribute(ST->ConOut, attr);
+    text_attr = attr;
+    ++con_stats.calls;
+}
+
+static void text_clear(int attr) {
+    text_set_attr(attr);
+    ST->ConOut->ClearScreen(ST->ConOut);
+    ++con_stats.calls;
+}
+
+static void text_position(int col, int row) {
+    ST->ConOut->SetCursorPosition(ST->ConOut, col, row);
+    ++con_stats.calls;
+}
+
+static void text_output(int attr, wchar_t *str, int len) {
+    text_set_attr(attr);
+    str[len] = 0;
+    ST->ConOut->OutputString(ST->ConOut, str);
+    ++con_stats.calls;
+}
+
+static void text_present() {}
+
+struct con_backend con_text = {
+    text_init, text_clear, text_position, text_output, text_present, NULL, NULL
+};
+
+/*** Buffered writer ***/
+// Cursor and attribute as they will be once the buffer is flushed.
+enum { CON_BUF = 2048 };
+struct {
+    struct con_backend *backend;
+    int select;
+    efi_event_t poll;
+    int cols, rows;
+    int col, row;
+    int attr;
+    int len;
+    wchar_t buf[CON_BUF+1];
+} con = {
+#ifdef SEFIL_SERIAL
+    .select = CON_SERIAL
+#else
+    .select = CON_GOP
+#endif
+};
+struct con_stats con_stats;
+static uint32_t frame_start;
+
+// Preferred backend, only effective before the first output.
+void con_select(int backend) {
+    con.select = backend;
+}
+
+void con_init() {
+    struct con_backend *backend = con.select==CON_GOP ? &con_gop
+                                : con.select==CON_SERIAL ? &con_serial : &con_text;
+    if(backend==&con_text || !backend->init(&con.cols, &con.rows, &con.col, &con.row))
+        con_text.init(&con.cols, &con.rows, &con.col, &con.row), backend = &con_text;
+    con.backend = backend;
+    // Keep the firmware attribute in text mode, debug output may precede
+    // the first clear.
+    con.attr = con.backend==&con_text ? text_attr : EFI_TEXT_ATTR(EFI_LIGHTGRAY, EFI_BLACK);
+    con.len = 0;
+}
+
+int con_cols() {
+    if(!con.backend) con_init();
+    return con.cols;
+}
+
+int con_rows() {
+    if(!con.backend) con_init();
+    return con.rows;
+}
+
+// Key from the backend input, else from ConIn.
+int con_read_key(efi_input_key_t *key) {
+    if(con.backend && con.backend->read_key && con.backend->read_key(key))
+        return 1;
+    return !EFI_ERROR(ST->ConIn->ReadKeyStroke(ST->ConIn, key));
+}
+
+// Periodic timer to wait on next to WaitForKey, NULL unless the backend
+// has its own input.
+efi_event_t con_poll_event() {
+    if(!con.backend || !con.backend->read_key || con.poll)
+        return con.poll;
+    EE(BS->CreateEvent(EVT_TIMER, 0, NULL, NULL, &con.poll))
+        return con.poll = NULL;
+    EE(BS->SetTimer(con.poll, TimerPeriodic, 200000)) {}
+    return con.poll;
+}
+
+// Around an image start, see struct con_backend.
+void con_handover(int leaving) {
+    if(leaving)
+        con_flush();
+    if(con.backend && con.backend->handover)
+        con.backend->handover(leaving);
+}
+
+// Hand the buffered run to the backend without presenting it.
+static void con_emit() {
+    if(!con.len)
+        return;
+    con.backend->output(con.attr, con.buf, con.len);
+    con.len = 0;
+}
+
+void con_flush() {
+    if(!con.backend)
+        return;
+    con_emit();
+    con.backend->present();
+}
+
+// Close the current frame and keep its firmware call count.
+void con_frame() {
+    con_flush();
+    con_stats.frame_calls = con_stats.calls-frame_start;
+    frame_start = con_stats.calls;
+}
+
+void con_clear(int attr) {
+    if(!con.backend) con_init();
+    con_emit();
+    con.backend->clear(attr);
+    con.attr = attr;
+    con.col = con.row = 0;
+}
+
+void con_attr(int attr) {
+    if(attr==con.attr)
+        return;
+    con_emit();
+    con.attr = attr;
+}
+
+// Moving to the start of the next row stays in the buffer as CR LF, any
+// other move is a backend call.
+void con_goto(int col, int row) {
+    if(!con.backend) con_init();
+    if(col==con.col && row==con.row)
+        return;
+    if(!col && row==con.row+1 && con.col<con.cols) {
+        con_putc('\r');
+        con_putc('\n');
+        return;
+    }
+    con_emit();
+    con.backend->position(col, row);
+    con.col = col, con.row = row;
+}
+
+void con_putc(wchar_t c) {
+    if(!con.backend) con_init();
+    if(con.len==CON_BUF)
+        con_emit();
+    con.buf[con.len++] = c;
+    if(c=='\r')
+        con.col = 0;
+    else if(c=='\n')
+        con.row = min(con.row+1, con.rows-1);
+    // A full row may or may not wrap depending on the firmware, col==cols
+    // forces the next con_goto() to position explicitly.
+    else if(con.col<con.cols)
+        ++con.col;
+}
+
+void con_fill(wchar_t c, int n) {
+    while(n-->0) con_putc(c);
+}
+
+void con_puts(const wchar_t *str, int n) {
+    for(int i = 0; n<0 ? str[i] : i<n; ++i)
+        con_putc(str[i]);
+}
+
+// printf into the buffer, the UTF-8 from vsnprintf is decoded to UCS-2.
+int con_printf(const char *fmt, ...) {
+    static char text[4096];
+    __builtin_va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+
+    for(const uint8_t *p = (const uint8_t *)text; *p;) {
+        wchar_t c = *p++;
+        if(c>=0xE0 && (p[0] & 0xC0)==0x80 && (p[1] & 0xC0)==0x80)
+            c = (c & 0x0F)<<12 | (p[0] & 0x3F)<<6 | (p[1] & 0x3F), p += 2;
+        else if(c>=0xC0 && (p[0] & 0xC0)==0x80)
+            c = (c & 0x1F)<<6 | (p[0] & 0x3F), p += 1;
+        con_putc(c);
+    }
+    return len;
+}
@@ -0,0 +1,594 @@
+#include "sefil.h"
+
+// ext4, and ext2/ext3 without journal replay, read only. The inode table
+// location of every block group is taken from the descriptor table once at
+// mount. Files map through their extent tree, or the indirect block map of
+// older inodes, and contiguous extents coalesce into one transfer. Indexed
+// directories are searched by name hash, others entry by entry, through the
+// block cache. Names compare as stored, case sensitive, and symbolic links
+// are followed. Inline data is read from the inode itself.
+enum {
+    EXT4_SUPER = 1024, EXT4_MAGIC = 0xEF53, EXT4_ROOT = 2,
+    // Group descriptor table, one inode table address per group.
+    EXT4_GROUPS_MAX = 2*1024*1024,
+    EXT4_LINKS_MAX = 8, EXT4_NAME_MAX = 255, EXT4_PATH_MAX = 4096,
+    // Feature bits, any incompatible one not supported fails the mount.
+    EXT4_COMPAT_DIR_INDEX = 0x20,
+    EXT4_INCOMPAT_64BIT = 0x80,
+    EXT4_INCOMPAT_SUPPORTED = 0x2|0x4|0x40|0x80|0x100|0x200|0x400|0x2000|0x4000|0x8000|0x10000|0x20000,
+    EXT4_FLAGS_UNSIGNED_HASH = 0x2,
+    // Inode flags and modes.
+    EXT4_ENCRYPT_FL = 0x800, EXT4_INDEX_FL = 0x1000, EXT4_EXTENTS_FL = 0x80000,
+    EXT4_CASEFOLD_FL = 0x40000000, EXT4_INLINE_DATA_FL = 0x10000000,
+    EXT4_S_IFMT = 0xF000, EXT4_S_IFDIR = 0x4000, EXT4_S_IFREG = 0x8000, EXT4_S_IFLNK = 0xA000,
+    EXT4_EXTENT_MAGIC = 0xF30A, EXT4_EXTENT_INIT_MAX = 32768,
+    EXT4_XATTR_MAGIC = 0xEA020000, EXT4_XATTR_SYSTEM = 7,
+    EXT4_HASH_LEGACY = 0, EXT4_HASH_HALF_MD4 = 1, EXT4_HASH_TEA = 2, EXT4_HASH_UNSIGNED = 3,
+    EXT4_HTREE_LEVELS = 3,
+};
+
+struct ext4 {
+    uint32_t block_size, inode_size;
+    uint32_t inodes_per_group, groups;
+    uint64_t blocks;
+    uint32_t hash_seed[4];
+    int hash_unsigned, dir_index;
+    uint64_t *inode_table;
+    uint8_t *scratch;           // one block, for blocks above BLOCK_UNIT
+};
+
+// Inode fields, i_block holds the extent tree root, block map or inline
+// data. Inline data longer than i_block continues in the system.data
+// attribute, at tail on disk.
+struct ext4_inode {
+    uint16_t mode;
+    uint32_t number, flags;
+    uint64_t size, offset, tail, tail_size;
+    uint8_t block[60];
+    efi_time_t ctime, mtime;
+};
+
+struct ext4_file {
+    struct block_file base;
+    struct ext4_inode inode;
+};
+
+static inline uint16_t le16(const uint8_t *p) {
+    return p[0] | p[1]<<8;
+}
+
+static inline uint32_t le32(const uint8_t *p) {
+    return p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+// Block number block, valid until the next call.
+static const uint8_t *ext4_block(struct block_dev *dev, uint64_t block) {
+    struct ext4 *fs = dev->fs_data;
+    if(block>=fs->blocks)
+        return NULL;
+    if(fs->block_size<=BLOCK_UNIT)
+        return block_cached(dev, block*fs->block_size, fs->block_size);
+    return block_read(dev, block*fs->block_size, fs->block_size, fs->scratch) ? fs->scratch : NULL;
+}
+
+int ext4_mount(struct block_dev *dev) {
+    uint8_t sb[1024];
+    if(dev->size<2*EXT4_SUPER || !block_read(dev, EXT4_SUPER, sizeof(sb), sb) || le16(sb+0x38)!=EXT4_MAGIC)
+        return 0;
+    uint32_t incompat = le32(sb+0x60), log_block = le32(sb+0x18);
+    if(incompat & ~EXT4_INCOMPAT_SUPPORTED || log_block>6) {
+        log_printf(LOG_WARN, "ext4: unsupported features %x", (uint64_t)incompat);
+        return 0;
+    }
+    struct ext4 *fs = calloc(1, sizeof(*fs));
+    if(!fs)
+        return 0;
+    fs->block_size = 1024<<log_block;
+    fs->inode_size = le32(sb+0x4C) ? le16(sb+0x58) : 128;
+    fs->inodes_per_group = le32(sb+0x28);
+    fs->blocks = le32(sb+0x4) | (incompat & EXT4_INCOMPAT_64BIT ? (uint64_t)le32(sb+0x150)<<32 : 0);
+    uint32_t first_data = le32(sb+0x14), per_group = le32(sb+0x20);
+    uint32_t desc_size = incompat & EXT4_INCOMPAT_64BIT ? le16(sb+0xFE) : 32;
+    if(fs->inode_size<128 || fs->inode_size>fs->block_size || fs->inode_size & (fs->inode_size-1)
+       || !fs->inodes_per_group || !per_group || desc_size<32 || desc_size>fs->block_size
+       || fs->blocks<=first_data || fs->blocks*fs->block_size>dev->size
+       || (fs->groups = (fs->blocks-first_data+per_group-1)/per_group)>EXT4_GROUPS_MAX
+       || (uint64_t)fs->groups*fs->inodes_per_group<le32(sb+0x0)) {
+        log_printf(LOG_WARN, "ext4: bad superblock");
+        free(fs);
+        return 0;
+    }
+    for(int i = 0; i<4; ++i)
+        fs->hash_seed[i] = le32(sb+0xEC+4*i);
+    // mkfs always sets a seed, the MD4 initial state stands in without one.
+    if(!(fs->hash_seed[0] | fs->hash_seed[1] | fs->hash_seed[2] | fs->hash_seed[3]))
+        memcpy(fs->hash_seed, (uint32_t[4]){ 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 },
+               sizeof(fs->hash_seed));
+    fs->hash_unsigned = le32(sb+0x160) & EXT4_FLAGS_UNSIGNED_HASH;
+    fs->dir_index = le32(sb+0x5C) & EXT4_COMPAT_DIR_INDEX;
+
+    // The descriptor table follows the superblock's block.
+    uint64_t table_size = (uint64_t)fs->groups*desc_size;
+    uint8_t *table = malloc(table_size);
+    if(fs->block_size>BLOCK_UNIT)
+        fs->scratch = malloc(fs->block_size);
+    fs->inode_table = malloc((uint64_t)fs->groups*sizeof(uint64_t));
+    if(!table || !fs->inode_table || (fs->block_size>BLOCK_UNIT && !fs->scratch)
+       || !block_read(dev, (uint64_t)(first_data+1)*fs->block_size, table_size, table)) {
+        free(table), free(fs->inode_table), free(fs->scratch), free(fs);
+        return 0;
+    }
+    for(uint32_t i = 0; i<fs->groups; ++i) {
+        const uint8_t *desc = table+(uint64_t)i*desc_size;
+        fs->inode_table[i] = le32(desc+0x8) | (desc_size>=64 ? (uint64_t)le32(desc+0x28)<<32 : 0);
+    }
+    free(table);
+    dev->fs_data = fs;
+    log_printf(LOG_INFO, "ext4: %d blocks of %d bytes in %d groups", fs->blocks,
+               (uint64_t)fs->block_size, (uint64_t)fs->groups);
+    return 1;
+}
+
+void ext4_unmount(struct block_dev *dev) {
+    struct ext4 *fs = dev->fs_data;
+    if(fs)
+        free(fs->inode_table), free(fs->scratch), free(fs);
+    dev->fs_data = NULL;
+}
+
+// Seconds since 1970 and their extra word, epoch bits and nanoseconds, as
+// UTC.
+static efi_time_t ext4_time(uint32_t seconds, uint32_t extra) {
+    int64_t time = (int64_t)(int32_t)seconds+((int64_t)(extra & 3)<<32);
+    int64_t days = (time>=0 ? time : time-86399)/86400, rest = time-days*86400;
+    // Days to civil date, with years beginning in March.
+    int64_t z = days+719468, era = (z>=0 ? z : z-146096)/146097;
+    int64_t doe = z-era*146097, yoe = (doe-doe/1460+doe/36524-doe/146096)/365;
+    int64_t doy = doe-(365*yoe+yoe/4-yoe/100), mp = (5*doy+2)/153;
+    int month = mp<10 ? mp+3 : mp-9;
+    return (efi_time_t){
+        .Year = yoe+era*400+(month<=2), .Month = month, .Day = doy-(153*mp+2)/5+1,
+        .Hour = rest/3600, .Minute = rest/60%60, .Second = rest%60, .Nanosecond = extra>>2,
+    };
+}
+
+// The system.data attribute among those stored in the inode after its extra
+// fields.
+static void ext4_inline_tail(struct ext4 *fs, const uint8_t *p, uint32_t extra, struct ext4_inode *inode) {
+    uint32_t start = 128+extra+4, size = min(fs->inode_size, BLOCK_UNIT);
+    if(start>size || le32(p+start-4)!=EXT4_XATTR_MAGIC)
+        return;
+    // Entries end with four zero bytes, values are relative to the first.
+    for(uint32_t offset = 0; offset+16<=size-start && le32(p+start+offset);) {
+        const uint8_t *entry = p+start+offset;
+        uint32_t name = entry[0], value = le16(entry+2), value_size = le32(entry+8);
+        if(offset+16+name>size-start)
+            return;
+        if(entry[1]==EXT4_XATTR_SYSTEM && name==4 && !memcmp(entry+16, "data", 4) && !le32(entry+4)
+           && value+value_size<=size-start) {
+            inode->tail = inode->offset+start+value;
+            inode->tail_size = value_size;
+            return;
+        }
+        offset += (16+name+3) & ~3u;
+    }
+}
+
+static int ext4_inode(struct block_dev *dev, uint32_t number, struct ext4_inode *inode) {
+    struct ext4 *fs = dev->fs_data;
+    uint32_t group = (number-1)/fs->inodes_per_group, index = (number-1)%fs->inodes_per_group;
+    if(!number || group>=fs->groups)
+        return 0;
+    uint64_t offset = fs->inode_table[group]*fs->block_size+(uint64_t)index*fs->inode_size;
+    const uint8_t *p = block_cached(dev, offset, min(fs->inode_size, BLOCK_UNIT));
+    if(!p)
+        return 0;
+    uint32_t extra = fs->inode_size>128 ? le16(p+0x80) : 0;
+    *inode = (struct ext4_inode){ .number = number };
+    inode->mode = le16(p+0x0);
+    inode->flags = le32(p+0x20);
+    inode->size = le32(p+0x4) | (uint64_t)le32(p+0x6C)<<32;
+    inode->offset = offset;
+    memcpy(inode->block, p+0x28, sizeof(inode->block));
+    inode->mtime = ext4_time(le32(p+0x10), extra>=0x8C-0x80 ? le32(p+0x88) : 0);
+    inode->ctime = extra>=0x98-0x80 ? ext4_time(le32(p+0x90), le32(p+0x94)) : inode->mtime;
+    if(inode->flags & EXT4_INLINE_DATA_FL && fs->inode_size>128)
+        ext4_inline_tail(fs, p, extra, inode);
+    return 1;
+}
+
+// Extent covering logical block, or the hole before the next one. Extents
+// that continue each other on disk as well are merged, up to count blocks.
+static int ext4_extent(struct block_dev *dev, struct ext4_inode *inode, uint64_t logical, uint64_t count,
+                       uint64_t *physical, uint64_t *length) {
+    struct ext4 *fs = dev->fs_data;
+    const uint8_t *node = inode->block;
+    // Where the next subtree begins, holes at the end of a leaf stop there.
+    uint64_t bound = ~0ull;
+    for(int level = 0;; ++level) {
+        uint32_t entries = le16(node+2), depth = le16(node+6);
+        if(le16(node)!=EXT4_EXTENT_MAGIC || level>5
+           || 12+12*entries>(level ? fs->block_size : sizeof(inode->block)))
+            return 0;
+        // Last entry starting at or before the block.
+        uint32_t i = 0;
+        while(i+1<entries && le32(node+12+12*(i+1))<=logical) ++i;
+        const uint8_t *entry = node+12+12*i;
+        if(!depth) {
+            if(!entries || logical<le32(entry)) {
+                *physical = BLOCK_HOLE;
+                *length = entries ? le32(entry)-logical : min(count, bound-logical);
+                return 1;
+            }
+            uint64_t first = le32(entry), run = le16(entry+4);
+            uint64_t start = le32(entry+8) | (uint64_t)le16(entry+6)<<32;
+            int uninit = run>EXT4_EXTENT_INIT_MAX;
+            run -= uninit ? EXT4_EXTENT_INIT_MAX : 0;
+            if(logical>=first+run) {
+                // Past this extent, a hole up to the next one.
+                *physical = BLOCK_HOLE;
+                *length = i+1<entries ? le32(entry+12)-logical : min(count, bound-logical);
+                return 1;
+            }
+            // Preallocated extents read as zeros.
+            *physical = uninit ? BLOCK_HOLE : start+logical-first;
+            *length = first+run-logical;
+            while(!uninit && *length<count && ++i<entries) {
+                entry += 12;
+                uint64_t next = le16(entry+4);
+                if(next>EXT4_EXTENT_INIT_MAX || le32(entry)!=first+run
+                   || (le32(entry+8) | (uint64_t)le16(entry+6)<<32)!=start+run)
+                    break;
+                first = le32(entry), start += run, run = next;
+                *length += next;
+            }
+            return 1;
+        }
+        if(i+1<entries)
+            bound = le32(entry+12);
+        if(!entries || !(node = ext4_block(dev, le32(entry+4) | (uint64_t)le16(entry+8)<<32)))
+            return 0;
+    }
+}
+
+// ext2/ext3 block map, 12 direct blocks then single, double and triple
+// indirect ones. 0 for holes.
+static int ext4_indirect(struct block_dev *dev, struct ext4_inode *inode, uint64_t logical, uint64_t *physical) {
+    struct ext4 *fs = dev->fs_data;
+    uint64_t per_block = fs->block_size/4, span = 1;
+    if(logical<12) {
+        *physical = le32(inode->block+4*logical);
+        return 1;
+    }
+    logical -= 12;
+    int level = 1;
+    while(logical>=(span *= per_block)) {
+        logical -= span;
+        if(++level>3)
+            return 0;
+    }
+    uint32_t block = le32(inode->block+4*(11+level));
+    while(block && level--) {
+        span /= per_block;
+        const uint8_t *p = block<fs->blocks
+                           ? block_cached(dev, (uint64_t)block*fs->block_size+logical/span*4, 4) : NULL;
+        if(!p)
+            return 0;
+        block = le32(p);
+        logical %= span;
+    }
+    *physical = block;
+    return 1;
+}
+
+static int ext4_map(struct block_file *base, uint64_t pos, uint64_t max, uint64_t *disk, uint64_t *length) {
+    struct ext4_file *file = (struct ext4_file *)base;
+    struct ext4 *fs = base->dev->fs_data;
+    struct ext4_inode *inode = &file->inode;
+    uint64_t logical = pos/fs->block_size, skip = pos%fs->block_size;
+    uint64_t count = (skip+max+fs->block_size-1)/fs->block_size, physical, blocks = 1;
+    if(inode->flags & EXT4_INLINE_DATA_FL) {
+        // i_block, then the attribute, open refuses files larger than both.
+        if(pos<sizeof(inode->block)) {
+            *disk = inode->offset+0x28+pos;
+            *length = sizeof(inode->block)-pos;
+            return 1;
+        }
+        pos -= sizeof(inode->block);
+        *disk = inode->tail+pos;
+        *length = inode->tail_size-pos;
+        return pos<inode->tail_size;
+    }
+    if(inode->flags & EXT4_EXTENTS_FL) {
+        if(!ext4_extent(base->dev, inode, logical, count, &physical, &blocks) || !blocks)
+            return 0;
+    }
+    else {
+        if(!ext4_indirect(base->dev, inode, logical, &physical))
+            return 0;
+        physical = physical ? physical : BLOCK_HOLE;
+        // Block maps have no extents, merge blocks that follow on disk.
+        for(uint64_t next; blocks<count && physical!=BLOCK_HOLE
+            && ext4_indirect(base->dev, inode, logical+blocks, &next) && next==physical+blocks;)
+            ++blocks;
+    }
+    if(physical!=BLOCK_HOLE && physical+blocks>fs->blocks)
+        return 0;
+    *disk = physical==BLOCK_HOLE ? BLOCK_HOLE : physical*fs->block_size+skip;
+    *length = blocks*fs->block_size-skip;
+    return 1;
+}
+
+// Disk block of a directory's logical block, 0 for holes.
+static uint64_t ext4_dir_block(struct block_dev *dev, struct ext4_file *dir, uint64_t logical) {
+    struct ext4 *fs = dev->fs_data;
+    uint64_t disk, length;
+    if(!ext4_map(&dir->base, logical*fs->block_size, fs->block_size, &disk, &length) || disk==BLOCK_HOLE)
+        return 0;
+    return disk/fs->block_size;
+}
+
+// Entry named name among the entries in size bytes at p, 0 if none.
+static uint32_t ext4_dir_search(const uint8_t *p, uint32_t size, const char *name, int length) {
+    for(uint32_t offset = 0; p && offset+8<=size;) {
+        uint32_t record = le16(p+offset+4);
+        if(record<8 || record%4 || offset+record>size || p[offset+6]+8u>record)
+            return 0;
+        if(le32(p+offset) && p[offset+6]==length && !memcmp(p+offset+8, name, length))
+            return le32(p+offset);
+        offset += record;
+    }
+    return 0;
+}
+
+// Directory index hashes, as in fs/ext4/hash.c.
+static uint32_t rol32(uint32_t x, int r) {
+    return x<<r | x>>(32-r);
+}
+
+static void hash_md4(uint32_t buf[4], const uint32_t in[8]) {
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+    static const uint8_t order[3][8] = { { 0, 1, 2, 3, 4, 5, 6, 7 }, { 1, 3, 5, 7, 0, 2, 4, 6 },
+                                         { 3, 7, 2, 6, 1, 5, 0, 4 } };
+    static const uint8_t shift[3][4] = { { 3, 7, 11, 19 }, { 3, 5, 9, 13 }, { 3, 9, 11, 15 } };
+    static const uint32_t key[3] = { 0, 013240474631, 015666365641 };
+    for(int round = 0; round<3; ++round)
+        for(int i = 0; i<8; ++i) {
+            uint32_t f = round==0 ? d ^ (b & (c ^ d)) : round==1 ? (b & c)+((b ^ c) & d) : b ^ c ^ d;
+            uint32_t t = rol32(a+f+in[order[round][i]]+key[round], shift[round][i%4]);
+            a = d, d = c, c = b, b = t;
+        }
+    buf[0] += a, buf[1] += b, buf[2] += c, buf[3] += d;
+}
+
+static void hash_tea(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+    for(int n = 0; n<16; ++n) {
+        sum += 0x9E3779B9;
+        b0 += ((b1<<4)+in[0]) ^ (b1+sum) ^ ((b1>>5)+in[1]);
+        b1 += ((b0<<4)+in[2]) ^ (b0+sum) ^ ((b0>>5)+in[3]);
+    }
+    buf[0] += b0, buf[1] += b1;
+}
+
+// Name bytes packed big end first into words, padded with the length.
+static void hash_words(const char *name, int length, uint32_t *words, int count, int is_unsigned) {
+    uint32_t pad = (uint32_t)length | (uint32_t)length<<8, value;
+    pad |= pad<<16;
+    value = pad;
+    length = min(length, count*4);
+    for(int i = 0; i<length; ++i) {
+        int c = is_unsigned ? (uint8_t)name[i] : (signed char)name[i];
+        value = (uint32_t)c+(value<<8);
+        if(i%4==3)
+            *words++ = value, value = pad, --count;
+    }
+    if(--count>=0)
+        *words++ = value;
+    while(--count>=0)
+        *words++ = pad;
+}
+
+static uint32_t ext4_hash(struct ext4 *fs, int version, const char *name, int length) {
+    int is_unsigned = version>=EXT4_HASH_UNSIGNED;
+    uint32_t buf[4], in[8], hash;
+    memcpy(buf, fs->hash_seed, sizeof(buf));
+    switch(version%EXT4_HASH_UNSIGNED) {
+    case EXT4_HASH_LEGACY: {
+        uint32_t hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+        for(int i = 0; i<length; ++i) {
+            int c = is_unsigned ? (uint8_t)name[i] : (signed char)name[i];
+            hash = hash1+(hash0 ^ (uint32_t)(c*7152373));
+            if(hash & 0x80000000)
+                hash -= 0x7fffffff;
+            hash1 = hash0, hash0 = hash;
+        }
+        hash = hash0<<1;
+        break;
+    }
+    case EXT4_HASH_HALF_MD4:
+        for(int i = 0; i<length; i += 32) {
+            hash_words(name+i, length-i, in, 8, is_unsigned);
+            hash_md4(buf, in);
+        }
+        hash = buf[1];
+        break;
+    default:
+        for(int i = 0; i<length; i += 16) {
+            hash_words(name+i, length-i, in, 4, is_unsigned);
+            hash_tea(buf, in);
+        }
+        hash = buf[0];
+    }
+    hash &= ~1u;
+    return hash==0xFFFFFFFE ? 0xFFFFFFFC : hash;
+}
+
+// Lookup through the hash index, -1 if the directory has to be searched
+// linearly instead.
+static int64_t ext4_htree(struct block_dev *dev, struct ext4_file *dir, const char *name, int length) {
+    struct ext4 *fs = dev->fs_data;
+    uint64_t block = ext4_dir_block(dev, dir, 0);
+    const uint8_t *p = block ? ext4_block(dev, block) : NULL;
+    // Root: "." and ".." entries, then the index info and entries. Unsigned
+    // variants of the hashes are flagged in the superblock, SipHash of
+    // encrypted and case folded directories is not supported.
+    if(!p || p[0x1D]!=8 || p[0x1E]>=EXT4_HTREE_LEVELS)
+        return -1;
+    int version = p[0x1C], levels = p[0x1E];
+    if(version<=EXT4_HASH_TEA && fs->hash_unsigned)
+        version += EXT4_HASH_UNSIGNED;
+    if(version>EXT4_HASH_TEA+EXT4_HASH_UNSIGNED)
+        return -1;
+    uint32_t hash = ext4_hash(fs, version, name, length);
+    uint32_t offset = 0x20, next_hash = 0;
+    for(int level = 0;; ++level) {
+        uint32_t limit = le16(p+offset), count = le16(p+offset+2);
+        if(!count || count>limit || offset+8*limit>fs->block_size)
+            return -1;
+        // Entry 0 holds the count and the block for hashes below entry 1.
+        uint32_t i = 1;
+        while(i<count && le32(p+offset+8*i)<=hash) ++i;
+        uint32_t logical = le32(p+offset+8*(i-1)+4);
+        if(i<count)
+            next_hash = le32(p+offset+8*i);
+        else if(level==0)
+            next_hash = 0;
+        if(!(block = ext4_dir_block(dev, dir, logical)))
+            return -1;
+        if(level==levels)
+            break;
+        // Interior nodes start with an empty entry over the whole block.
+        if(!(p = ext4_block(dev, block)))
+            return -1;
+        offset = 8;
+    }
+    uint32_t number = ext4_dir_search(ext4_block(dev, block), fs->block_size, name, length);
+    // Names of one hash may continue into the next leaf, which then has the
+    // collision bit set.
+    if(!number && (next_hash & ~1u)==hash && next_hash & 1)
+        return -1;
+    return number;
+}
+
+static uint32_t ext4_lookup(struct block_dev *dev, struct ext4_file *dir, const char *name, int length) {
+    struct ext4 *fs = dev->fs_data;
+    if(dir->inode.flags & EXT4_INLINE_DATA_FL) {
+        // The parent's number, then entries in i_block and the attribute.
+        if(length==2 && !memcmp(name, "..", 2))
+            return le32(dir->inode.block);
+        if(length==1 && *name=='.')
+            return dir->inode.number;
+        uint32_t number = ext4_dir_search(dir->inode.block+4, sizeof(dir->inode.block)-4, name, length);
+        if(!number && dir->inode.tail_size)
+            number = ext4_dir_search(block_cached(dev, dir->inode.tail, dir->inode.tail_size),
+                                     dir->inode.tail_size, name, length);
+        return number;
+    }
+    // "." and ".." are only in the index root, ahead of the index.
+    int dots = *name=='.' && length<=2 && name[length-1]=='.';
+    if(fs->dir_index && dir->inode.flags & EXT4_INDEX_FL && !(dir->inode.flags & EXT4_CASEFOLD_FL) && !dots) {
+        int64_t number = ext4_htree(dev, dir, name, length);
+        if(number>=0)
+            return number;
+    }
+    uint32_t number = 0;
+    for(uint64_t i = 0; !number && i<(dir->inode.size+fs->block_size-1)/fs->block_size; ++i) {
+        uint64_t block = ext4_dir_block(dev, dir, i);
+        if(block)
+            number = ext4_dir_search(ext4_block(dev, block), fs->block_size, name, length);
+    }
+    return number;
+}
+
+static struct ext4_file *ext4_file(struct block_dev *dev, uint32_t number) {
+    struct ext4_file *file = (struct ext4_file *)block_file_new(dev, sizeof(*file));
+    if(!file)
+        return NULL;
+    if(!ext4_inode(dev, number, &file->inode)) {
+        free(file);
+        return NULL;
+    }
+    file->base.size = file->inode.size;
+    file->base.map = ext4_map;
+    file->base.ctime = file->inode.ctime;
+    file->base.mtime = file->inode.mtime;
+    return file;
+}
+
+struct block_file *ext4_open(struct block_dev *dev, const wchar_t *name) {
+    // The path as UTF-8, in a buffer symbolic links are spliced into.
+    char *path = malloc(EXT4_PATH_MAX), *rest = path;
+    struct ext4_file *dir = path ? ext4_file(dev, EXT4_ROOT) : NULL, *file = NULL;
+    uintn_t length = 0;
+    for(const wchar_t *c = name; *c && length+3<EXT4_PATH_MAX; ++c)
+        if(*c<0x80)
+            path[length++] = *c=='\\' ? '/' : *c;
+        else if(*c<0x800)
+            path[length++] = 0xC0 | *c>>6, path[length++] = 0x80 | (*c & 0x3F);
+        else
+            path[length++] = 0xE0 | *c>>12, path[length++] = 0x80 | (*c>>6 & 0x3F),
+            path[length++] = 0x80 | (*c & 0x3F);
+    if(path)
+        path[length] = 0;
+
+    for(int links = 0; dir && *rest;) {
+        while(*rest=='/') ++rest;
+        int part = 0;
+        while(rest[part] && rest[part]!='/') ++part;
+        if(!part)
+            break;
+        uint32_t number = part<=EXT4_NAME_MAX ? ext4_lookup(dev, dir, rest, part) : 0;
+        free(file);
+        if(!number || !(file = ext4_file(dev, number)))
+            goto fail;
+        rest += part;
+        uint16_t type = file->inode.mode & EXT4_S_IFMT;
+        if(type==EXT4_S_IFLNK) {
+            // The target replaces the link in the path, absolute from the
+            // root and relative from the link's directory.
+            uintn_t target = file->inode.size, tail = strlen(rest);
+            if(++links>EXT4_LINKS_MAX || !target || target+tail+1>EXT4_PATH_MAX)
+                goto fail;
+            memmove(path+target, rest, tail+1);
+            if(target<sizeof(file->inode.block) && !(file->inode.flags & (EXT4_EXTENTS_FL|EXT4_INLINE_DATA_FL)))
+                memcpy(path, file->inode.block, target);
+            else {
+                uintn_t read = target;
+                if(EFI_ERROR(file->base.file.Read(&file->base.file, &read, path)) || read!=target)
+                    goto fail;
+            }
+            free(file), file = NULL;
+            rest = path;
+            if(*path=='/') {
+                free(dir);
+                if(!(dir = ext4_file(dev, EXT4_ROOT)))
+                    goto fail;
+            }
+            continue;
+        }
+        while(*rest=='/') ++rest;
+        if(!*rest)
+            break;
+        if(type!=EXT4_S_IFDIR)
+            goto fail;
+        free(dir);
+        dir = file, file = NULL;
+    }
+    if(!file || (file->inode.mode & EXT4_S_IFMT)!=EXT4_S_IFREG || file->inode.flags & EXT4_ENCRYPT_FL
+       || (file->inode.flags & EXT4_INLINE_DATA_FL
+           && file->inode.size>sizeof(file->inode.block)+file->inode.tail_size))
+        goto fail;
+    // The name GetInfo reports, the last component.
+    const wchar_t *leaf = name;
+    for(const wchar_t *c = name; *c; ++c)
+        if((*c=='\\' || *c=='/') && c[1])
+            leaf = c+1;
+    for(length = 0; leaf[length] && leaf[length]!='\\' && leaf[length]!='/' && length<255; ++length)
+        file->base.name[length] = leaf[length];
+    free(dir), free(path);
+    return &file->base;
+fail:
+    free(file), free(dir), free(path);
+    return NULL;
+}
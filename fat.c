@@ -0,0 +1,302 @@
+#include "sefil.h"
+
+// FAT12, FAT16 and FAT32, read only. The allocation table is kept in
+// memory, whole for FAT12 and FAT16, in FAT_WINDOW pieces loaded on first
+// use for FAT32, so following a cluster chain costs no I/O. Runs of
+// consecutive clusters are handed to block_file_read() as one extent.
+// Directories go through the block cache, names are matched against the
+// long name and the 8.3 name, ignoring ASCII case.
+enum {
+    FAT_WINDOW = 64*1024, FAT_TABLE_MAX = 32*1024*1024,
+    // Directories hold at most FAT_DIR_MAX entries, which also ends loops
+    // in corrupt cluster chains.
+    FAT_ENTRY = 32, FAT_LFN_CHARS = 13, FAT_DIR_MAX = 65536,
+    FAT_ATTR_VOLUME = 0x08, FAT_ATTR_DIRECTORY = 0x10, FAT_ATTR_LFN = 0x0F,
+    FAT_DELETED = 0xE5,
+    // EFI_UNSPECIFIED_TIMEZONE, FAT stores local time.
+    FAT_TIMEZONE = 0x07FF,
+};
+
+struct fat {
+    int bits;
+    uint32_t cluster_size;
+    uint32_t clusters;          // valid cluster numbers are 2 to clusters+1
+    uint64_t fat_offset, data_offset;
+    // Fixed root directory of FAT12 and FAT16, root_cluster on FAT32.
+    uint64_t root_offset;
+    uint32_t root_size, root_cluster;
+    uint8_t *table;
+    uint32_t table_size;
+    uint8_t *loaded;            // FAT_WINDOW bitmap, NULL when all is
+};
+
+struct fat_file {
+    struct block_file base;
+    uint32_t first;
+    // Last cluster mapped and its index in the chain.
+    uint32_t index, cluster;
+};
+
+static inline uint16_t le16(const uint8_t *p) {
+    return p[0] | p[1]<<8;
+}
+
+static inline uint32_t le32(const uint8_t *p) {
+    return p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+int fat_mount(struct block_dev *dev) {
+    const uint8_t *b = block_cached(dev, 0, 512);
+    if(!b || b[510]!=0x55 || b[511]!=0xAA || (b[0]!=0xEB && b[0]!=0xE9))
+        return 0;
+    uint32_t sector = le16(b+11), per_cluster = b[13], reserved = le16(b+14), fats = b[16];
+    uint32_t root_entries = le16(b+17), fat_sectors = le16(b+22) ? le16(b+22) : le32(b+36);
+    uint64_t sectors = le16(b+19) ? le16(b+19) : le32(b+32);
+    if(sector<512 || sector>4096 || sector & (sector-1) || !per_cluster || per_cluster & (per_cluster-1)
+       || !reserved || !fats || !fat_sectors || sectors*sector>dev->size)
+        return 0;
+
+    struct fat *fat = calloc(1, sizeof(*fat));
+    if(!fat)
+        return 0;
+    uint32_t root_sectors = (root_entries*FAT_ENTRY+sector-1)/sector;
+    uint64_t data = reserved+(uint64_t)fats*fat_sectors+root_sectors;
+    fat->cluster_size = sector*per_cluster;
+    fat->clusters = sectors>data ? (sectors-data)/per_cluster : 0;
+    fat->bits = fat->clusters<4085 ? 12 : fat->clusters<65525 ? 16 : 32;
+    fat->fat_offset = (uint64_t)reserved*sector;
+    fat->data_offset = data*sector;
+    fat->root_offset = fat->fat_offset+(uint64_t)fats*fat_sectors*sector;
+    fat->root_size = root_sectors*sector;
+    fat->root_cluster = fat->bits==32 ? le32(b+44) : 0;
+    fat->table_size = ((uint64_t)fat->clusters+2)*fat->bits/8+1;
+    if(!fat->clusters || (fat->bits==32)!=!root_entries
+       || (fat->bits==32 && (fat->root_cluster<2 || fat->root_cluster>fat->clusters+1))
+       || fat->table_size>min((uint64_t)fat_sectors*sector, FAT_TABLE_MAX)) {
+        log_printf(LOG_DEBUG, "fat: unsupported layout");
+        free(fat);
+        return 0;
+    }
+
+    // FAT32 tables go up to megabytes, of which a boot touches a few windows.
+    if(fat->bits==32 && fat->table_size>FAT_WINDOW)
+        fat->loaded = calloc(1, fat->table_size/FAT_WINDOW/8+1);
+    if(!(fat->table = malloc(fat->table_size)) || (fat->bits==32 && fat->table_size>FAT_WINDOW && !fat->loaded)
+       || (!fat->loaded && !block_read(dev, fat->fat_offset, fat->table_size, fat->table))) {
+        free(fat->table), free(fat->loaded), free(fat);
+        return 0;
+    }
+    dev->fs_data = fat;
+    log_printf(LOG_INFO, "fat: FAT%d, %d clusters of %d bytes", (int64_t)fat->bits,
+               (uint64_t)fat->clusters, (uint64_t)fat->cluster_size);
+    return 1;
+}
+
+void fat_unmount(struct block_dev *dev) {
+    struct fat *fat = dev->fs_data;
+    if(fat)
+        free(fat->table), free(fat->loaded), free(fat);
+    dev->fs_data = NULL;
+}
+
+// Cluster following cluster, 0 at the end of the chain and on free, bad
+// or out of range entries.
+static uint32_t fat_next(struct block_dev *dev, uint32_t cluster) {
+    struct fat *fat = dev->fs_data;
+    uint32_t next;
+    if(cluster<2 || cluster>fat->clusters+1)
+        return 0;
+    if(fat->bits==12) {
+        next = le16(fat->table+cluster+cluster/2);
+        next = cluster & 1 ? next>>4 : next & 0xFFF;
+    }
+    else if(fat->bits==16)
+        next = le16(fat->table+2*cluster);
+    else {
+        uint32_t window = 4*cluster/FAT_WINDOW;
+        if(fat->loaded && !(fat->loaded[window/8] & 1<<window%8)) {
+            uint32_t offset = window*FAT_WINDOW;
+            if(!block_read(dev, fat->fat_offset+offset, min(FAT_WINDOW, fat->table_size-offset),
+                           fat->table+offset))
+                return 0;
+            fat->loaded[window/8] |= 1<<window%8;
+        }
+        next = le32(fat->table+4*cluster) & 0x0FFFFFFF;
+    }
+    return next>=2 && next<=fat->clusters+1 ? next : 0;
+}
+
+static uint64_t fat_cluster_offset(struct fat *fat, uint32_t cluster) {
+    return fat->data_offset+(uint64_t)(cluster-2)*fat->cluster_size;
+}
+
+static int fat_map(struct block_file *base, uint64_t pos, uint64_t max, uint64_t *disk, uint64_t *length) {
+    struct fat_file *file = (struct fat_file *)base;
+    struct fat *fat = base->dev->fs_data;
+    uint32_t index = pos/fat->cluster_size;
+    if(index<file->index)
+        file->index = 0, file->cluster = file->first;
+    while(file->index<index) {
+        if(!(file->cluster = fat_next(base->dev, file->cluster)))
+            return 0;
+        ++file->index;
+    }
+    uint32_t skip = pos%fat->cluster_size, start = file->cluster, next;
+    if(start<2 || start>fat->clusters+1)
+        return 0;
+    uint64_t run = fat->cluster_size-skip;
+    // Clusters following each other on disk are one transfer.
+    while(run<max && (next = fat_next(base->dev, file->cluster))==file->cluster+1) {
+        file->cluster = next, ++file->index;
+        run += fat->cluster_size;
+    }
+    *disk = fat_cluster_offset(fat, start)+skip;
+    *length = run;
+    return 1;
+}
+
+// Directory entries in order, from the fixed root when cluster is 0.
+struct fat_dir {
+    uint32_t cluster, index, count;
+};
+
+static const uint8_t *fat_dir_next(struct block_dev *dev, struct fat_dir *dir) {
+    struct fat *fat = dev->fs_data;
+    if(dir->count++==FAT_DIR_MAX)
+        return NULL;
+    if(!dir->cluster) {
+        if((uint64_t)dir->index*FAT_ENTRY>=fat->root_size)
+            return NULL;
+        return block_cached(dev, fat->root_offset+dir->index++*FAT_ENTRY, FAT_ENTRY);
+    }
+    if(dir->index*FAT_ENTRY==fat->cluster_size) {
+        if(!(dir->cluster = fat_next(dev, dir->cluster)))
+            return NULL;
+        dir->index = 0;
+    }
+    return block_cached(dev, fat_cluster_offset(fat, dir->cluster)+dir->index++*FAT_ENTRY, FAT_ENTRY);
+}
+
+static int name_char(int c) {
+    return c>='a' && c<='z' ? c-'a'+'A' : c;
+}
+
+static int name_equal(const wchar_t *a, const wchar_t *b, uintn_t length) {
+    for(uintn_t i = 0; i<length; ++i)
+        if(name_char(a[i])!=name_char(b[i]))
+            return 0;
+    return !b[length];
+}
+
+// The 8.3 name of an entry as "NAME.EXT", lower case where Windows NT
+// flagged a part as such.
+static void fat_short_name(const uint8_t *entry, wchar_t *name) {
+    int length = 0;
+    for(int i = 0; i<8 && entry[i]!=' '; ++i) {
+        int c = i==0 && entry[i]==0x05 ? FAT_DELETED : entry[i];
+        name[length++] = entry[12] & 0x08 && c>='A' && c<='Z' ? c-'A'+'a' : c;
+    }
+    if(entry[8]!=' ')
+        name[length++] = '.';
+    for(int i = 8; i<11 && entry[i]!=' '; ++i)
+        name[length++] = entry[12] & 0x10 && entry[i]>='A' && entry[i]<='Z' ? entry[i]-'A'+'a' : entry[i];
+    name[length] = 0;
+}
+
+// Find the component of length characters in dir. On success entry gets a
+// copy of the entry and name its long or short name.
+static int fat_lookup(struct block_dev *dev, uint32_t cluster, const wchar_t *component, uintn_t length,
+                      uint8_t *entry, wchar_t *name) {
+    struct fat_dir dir = { cluster, 0, 0 };
+    wchar_t long_name[256];
+    int expect = -1;    // LFN piece due next, 0 after the last, -1 without
+    uint8_t checksum = 0;
+    for(const uint8_t *e; (e = fat_dir_next(dev, &dir)) && e[0];) {
+        if(e[0]==FAT_DELETED) {
+            expect = -1;
+            continue;
+        }
+        if((e[11] & 0x3F)==FAT_ATTR_LFN) {
+            int sequence = e[0] & 0x1F;
+            if(e[0] & 0x40) {
+                expect = sequence, checksum = e[13];
+                long_name[min(sequence*FAT_LFN_CHARS, 255)] = 0;
+            }
+            if(!sequence || sequence!=expect || e[13]!=checksum) {
+                expect = -1;
+                continue;
+            }
+            static const uint8_t offset[FAT_LFN_CHARS] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+            for(int i = 0; i<FAT_LFN_CHARS; ++i)
+                if((sequence-1)*FAT_LFN_CHARS+i<255)
+                    long_name[(sequence-1)*FAT_LFN_CHARS+i] = le16(e+offset[i]);
+            --expect;
+            continue;
+        }
+        int has_long = !expect;
+        expect = -1;
+        if(e[11] & FAT_ATTR_VOLUME)
+            continue;
+        uint8_t sum = 0;
+        for(int i = 0; i<11; ++i)
+            sum = ((sum & 1)<<7)+(sum>>1)+e[i];
+        // Short names are unique, so either may match.
+        if(has_long && sum==checksum && name_equal(component, long_name, length))
+            memcpy(name, long_name, sizeof(long_name));
+        else {
+            fat_short_name(e, name);
+            if(!name_equal(component, name, length))
+                continue;
+        }
+        memcpy(entry, e, FAT_ENTRY);
+        return 1;
+    }
+    return 0;
+}
+
+static efi_time_t fat_time(uint16_t date, uint16_t time, int tenths) {
+    return (efi_time_t){
+        .Year = 1980+(date>>9), .Month = date>>5 & 15, .Day = date & 31,
+        .Hour = time>>11, .Minute = time>>5 & 63, .Second = (time & 31)*2+tenths/100,
+        .TimeZone = FAT_TIMEZONE,
+    };
+}
+
+struct block_file *fat_open(struct block_dev *dev, const wchar_t *path) {
+    struct fat *fat = dev->fs_data;
+    uint32_t cluster = fat->root_cluster;
+    uint8_t entry[FAT_ENTRY];
+    wchar_t name[256];
+    int found = 0;
+    while(*path) {
+        while(*path=='\\' || *path=='/') ++path;
+        uintn_t length = 0;
+        while(path[length] && path[length]!='\\' && path[length]!='/') ++length;
+        if(!length)
+            break;
+        if(found && !(entry[11] & FAT_ATTR_DIRECTORY))
+            return NULL;
+        if(!fat_lookup(dev, cluster, path, length, entry, name))
+            return NULL;
+        found = 1;
+        // ".." of a directory in the root holds cluster 0.
+        cluster = (fat->bits==32 ? le16(entry+20)<<16 : 0) | le16(entry+26);
+        if(!cluster && entry[11] & FAT_ATTR_DIRECTORY)
+            cluster = fat->root_cluster;
+        path += length;
+    }
+    // Directories stay with the firmware.
+    if(!found || entry[11] & FAT_ATTR_DIRECTORY)
+        return NULL;
+
+    struct fat_file *file = (struct fat_file *)block_file_new(dev, sizeof(*file));
+    if(!file)
+        return NULL;
+    file->base.size = le32(entry+28);
+    file->base.map = fat_map;
+    file->base.ctime = fat_time(le16(entry+16), le16(entry+14), entry[13]);
+    file->base.mtime = fat_time(le16(entry+24), le16(entry+22), 0);
+    memcpy(file->base.name, name, sizeof(name));
+    file->first = file->cluster = cluster;
+    return &file->base;
+}
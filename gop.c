@@ -0,0 +1,339 @@
+#include "sefil.h"
+
+// HII Font protocol, only GetGlyph is used to fill the glyph atlas.
+#define EFI_HII_FONT_PROTOCOL_GUID { 0xe9ca4775, 0x8657, 0x47fc, {0x97, 0xe7, 0x7e, 0xd6, 0x5a, 0x08, 0x43, 0x24} }
+
+typedef struct {
+    uint16_t Width;
+    uint16_t Height;
+    uint32_t *Bitmap;
+} efi_image_output_t;
+
+typedef efi_status_t (EFIAPI *efi_hii_get_glyph_t)(void *This, wchar_t Char, void *StringInfo,
+    efi_image_output_t **Blt, uintn_t *Baseline);
+
+typedef struct {
+    void                    *StringToImage;
+    void                    *StringIdToImage;
+    efi_hii_get_glyph_t     GetGlyph;
+    void                    *GetFontInfo;
+} efi_hii_font_t;
+
+// EFI text colors as Blt pixels, the EDK2 GraphicsConsole palette.
+static const uint32_t gop_palette[16] = {
+    0x000000, 0x000098, 0x009800, 0x009898, 0x980000, 0x980098, 0x986500, 0x989898,
+    0x303030, 0x0000ff, 0x00ff00, 0x00ffff, 0xff0000, 0xff00ff, 0xffff00, 0xffffff
+};
+
+// Glyphs drawn procedurally so borders join up at every scale.
+enum { ARM_L = 1, ARM_R = 2, ARM_U = 4, ARM_D = 8, SHAPE_UP = 16, SHAPE_DOWN = 32, SHAPE_BLOCK = 64 };
+static const struct { wchar_t c; uint8_t shape; } gop_shapes[] = {
+    { BOXDRAW_HORIZONTAL, ARM_L|ARM_R },
+    { BOXDRAW_VERTICAL, ARM_U|ARM_D },
+    { BOXDRAW_DOWN_RIGHT, ARM_D|ARM_R },
+    { BOXDRAW_DOWN_LEFT, ARM_D|ARM_L },
+    { BOXDRAW_UP_RIGHT, ARM_U|ARM_R },
+    { BOXDRAW_UP_LEFT, ARM_U|ARM_L },
+    { BOXDRAW_VERTICAL_RIGHT, ARM_U|ARM_D|ARM_R },
+    { BOXDRAW_VERTICAL_LEFT, ARM_U|ARM_D|ARM_L },
+    { BOXDRAW_DOWN_HORIZONTAL, ARM_L|ARM_R|ARM_D },
+    { BOXDRAW_UP_HORIZONTAL, ARM_L|ARM_R|ARM_U },
+    { BOXDRAW_VERTICAL_HORIZONTAL, ARM_L|ARM_R|ARM_U|ARM_D },
+    { ARROW_UP, SHAPE_UP },
+    { ARROW_DOWN, SHAPE_DOWN },
+    { BLOCKELEMENT_FULL_BLOCK, SHAPE_BLOCK },
+};
+// Latin-1 from the firmware font, then the shapes. Anything else is '?'.
+enum { GLYPH_SLOTS = 0x100+sizeof(gop_shapes)/sizeof(*gop_shapes) };
+
+// Off-screen back buffer in Blt pixel layout with the text grid centered in
+// it. cell mirrors what the buffer shows, dirty holds the changed column
+// span of each row until the next present.
+struct {
+    efi_gop_t *gop;
+    efi_hii_font_t *font;
+    uint32_t width, height;
+    uint32_t *buffer;
+    uintn_t pages;
+    int cols, rows, left, top;
+    int cell_w, cell_h, scale;
+    uint32_t glyph_bg;
+    int col, row;
+    struct gop_cell { wchar_t c; uint8_t attr; } *cell;
+    struct { int16_t lo, hi; } *dirty;
+    uint8_t *atlas, *ready;
+} gop;
+
+static void glyph_rect(uint8_t *g, int x0, int y0, int x1, int y1) {
+    x0 = max(x0, 0), y0 = max(y0, 0);
+    x1 = min(x1, gop.cell_w), y1 = min(y1, gop.cell_h);
+    for(int y = y0; y<y1; ++y)
+        for(int x = x0; x<x1; ++x)
+            g[y*gop.cell_w+x] = 1;
+}
+
+static void glyph_shape(uint8_t *g, int shape) {
+    int w = gop.cell_w, h = gop.cell_h, t = gop.scale;
+    int cx = (w-t)/2, cy = (h-t)/2;
+    if(shape & ARM_L) glyph_rect(g, 0, cy, cx+t, cy+t);
+    if(shape & ARM_R) glyph_rect(g, cx, cy, w, cy+t);
+    if(shape & ARM_U) glyph_rect(g, cx, 0, cx+t, cy+t);
+    if(shape & ARM_D) glyph_rect(g, cx, cy, cx+t, h);
+    if(shape & SHAPE_BLOCK) glyph_rect(g, 0, 0, w, h);
+    if(shape & (SHAPE_UP|SHAPE_DOWN)) {
+        // Stem with a triangular head, the down arrow is the up one flipped.
+        int y0 = h/4;
+        for(int i = 0; i<w/2; ++i)
+            glyph_rect(g, cx-i, y0+i, cx+t+i, y0+i+1);
+        glyph_rect(g, cx, y0, cx+t, h-y0);
+        if(shape & SHAPE_DOWN)
+            for(int y = 0; y<h/2; ++y)
+                for(int x = 0; x<w; ++x) {
+                    uint8_t swap = g[y*w+x];
+                    g[y*w+x] = g[(h-1-y)*w+x];
+                    g[(h-1-y)*w+x] = swap;
+                }
+    }
+}
+
+// Coverage from the firmware bitmap, scaled up by pixel replication.
+static void glyph_hii(uint8_t *g, wchar_t c) {
+    efi_image_output_t *image = NULL;
+    uintn_t baseline;
+    ++con_stats.calls;
+    if(EFI_ERROR(gop.font->GetGlyph(gop.font, c, NULL, &image, &baseline)) || !image)
+        return;
+    if(image->Bitmap) {
+        int w = min(image->Width*gop.scale, gop.cell_w);
+        int h = min(image->Height*gop.scale, gop.cell_h);
+        for(int y = 0; y<h; ++y)
+            for(int x = 0; x<w; ++x) {
+                uint32_t pixel = image->Bitmap[y/gop.scale*image->Width+x/gop.scale];
+                g[y*gop.cell_w+x] = (pixel & 0xffffff)!=gop.glyph_bg;
+            }
+        BS->FreePool(image->Bitmap);
+    }
+    BS->FreePool(image);
+}
+
+// Atlas slot of c, rasterized on first use.
+static uint8_t *gop_glyph(wchar_t c) {
+    int slot = c<0x100 ? c : '?';
+    for(int i = 0; c>=0x100 && i<GLYPH_SLOTS-0x100; ++i)
+        if(gop_shapes[i].c==c)
+            slot = 0x100+i;
+    uint8_t *g = gop.atlas+slot*gop.cell_w*gop.cell_h;
+    if(!gop.ready[slot]) {
+        memset(g, 0, gop.cell_w*gop.cell_h);
+        if(slot<0x100)
+            glyph_hii(g, slot);
+        else
+            glyph_shape(g, gop_shapes[slot-0x100].shape);
+        gop.ready[slot] = 1;
+    }
+    return g;
+}
+
+static void gop_clean(int row) {
+    gop.dirty[row].lo = 0x7fff, gop.dirty[row].hi = -1;
+}
+
+static void gop_dirty(int row, int lo, int hi) {
+    gop.dirty[row].lo = min(gop.dirty[row].lo, lo);
+    gop.dirty[row].hi = max(gop.dirty[row].hi, hi);
+}
+
+static void gop_draw(int col, int row, wchar_t c, int attr) {
+    struct gop_cell *cell = &gop.cell[row*gop.cols+col];
+    if(cell->c==c && cell->attr==attr)
+        return;
+    cell->c = c, cell->attr = attr;
+
+    const uint8_t *g = gop_glyph(c);
+    uint32_t fg = gop_palette[attr & 0xF], bg = gop_palette[attr>>4 & 0x7];
+    uint32_t *p = gop.buffer+(gop.top+row*gop.cell_h)*gop.width+gop.left+col*gop.cell_w;
+    for(int y = 0; y<gop.cell_h; ++y, p += gop.width, g += gop.cell_w)
+        for(int x = 0; x<gop.cell_w; ++x)
+            p[x] = g[x] ? fg : bg;
+    gop_dirty(row, col, col);
+}
+
+// Scroll the grid up one row like the text console does.
+static void gop_scroll(int attr) {
+    uint32_t *grid = gop.buffer+gop.top*gop.width, band = gop.cell_h*gop.width;
+    memmove(grid, grid+band, (gop.rows-1)*band*sizeof(*grid));
+    uint32_t bg = gop_palette[attr>>4 & 0x7], *last = grid+(gop.rows-1)*band;
+    for(uint32_t i = 0; i<band; ++i) last[i] = bg;
+
+    memmove(gop.cell, gop.cell+gop.cols, (gop.rows-1)*gop.cols*sizeof(*gop.cell));
+    for(int i = 0; i<gop.cols; ++i)
+        gop.cell[(gop.rows-1)*gop.cols+i] = (struct gop_cell){ ' ', attr };
+    for(int row = 0; row<gop.rows; ++row)
+        gop_dirty(row, 0, gop.cols-1);
+}
+
+static void gop_clear(int attr) {
+    uint32_t bg = gop_palette[attr>>4 & 0x7];
+    for(uint32_t i = 0; i<gop.width*gop.height; ++i) gop.buffer[i] = bg;
+    for(int i = 0; i<gop.cols*gop.rows; ++i)
+        gop.cell[i] = (struct gop_cell){ ' ', attr };
+    for(int row = 0; row<gop.rows; ++row)
+        gop_clean(row);
+    gop.col = gop.row = 0;
+    // The screen is filled directly, only later changes go through the buffer.
+    ++con_stats.calls;
+    EE(gop.gop->Blt(gop.gop, &bg, EfiBltVideoFill, 0, 0, 0, 0, gop.width, gop.height, 0)) {}
+}
+
+static void gop_position(int col, int row) {
+    gop.col = min(col, gop.cols), gop.row = min(row, gop.rows-1);
+}
+
+static void gop_output(int attr, wchar_t *str, int len) {
+    for(int i = 0; i<len; ++i) {
+        wchar_t c = str[i];
+        if(c=='\r') {
+            gop.col = 0;
+            continue;
+        }
+        if(c=='\n' || gop.col==gop.cols) {
+            if(gop.row==gop.rows-1)
+                gop_scroll(attr);
+            else
+                ++gop.row;
+            if(c=='\n')
+                continue;
+            gop.col = 0;
+        }
+        gop_draw(gop.col++, gop.row, c, attr);
+    }
+}
+
+// One Blt per run of consecutive dirty rows.
+static void gop_present() {
+    for(int row = 0; row<gop.rows;) {
+        if(gop.dirty[row].hi<0) {
+            ++row;
+            continue;
+        }
+        int first = row, lo = gop.dirty[row].lo, hi = gop.dirty[row].hi;
+        for(; row<gop.rows && gop.dirty[row].hi>=0; ++row) {
+            lo = min(lo, gop.dirty[row].lo), hi = max(hi, gop.dirty[row].hi);
+            gop_clean(row);
+        }
+        uintn_t x = gop.left+lo*gop.cell_w, y = gop.top+first*gop.cell_h;
+        ++con_stats.calls;
+        EE(gop.gop->Blt(gop.gop, gop.buffer, EfiBltBufferToVideo, x, y, x, y,
+                        (hi-lo+1)*gop.cell_w, (row-first)*gop.cell_h,
+                        gop.width*sizeof(*gop.buffer))) {}
+    }
+}
+
+// The native mode is the EDID preferred timing if a mode matches it, else
+// the largest one.
+static void gop_mode_native() {
+    efi_guid_t edid_guid = EFI_EDID_ACTIVE_GUID;
+    efi_edid_t *edid;
+    uint32_t want_w = 0, want_h = 0;
+    if(!EFI_ERROR(BS->LocateProtocol(&edid_guid, NULL, (void **)&edid)) && edid->SizeOfEdid>=128) {
+        // First detailed timing descriptor, a zero pixel clock means none.
+        uint8_t *dtd = edid->Edid+54;
+        if(dtd[0] || dtd[1])
+            want_w = dtd[2] | (dtd[4] & 0xF0)<<4, want_h = dtd[5] | (dtd[7] & 0xF0)<<4;
+    }
+
+    uint32_t best = gop.gop->Mode->Mode;
+    uint64_t best_area = 0;
+    for(uint32_t mode = 0; mode<gop.gop->Mode->MaxMode; ++mode) {
+        efi_gop_mode_info_t *info;
+        uintn_t size;
+        if(EFI_ERROR(gop.gop->QueryMode(gop.gop, mode, &size, &info)))
+            continue;
+        uint32_t w = info->HorizontalResolution, h = info->VerticalResolution;
+        BS->FreePool(info);
+        if(w==want_w && h==want_h) {
+            best = mode;
+            break;
+        }
+        if((uint64_t)w*h>best_area)
+            best = mode, best_area = (uint64_t)w*h;
+    }
+    if(best!=gop.gop->Mode->Mode)
+        EE(gop.gop->SetMode(gop.gop, best)) {}
+}
+
+static void gop_release() {
+    free(gop.cell), free(gop.dirty), free(gop.atlas), free(gop.ready);
+    gop.cell = NULL, gop.dirty = NULL, gop.atlas = gop.ready = NULL;
+    if(gop.buffer)
+        BS->FreePages((efi_physical_address_t)(uintn_t)gop.buffer, gop.pages);
+    gop.buffer = NULL;
+}
+
+// Text mode is used if GOP or the firmware font is missing.
+static int gop_init(int *cols, int *rows, int *col, int *row) {
+    efi_guid_t gop_guid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
+    efi_guid_t font_guid = EFI_HII_FONT_PROTOCOL_GUID;
+    // Plain calls, a missing protocol only selects the text backend.
+    if(EFI_ERROR(BS->LocateProtocol(&gop_guid, NULL, (void **)&gop.gop))
+       || EFI_ERROR(BS->LocateProtocol(&font_guid, NULL, (void **)&gop.font)))
+        return 0;
+
+    // The space glyph gives the cell size and the font background color.
+    efi_image_output_t *space = NULL;
+    uintn_t baseline;
+    if(EFI_ERROR(gop.font->GetGlyph(gop.font, ' ', NULL, &space, &baseline)) || !space)
+        return 0;
+    int glyph_w = space->Width, glyph_h = space->Height;
+    if(space->Bitmap) {
+        gop.glyph_bg = space->Bitmap[0] & 0xffffff;
+        BS->FreePool(space->Bitmap);
+    }
+    else glyph_w = 0;
+    BS->FreePool(space);
+    if(!glyph_w || !glyph_h)
+        return 0;
+
+    gop_mode_native();
+    gop.width = gop.gop->Mode->Information->HorizontalResolution;
+    gop.height = gop.gop->Mode->Information->VerticalResolution;
+    // Integer scale keeping at least an 80x25 grid.
+    gop.scale = max(1, min(gop.width/(80*glyph_w), gop.height/(25*glyph_h)));
+    gop.cell_w = glyph_w*gop.scale, gop.cell_h = glyph_h*gop.scale;
+    gop.cols = gop.width/gop.cell_w, gop.rows = gop.height/gop.cell_h;
+    gop.left = (gop.width-gop.cols*gop.cell_w)/2;
+    gop.top = (gop.height-gop.rows*gop.cell_h)/2;
+    if(!gop.cols || !gop.rows)
+        return 0;
+
+    efi_physical_address_t buffer;
+    gop.pages = EFI_SIZE_TO_PAGES((uintn_t)gop.width*gop.height*sizeof(*gop.buffer));
+    EE(BS->AllocatePages(AllocateAnyPages, EfiLoaderData, gop.pages, &buffer))
+        return 0;
+    gop.buffer = (uint32_t *)(uintn_t)buffer;
+    gop.cell = malloc(gop.cols*gop.rows*sizeof(*gop.cell));
+    gop.dirty = malloc(gop.rows*sizeof(*gop.dirty));
+    gop.atlas = malloc(GLYPH_SLOTS*gop.cell_w*gop.cell_h);
+    gop.ready = calloc(GLYPH_SLOTS, 1);
+    if(!gop.cell || !gop.dirty || !gop.atlas || !gop.ready)
+        return gop_release(), 0;
+
+    // Printable ASCII and the shapes up front, the rest of Latin-1 on use.
+    for(wchar_t c = ' '; c<0x7F; ++c)
+        gop_glyph(c);
+    for(int i = 0; i<GLYPH_SLOTS-0x100; ++i)
+        gop_glyph(gop_shapes[i].c);
+
+    // The firmware console shares the screen, keep its cursor off it.
+    ST->ConOut->EnableCursor(ST->ConOut, 0);
+    gop_clear(EFI_TEXT_ATTR(EFI_LIGHTGRAY, EFI_BLACK));
+    log_printf(LOG_INFO, "gop: %dx%d, %dx%d cells", (uint64_t)gop.width, (uint64_t)gop.height,
+               (int64_t)gop.cols, (int64_t)gop.rows);
+    *cols = gop.cols, *rows = gop.rows;
+    *col = *row = 0;
+    return 1;
+}
+
+struct con_backend con_gop = {
+    gop_init, gop_clear, gop_position, gop_output, gop_present, NULL, NULL
+};
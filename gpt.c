@@ -0,0 +1,473 @@
+#include "sefil.h"
+
+// GPT partition tables of all disks, read into an index by unique and by
+// type GUID, so a PARTUUID= or PARTTYPE= path resolves by lookup rather
+// than by walking the device path of every BlockIo handle. Each table comes
+// in one transfer, protective MBR, header and the usual 16 KiB entry array
+// together, and header and array are checked against their CRC32. A table
+// failing either is replaced by the backup at the end of the disk.
+//
+// Disks are probed while the menu shows. Every disk with BlockIo2 has its
+// table read at once, then the boot sector of each ESP on it, so slow disks
+// overlap instead of adding up. Disks with only BlockIo are read one per
+// idle tick, and ESPs whose boot sector shows FAT are handed to the menu
+// one per tick as they turn up. A lookup in the index first finishes the
+// tables still missing synchronously.
+#define EFI_BLOCK_IO2_PROTOCOL_GUID { 0xa77b2472, 0xe282, 0x4e9f, {0xa2, 0x45, 0xc2, 0xc0, 0xe2, 0x7b, 0xbc, 0xc1} }
+
+typedef struct {
+    efi_event_t Event;
+    efi_status_t TransactionStatus;
+} efi_block_io2_token_t;
+
+typedef struct efi_block_io2_s efi_block_io2_t;
+struct efi_block_io2_s {
+    efi_block_io_media_t *Media;
+    void *Reset;
+    efi_status_t (EFIAPI *ReadBlocksEx)(efi_block_io2_t *This, uint32_t MediaId, efi_lba_t LBA,
+                                        efi_block_io2_token_t *Token, uintn_t BufferSize, void *Buffer);
+    void *WriteBlocksEx, *FlushBlocksEx;
+};
+
+enum {
+    GPT_HEADER_MIN = 92, GPT_ENTRY_MIN = 128, GPT_PROTECTIVE = 0xEE,
+    GPT_ARRAY_MIN = 16384, GPT_ARRAY_MAX = 1024*1024,
+    GPT_BUCKETS = 64,
+};
+
+// Table not read, table or ESP boot sector read in flight, ESP to hand
+// out, nothing left.
+enum { PROBE_QUEUED, PROBE_TABLE, PROBE_SECTOR, PROBE_FOUND, PROBE_DONE };
+
+struct probe {
+    efi_handle_t handle;
+    struct block_dev *dev;
+    efi_block_io2_t *bio2;
+    efi_block_io2_token_t token;
+    uint8_t *window;
+    uint64_t blocks;
+    struct partition *esp;
+    int state;
+};
+
+// A partition handle of the firmware, by the GUID in its device path.
+struct partition_handle {
+    efi_handle_t handle;
+    efi_guid_t uuid;
+    uint64_t first, size;
+    uint32_t number, attached;
+};
+
+int probe_enabled = 1;
+static efi_guid_t esp_type = { 0xc12a7328, 0xf81f, 0x11d2, {0xba, 0x4b, 0x00, 0xa0, 0xc9, 0x3e, 0xc9, 0x3b} };
+
+struct {
+    int listed, complete, count, disks, probes, handles;
+    struct partition *by_uuid[GPT_BUCKETS], *by_type[GPT_BUCKETS];
+    struct probe *probe;
+    struct partition_handle *handle;
+    uint64_t start;
+} partitions;
+
+static inline uint16_t le16(const uint8_t *p) {
+    return p[0] | p[1]<<8;
+}
+
+static inline uint32_t le32(const uint8_t *p) {
+    return p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+static inline uint64_t le64(const uint8_t *p) {
+    return le32(p) | (uint64_t)le32(p+4)<<32;
+}
+
+// FNV-1a over the GUID, type GUIDs share no structure worth exploiting.
+static uint32_t guid_bucket(const efi_guid_t *guid) {
+    const uint8_t *p = (const uint8_t *)guid;
+    uint32_t hash = 2166136261u;
+    for(uintn_t i = 0; i<sizeof(*guid); ++i)
+        hash = (hash ^ p[i])*16777619u;
+    return hash%GPT_BUCKETS;
+}
+
+// Position of a disk in the firmware's handle order, tables finish in any.
+static int probe_index(efi_handle_t disk) {
+    int i = 0;
+    while(i<partitions.probes && partitions.probe[i].handle!=disk) ++i;
+    return i;
+}
+
+// Chained in disk order, so partitions of a type come in the order the
+// firmware lists the disks. The firmware's handle for it is attached if
+// there is one.
+static void partition_add(struct partition *partition) {
+    struct partition **uuid = &partitions.by_uuid[guid_bucket(&partition->uuid)];
+    struct partition **type = &partitions.by_type[guid_bucket(&partition->type)];
+    int index = probe_index(partition->disk);
+    while(*uuid) uuid = &(*uuid)->next_uuid;
+    while(*type && probe_index((*type)->disk)<=index) type = &(*type)->next_type;
+    partition->next_type = *type;
+    *uuid = *type = partition;
+    ++partitions.count;
+    for(int i = 0; i<partitions.handles && !partition->handle; ++i) {
+        struct partition_handle *handle = &partitions.handle[i];
+        if(!handle->attached && !memcmp(&handle->uuid, &partition->uuid, sizeof(handle->uuid)))
+            partition->handle = handle->handle, handle->attached = 1;
+    }
+}
+
+static struct partition *partition_next(const efi_guid_t *type, struct partition *after) {
+    for(struct partition *p = after ? after->next_type : partitions.by_type[guid_bucket(type)]; p;
+        p = p->next_type)
+        if(!memcmp(&p->type, type, sizeof(*type)))
+            return p;
+    return NULL;
+}
+
+static int gpt_crc(void *data, uintn_t size, uint32_t expected) {
+    uint32_t crc;
+    EE(BS->CalculateCrc32(data, size, &crc))
+        return 0;
+    return crc==expected;
+}
+
+// The header at lba in window and its entry array, NULL unless both match
+// their CRC. The array is read on its own if it lies outside the window.
+static uint8_t *gpt_header(struct block_dev *dev, uint8_t *window, uint64_t window_lba, uint64_t blocks,
+                           uint64_t lba, uint8_t **array, int *allocated) {
+    uint8_t *header = window+(lba-window_lba)*dev->block_size;
+    uint32_t size = le32(header+12), crc = le32(header+16);
+    if(memcmp(header, "EFI PART", 8) || size<GPT_HEADER_MIN || size>dev->block_size || le64(header+24)!=lba)
+        return NULL;
+    // The CRC covers the header with its own field zeroed.
+    memset(header+16, 0, 4);
+    int valid = gpt_crc(header, size, crc);
+    memcpy(header+16, &crc, 4);
+    uint64_t first = le64(header+72), array_size = (uint64_t)le32(header+80)*le32(header+84);
+    uint64_t array_blocks = (array_size+dev->block_size-1)/dev->block_size;
+    if(!valid || le32(header+84)<GPT_ENTRY_MIN || le32(header+84)%8 || !array_size || array_size>GPT_ARRAY_MAX)
+        return NULL;
+    *allocated = first<window_lba || first+array_blocks>window_lba+blocks;
+    if(!*allocated)
+        *array = window+(first-window_lba)*dev->block_size;
+    else if(!(*array = malloc(array_size)))
+        return NULL;
+    if((*allocated && !block_read(dev, first*dev->block_size, array_size, *array))
+       || !gpt_crc(*array, array_size, le32(header+88))) {
+        if(*allocated)
+            free(*array);
+        return NULL;
+    }
+    return header;
+}
+
+// Index the partition table in the probe's window, read from LBA 0.
+static void gpt_table(struct probe *probe) {
+    struct block_dev *dev = probe->dev;
+    uint8_t *window = probe->window, *array, *header = NULL;
+    uint32_t block = dev->block_size;
+    uint64_t blocks = probe->blocks, last = dev->size/block-1;
+    int protective = 0, allocated;
+    for(int i = 0; i<4; ++i)
+        protective |= window[446+16*i+4]==GPT_PROTECTIVE;
+    if(le16(window+510)!=0xAA55 || !protective)
+        return;
+    if(!(header = gpt_header(dev, window, 0, blocks, 1, &array, &allocated))) {
+        // The backup header is the last block, its array right before it.
+        log_printf(LOG_WARN, "gpt: primary table damaged, using the backup");
+        if(block_read(dev, (last-blocks+2)*block, (blocks-1)*block, window))
+            header = gpt_header(dev, window, last-blocks+2, blocks-1, last, &array, &allocated);
+        if(!header) {
+            log_printf(LOG_ERROR, "gpt: backup table damaged too");
+            return;
+        }
+    }
+    uint32_t entries = le32(header+80), entry_size = le32(header+84);
+    for(uint32_t i = 0; i<entries; ++i) {
+        const uint8_t *entry = array+(uint64_t)i*entry_size;
+        struct partition *partition;
+        // Unused entries have a zero type.
+        if(!le64(entry) && !le64(entry+8))
+            continue;
+        if(!(partition = calloc(1, sizeof(*partition))))
+            break;
+        memcpy(&partition->type, entry, sizeof(partition->type));
+        memcpy(&partition->uuid, entry+16, sizeof(partition->uuid));
+        partition->disk = probe->handle;
+        partition->first = le64(entry+32), partition->last = le64(entry+40);
+        partition->number = i+1;
+        for(int c = 0; c<PARTITION_NAME_MAX; ++c)
+            partition->name[c] = le16(entry+56+2*c);
+        partition_add(partition);
+    }
+    ++partitions.disks;
+    if(allocated)
+        free(array);
+}
+
+// Handles of whole disks to probe, and of partitions with the GUID from
+// their HardDrive device path node.
+static void probe_list() {
+    efi_guid_t dp_guid = EFI_DEVICE_PATH_PROTOCOL_GUID, bio2_guid = EFI_BLOCK_IO2_PROTOCOL_GUID;
+    efi_handle_t *handles;
+    uintn_t count;
+    if(partitions.listed)
+        return;
+    partitions.listed = 1;
+    partitions.start = rdtsc();
+    EE(BS->LocateHandleBuffer(ByProtocol, &block_io_guid, NULL, &count, &handles))
+        return;
+    partitions.probe = calloc(count, sizeof(*partitions.probe));
+    partitions.handle = calloc(count, sizeof(*partitions.handle));
+    for(uintn_t i = 0; i<count && partitions.probe && partitions.handle; ++i) {
+        efi_block_io_t *bio;
+        efi_device_path_t *node, *last = NULL;
+        if(EFI_ERROR(BS->HandleProtocol(handles[i], &block_io_guid, (void **)&bio)))
+            continue;
+        if(!bio->Media->LogicalPartition) {
+            struct probe *probe = &partitions.probe[partitions.probes];
+            if(!(probe->dev = block_get(handles[i])))
+                continue;
+            probe->handle = handles[i];
+            // Asynchronous reads need no bounce buffer, see probe_window().
+            if(probe->dev->io_align<=EFI_PAGE_SIZE
+               && EFI_ERROR(BS->HandleProtocol(handles[i], &bio2_guid, (void **)&probe->bio2)))
+                probe->bio2 = NULL;
+            ++partitions.probes;
+            continue;
+        }
+        if(EFI_ERROR(BS->HandleProtocol(handles[i], &dp_guid, (void **)&node)))
+            continue;
+        for(; !IsDevicePathEnd(node); node = NextDevicePathNode(node))
+            last = node;
+        // HardDrive node: the signature at 24, its type at 41, 2 for GPT.
+        const uint8_t *hd = (const uint8_t *)last;
+        if(!last || DevicePathType(last)!=MEDIA_DEVICE_PATH || DevicePathSubType(last)!=MEDIA_HARDDRIVE_DP
+           || DevicePathNodeLength(last)<42 || hd[41]!=2)
+            continue;
+        struct partition_handle *handle = &partitions.handle[partitions.handles++];
+        handle->handle = handles[i];
+        memcpy(&handle->uuid, hd+24, sizeof(handle->uuid));
+        handle->number = le32(hd+4), handle->first = le64(hd+8), handle->size = le64(hd+16);
+    }
+    BS->FreePool(handles);
+}
+
+// Page aligned, for the table and later each ESP boot sector.
+static int probe_window(struct probe *probe) {
+    uint32_t block = probe->dev->block_size;
+    probe->blocks = 2+(GPT_ARRAY_MIN+block-1)/block;
+    if(probe->window)
+        return 1;
+    efi_physical_address_t pages;
+    if(probe->dev->size/block<=2*probe->blocks
+       || EFI_ERROR(BS->AllocatePages(AllocateAnyPages, EfiLoaderData,
+                                      EFI_SIZE_TO_PAGES(probe->blocks*block), &pages)))
+        return 0;
+    probe->window = (uint8_t *)(uintn_t)pages;
+    return 1;
+}
+
+static int probe_read(struct probe *probe, uint64_t lba, uint64_t blocks) {
+    probe->token.TransactionStatus = EFI_SUCCESS;
+    EE(probe->bio2->ReadBlocksEx(probe->bio2, probe->dev->media_id, lba, &probe->token,
+                                 blocks*probe->dev->block_size, probe->window))
+        return 0;
+    return 1;
+}
+
+// On to the next ESP of the disk the firmware made a handle for. Its boot
+// sector is read right away where that is asynchronous, otherwise the ESP
+// is handed out unchecked.
+static void probe_release(struct probe *probe) {
+    if(probe->window)
+        BS->FreePages((efi_physical_address_t)(uintn_t)probe->window,
+                      EFI_SIZE_TO_PAGES(probe->blocks*probe->dev->block_size));
+    probe->window = NULL;
+}
+
+static void probe_next(struct probe *probe) {
+    do probe->esp = partition_next(&esp_type, probe->esp);
+    while(probe->esp && (probe->esp->disk!=probe->handle || !probe->esp->handle));
+    if(probe->esp && probe_enabled) {
+        int async = probe->bio2 && probe->token.Event && probe_read(probe, probe->esp->first, 1);
+        probe->state = async ? PROBE_SECTOR : PROBE_FOUND;
+        return;
+    }
+    probe->state = PROBE_DONE;
+    probe_release(probe);
+}
+
+static void probe_table(struct probe *probe) {
+    if(probe->state==PROBE_TABLE
+       || block_read(probe->dev, 0, probe->blocks*probe->dev->block_size, probe->window))
+        gpt_table(probe);
+    probe->esp = NULL;
+    probe_next(probe);
+}
+
+// A read in flight finished, or has to be waited for.
+static void probe_complete(struct probe *probe) {
+    if(EFI_ERROR(probe->token.TransactionStatus)) {
+        log_printf(LOG_WARN, "gpt: read failed, %x", (uint64_t)probe->token.TransactionStatus);
+        // The table is read again synchronously.
+        if(probe->state==PROBE_TABLE)
+            probe->bio2 = NULL, probe->state = PROBE_QUEUED;
+        else
+            probe_next(probe);
+        return;
+    }
+    if(probe->state==PROBE_TABLE)
+        probe_table(probe);
+    // Only FAT is a valid ESP file system.
+    else if(le16(probe->window+510)!=0xAA55
+            || (memcmp(probe->window+54, "FAT", 3) && memcmp(probe->window+82, "FAT", 3)))
+        probe_next(probe);
+    else
+        probe->state = PROBE_FOUND;
+}
+
+static void probe_wait(struct probe *probe) {
+    uintn_t index;
+    if(probe->state!=PROBE_TABLE && probe->state!=PROBE_SECTOR)
+        return;
+    EE(BS->WaitForEvent(1, &probe->token.Event, &index))
+        probe->token.TransactionStatus = ECS;
+    probe_complete(probe);
+}
+
+// Partition handles left over are of tables sefil could not read, indexed
+// without a type once every table is done.
+static void probe_finish() {
+    if(partitions.complete)
+        return;
+    partitions.complete = 1;
+    for(int i = 0; i<partitions.handles; ++i) {
+        struct partition_handle *handle = &partitions.handle[i];
+        struct partition *partition;
+        if(handle->attached || !(partition = calloc(1, sizeof(*partition))))
+            continue;
+        partition->uuid = handle->uuid;
+        partition->first = handle->first, partition->last = handle->first+handle->size-1;
+        partition->number = handle->number;
+        partition_add(partition);
+        partition->handle = handle->handle, handle->attached = 1;
+    }
+    log_printf(LOG_INFO, "gpt: %d partitions on %d disks in %d us", (int64_t)partitions.count,
+               (int64_t)partitions.disks, tsc_to_us(rdtsc()-partitions.start));
+}
+
+// Read the table of a disk without BlockIo2, or of one whose asynchronous
+// read failed.
+static void probe_sync(struct probe *probe) {
+    if(probe_window(probe))
+        probe_table(probe);
+    else
+        probe->state = PROBE_DONE;
+}
+
+// Issue the table reads of every disk with BlockIo2. 0 if there is nothing
+// left to do in the background.
+int probe_start() {
+    int busy = 0;
+    probe_list();
+    for(int i = 0; i<partitions.probes; ++i) {
+        struct probe *probe = &partitions.probe[i];
+        // A disk whose read cannot be issued is read synchronously later.
+        if(probe->state==PROBE_QUEUED && probe->bio2) {
+            if(probe_window(probe)
+               && (probe->token.Event || !EFI_ERROR(BS->CreateEvent(0, 0, NULL, NULL, &probe->token.Event)))
+               && probe_read(probe, 0, probe->blocks))
+                probe->state = PROBE_TABLE;
+            else
+                probe->bio2 = NULL;
+        }
+        busy |= probe->state!=PROBE_DONE;
+    }
+    return busy;
+}
+
+// One round from the menu's idle timer: finished reads are processed and
+// the next ones issued, then at most one synchronous piece of work is done,
+// a table read without BlockIo2 or handing out one ESP in found, whose
+// file system is FAT as far as its boot sector tells. 0 once every disk is
+// done.
+int probe_step(struct partition **found) {
+    int busy = 0, tables = 0, worked = 0;
+    *found = NULL;
+    for(int i = 0; i<partitions.probes; ++i) {
+        struct probe *probe = &partitions.probe[i];
+        if((probe->state==PROBE_TABLE || probe->state==PROBE_SECTOR)
+           && BS->CheckEvent(probe->token.Event)==EFI_SUCCESS)
+            probe_complete(probe);
+    }
+    for(int i = 0; i<partitions.probes; ++i) {
+        struct probe *probe = &partitions.probe[i];
+        if(!worked && probe->state==PROBE_QUEUED)
+            worked = 1, probe_sync(probe);
+        else if(!worked && probe->state==PROBE_FOUND) {
+            worked = 1, *found = probe->esp;
+            probe_next(probe);
+        }
+        tables |= probe->state==PROBE_QUEUED || probe->state==PROBE_TABLE;
+        busy |= probe->state!=PROBE_DONE;
+    }
+    if(!tables)
+        probe_finish();
+    return busy;
+}
+
+// Wait for the reads in flight, so nothing lands in sefil's buffers after
+// an image took over.
+void probe_stop() {
+    for(int i = 0; i<partitions.probes; ++i) {
+        struct probe *probe = &partitions.probe[i];
+        // A table read may go on with its ESP's boot sector on the same
+        // event.
+        while(probe->state==PROBE_TABLE || probe->state==PROBE_SECTOR)
+            probe_wait(probe);
+        // Their ESPs are not looked at any more, a table still missing is
+        // read for the next lookup.
+        if(probe->state!=PROBE_QUEUED)
+            probe->state = PROBE_DONE;
+        if(probe->token.Event)
+            BS->CloseEvent(probe->token.Event), probe->token.Event = NULL;
+        probe_release(probe);
+    }
+}
+
+// Read every table not read yet, for a lookup.
+static void partition_scan() {
+    if(partitions.complete)
+        return;
+    probe_list();
+    for(int i = 0; i<partitions.probes; ++i) {
+        struct probe *probe = &partitions.probe[i];
+        if(probe->state==PROBE_TABLE)
+            probe_wait(probe);
+        // A failed asynchronous read leaves the table queued again.
+        if(probe->state==PROBE_QUEUED)
+            probe_sync(probe);
+    }
+    probe_finish();
+}
+
+// The partition with unique GUID uuid, NULL if there is none.
+struct partition *partition_find(const efi_guid_t *uuid) {
+    partition_scan();
+    for(struct partition *p = partitions.by_uuid[guid_bucket(uuid)]; p; p = p->next_uuid)
+        if(!memcmp(&p->uuid, uuid, sizeof(*uuid)))
+            return p;
+    return NULL;
+}
+
+// The next partition of type after the given one, the first with NULL.
+struct partition *partition_type(const efi_guid_t *type, struct partition *after) {
+    partition_scan();
+    return partition_next(type, after);
+}
+
+// Whether every table is read, so a lookup does not wait for the disks.
+int partition_ready() {
+    return partitions.complete;
+}
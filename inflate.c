@@ -0,0 +1,292 @@
+#include "sefil.h"
+
+// Deflate (RFC 1951) in gzip members (RFC 1952). Codes up to INFLATE_FAST
+// bits are resolved with one table lookup, longer ones canonically.
+enum { INFLATE_FAST = 10, INFLATE_MAXBITS = 15 };
+
+struct huffman {
+    uint16_t fast[1<<INFLATE_FAST];     // symbol<<4 | length, 0 if longer
+    uint16_t count[INFLATE_MAXBITS+1];
+    uint16_t symbol[288];
+};
+
+struct inflate {
+    struct unpack *u;
+    uint64_t bits;
+    int count;
+    // Zero bits appended past the end of the input.
+    int pad;
+    uint64_t start;
+    struct huffman lit, dist;
+};
+
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// Whole words are taken while the chunk has them, bytes near its end.
+static inline void inflate_fill(struct inflate *s, int need) {
+    struct unpack *u = s->u;
+    if(s->count>=need)
+        return;
+    if(u->in_end-u->in>=8) {
+        uint64_t word;
+        memcpy(&word, u->in, 8);
+        s->bits |= word<<s->count;
+        u->in += (63-s->count)>>3;
+        s->count |= 56;
+        return;
+    }
+    while(s->count<need) {
+        int c = unpack_byte(u);
+        if(c<0)
+            c = 0, s->pad += 8;
+        s->bits |= (uint64_t)c<<s->count;
+        s->count += 8;
+    }
+}
+
+static inline uint32_t inflate_bits(struct inflate *s, int n) {
+    inflate_fill(s, n);
+    uint32_t value = s->bits & ((1ull<<n)-1);
+    s->bits >>= n, s->count -= n;
+    return value;
+}
+
+// Back to byte granularity, whole bytes still buffered return to the input.
+static int inflate_align(struct inflate *s) {
+    int real = s->count-s->pad;
+    if(real<0)
+        return 0;
+    s->u->in -= real>>3;
+    s->bits = 0, s->count = 0, s->pad = 0;
+    return 1;
+}
+
+static int huffman_build(struct huffman *h, const uint8_t *length, int n) {
+    uint16_t offset[INFLATE_MAXBITS+2], next[INFLATE_MAXBITS+1];
+    memset(h->count, 0, sizeof(h->count));
+    for(int i = 0; i<n; ++i)
+        ++h->count[length[i]];
+    h->count[0] = 0;
+    int left = 1;
+    for(int len = 1; len<=INFLATE_MAXBITS; ++len) {
+        left = (left<<1)-h->count[len];
+        if(left<0)
+            return 0;
+    }
+
+    offset[1] = 0;
+    for(int len = 1; len<=INFLATE_MAXBITS; ++len)
+        offset[len+1] = offset[len]+h->count[len];
+    for(int i = 0; i<n; ++i)
+        if(length[i])
+            h->symbol[offset[length[i]]++] = i;
+
+    // Canonical codes are sent MSB first into an LSB first stream, so the
+    // table is indexed by the reversed code.
+    memset(h->fast, 0, sizeof(h->fast));
+    int code = 0;
+    for(int len = 1; len<=INFLATE_MAXBITS; ++len)
+        next[len] = code = (code+h->count[len-1])<<1;
+    for(int i = 0; i<n; ++i) {
+        int len = length[i];
+        if(!len || len>INFLATE_FAST)
+            continue;
+        int reversed = 0;
+        for(int bit = 0, c = next[len]++; bit<len; ++bit)
+            reversed |= (c>>bit & 1)<<(len-1-bit);
+        for(int r = reversed; r<1<<INFLATE_FAST; r += 1<<len)
+            h->fast[r] = i<<4 | len;
+    }
+    return 1;
+}
+
+static inline int huffman_decode(struct inflate *s, const struct huffman *h) {
+    inflate_fill(s, INFLATE_MAXBITS);
+    // Codes taken from the padding mean the input was cut short.
+    if(s->pad>2*INFLATE_MAXBITS)
+        return -1;
+    int entry = h->fast[s->bits & ((1<<INFLATE_FAST)-1)];
+    if(entry) {
+        s->bits >>= entry & 15, s->count -= entry & 15;
+        return entry>>4;
+    }
+    int code = 0, first = 0, index = 0;
+    uint64_t bits = s->bits;
+    for(int len = 1; len<=INFLATE_MAXBITS; ++len) {
+        code |= bits & 1, bits >>= 1;
+        int count = h->count[len];
+        if(code-count<first) {
+            s->bits >>= len, s->count -= len;
+            return h->symbol[index+code-first];
+        }
+        index += count, first += count;
+        first <<= 1, code <<= 1;
+    }
+    return -1;
+}
+
+static int inflate_fixed(struct inflate *s) {
+    static struct huffman lit, dist;
+    static int built;
+    if(!built) {
+        uint8_t length[288];
+        memset(length, 8, 144);
+        memset(length+144, 9, 112);
+        memset(length+256, 7, 24);
+        memset(length+280, 8, 8);
+        huffman_build(&lit, length, 288);
+        memset(length, 5, 30);
+        huffman_build(&dist, length, 30);
+        built = 1;
+    }
+    s->lit = lit, s->dist = dist;
+    return 1;
+}
+
+static int inflate_dynamic(struct inflate *s) {
+    static const uint8_t order[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+    };
+    int nlit = inflate_bits(s, 5)+257, ndist = inflate_bits(s, 5)+1, ncode = inflate_bits(s, 4)+4;
+    if(nlit>286 || ndist>30)
+        return 0;
+    uint8_t length[286+30] = {0};
+    for(int i = 0; i<ncode; ++i)
+        length[order[i]] = inflate_bits(s, 3);
+    if(!huffman_build(&s->lit, length, 19))
+        return 0;
+
+    memset(length, 0, 19);
+    for(int i = 0; i<nlit+ndist;) {
+        int sym = huffman_decode(s, &s->lit), value = 0, repeat;
+        if(sym<0)
+            return 0;
+        if(sym<16) {
+            length[i++] = sym;
+            continue;
+        }
+        if(sym==16) {
+            if(!i)
+                return 0;
+            value = length[i-1], repeat = 3+inflate_bits(s, 2);
+        }
+        else if(sym==17)
+            repeat = 3+inflate_bits(s, 3);
+        else
+            repeat = 11+inflate_bits(s, 7);
+        if(i+repeat>nlit+ndist)
+            return 0;
+        while(repeat--)
+            length[i++] = value;
+    }
+    if(!length[256])
+        return 0;
+    return huffman_build(&s->lit, length, nlit) && huffman_build(&s->dist, length+nlit, ndist);
+}
+
+static int inflate_codes(struct inflate *s) {
+    struct unpack *u = s->u;
+    for(;;) {
+        int sym = huffman_decode(s, &s->lit);
+        if(sym<256) {
+            if(sym<0 || !unpack_space(u, 1))
+                return 0;
+            u->out[u->out_len++] = sym;
+            continue;
+        }
+        if(sym==256)
+            return 1;
+        if((sym -= 257)>=29)
+            return 0;
+        uint32_t len = length_base[sym]+inflate_bits(s, length_extra[sym]);
+        if((sym = huffman_decode(s, &s->dist))<0 || sym>=30)
+            return 0;
+        uint32_t dist = dist_base[sym]+inflate_bits(s, dist_extra[sym]);
+        if(dist>u->out_len-s->start || !unpack_space(u, len))
+            return 0;
+        uint8_t *out = u->out+u->out_len, *from = out-dist;
+        u->out_len += len;
+        if(dist>=len)
+            memcpy(out, from, len);
+        else while(len--)
+            *out++ = *from++;
+    }
+}
+
+static int inflate_stored(struct inflate *s) {
+    if(!inflate_align(s))
+        return 0;
+    const uint8_t *header = unpack_need(s->u, 4);
+    if(!header || (header[0] ^ header[2])!=0xFF || (header[1] ^ header[3])!=0xFF)
+        return 0;
+    return unpack_copy(s->u, header[0] | header[1]<<8);
+}
+
+static int inflate_strz(struct unpack *u) {
+    int c;
+    while((c = unpack_byte(u))>0);
+    return !c;
+}
+
+// One gzip member, checked against its CRC32 and length trailer.
+int inflate_gzip(struct unpack *u) {
+    static struct inflate s;
+    s = (struct inflate){ .u = u, .start = u->out_len };
+
+    const uint8_t *header = unpack_need(u, 10);
+    if(!header || header[0]!=0x1F || header[1]!=0x8B || header[2]!=8 || header[3] & 0xE0)
+        return 0;
+    int flags = header[3];
+    if(flags & 4) {
+        const uint8_t *extra = unpack_need(u, 2);
+        if(!extra || !unpack_skip(u, extra[0] | extra[1]<<8))
+            return 0;
+    }
+    if((flags & 8 && !inflate_strz(u)) || (flags & 16 && !inflate_strz(u))
+       || (flags & 2 && !unpack_skip(u, 2)))
+        return 0;
+
+    for(int last = 0; !last;) {
+        last = inflate_bits(&s, 1);
+        switch(inflate_bits(&s, 2)) {
+        case 0:
+            if(!inflate_stored(&s))
+                return 0;
+            break;
+        case 1:
+            if(!inflate_fixed(&s) || !inflate_codes(&s))
+                return 0;
+            break;
+        case 2:
+            if(!inflate_dynamic(&s) || !inflate_codes(&s))
+                return 0;
+            break;
+        default:
+            return 0;
+        }
+    }
+    if(!inflate_align(&s))
+        return 0;
+
+    const uint8_t *trailer = unpack_need(u, 8);
+    if(!trailer)
+        return 0;
+    uint32_t crc, size;
+    memcpy(&crc, trailer, 4);
+    memcpy(&size, trailer+4, 4);
+    uint64_t length = u->out_len-s.start;
+    return size==(uint32_t)length && crc==unpack_crc32(u->out+s.start, length);
+}
@@ -0,0 +1,453 @@
+#include "sefil.h"
+
+// Direct kernel boot entries from sefil.conf, the keys following an entry
+// line belong to it:
+//   entry=Title
+//   linux=\vmlinuz
+//   initrd=\initrd.img     repeatable, concatenated in order
+//   options=root=... quiet
+// Values point into the config text, which stays allocated.
+struct kernel_entry kernel_entries[KERNEL_ENTRIES_MAX];
+int kernel_entry_count;
+
+// Kernel entries are persisted by their path and title rather than their
+// number, which shifts whenever sefil.conf or \EFI\Linux changes.
+uint32_t kernel_id(const struct kernel_entry *kernel) {
+    uint32_t hash = 2166136261u;
+    for(const char *p = kernel->kernel.path; p && *p; ++p)
+        hash = (hash ^ (uint8_t)*p)*16777619u;
+    hash = (hash ^ 0xFF)*16777619u;
+    for(const char *p = kernel->title; p && *p; ++p)
+        hash = (hash ^ (uint8_t)*p)*16777619u;
+    return hash;
+}
+
+void kernel_config(const char *key, char *value) {
+    if(!strcmp(key, "entry")) {
+        if(kernel_entry_count==KERNEL_ENTRIES_MAX)
+            log_printf(LOG_WARN, "sefil.conf: more than %d entries", (int64_t)KERNEL_ENTRIES_MAX);
+        else
+            kernel_entries[kernel_entry_count++] = (struct kernel_entry){ .title = value };
+        return;
+    }
+    if(!kernel_entry_count) {
+        log_printf(LOG_WARN, "sefil.conf: %s before the first entry", key);
+        return;
+    }
+    struct kernel_entry *entry = &kernel_entries[kernel_entry_count-1];
+    if(!strcmp(key, "linux"))
+        entry->kernel.path = value;
+    else if(!strcmp(key, "options"))
+        entry->options = value;
+    else if(entry->initrds<INITRD_MAX)
+        entry->initrd[entry->initrds++].path = value;
+    else
+        log_printf(LOG_WARN, "sefil.conf: more than %d initrds", (int64_t)INITRD_MAX);
+}
+
+// GUID text, as in root=PARTUUID=, to the GUID in its binary form.
+static int guid_parse(const char *text, efi_guid_t *guid) {
+    uint8_t bytes[16] = { 0 };
+    for(int i = 0, n = 0; i<36; ++i) {
+        int c = text[i] | 0x20;
+        if(i==8 || i==13 || i==18 || i==23) {
+            if(text[i]!='-')
+                return 0;
+            continue;
+        }
+        if(!((c>='0' && c<='9') || (c>='a' && c<='f')))
+            return 0;
+        bytes[n/2] = bytes[n/2]<<4 | (c<='9' ? c-'0' : c-'a'+10);
+        ++n;
+    }
+    guid->Data1 = (uint32_t)bytes[0]<<24 | bytes[1]<<16 | bytes[2]<<8 | bytes[3];
+    guid->Data2 = bytes[4]<<8 | bytes[5];
+    guid->Data3 = bytes[6]<<8 | bytes[7];
+    memcpy(guid->Data4, bytes+8, 8);
+    return 1;
+}
+
+// Device path of a file on the volume sefil was loaded from, in the arena.
+// A PARTUUID=<guid> prefix puts it on that GPT partition instead, and
+// PARTTYPE=<guid> on the first of that type, which the native readers open
+// even without a firmware file system, as /boot on ext4.
+efi_device_path_t *esp_path(const char *path) {
+    int by_type = !strncmp(path, "PARTTYPE=", 9);
+    if(!by_type && strncmp(path, "PARTUUID=", 9))
+        return volume_path(LIP->DeviceHandle, path);
+    efi_guid_t guid;
+    struct partition *partition;
+    if(strlen(path)<9+36 || !guid_parse(path+9, &guid)) {
+        log_printf(LOG_WARN, "sefil.conf: malformed %s", path);
+        return NULL;
+    }
+    // Only partitions the firmware made a handle for can be read.
+    if(by_type)
+        for(partition = partition_type(&guid, NULL); partition && !partition->handle;
+            partition = partition_type(&guid, partition));
+    else if((partition = partition_find(&guid)) && !partition->handle)
+        partition = NULL;
+    if(!partition) {
+        log_printf(LOG_WARN, "sefil.conf: no partition for %s", path);
+        return NULL;
+    }
+    return volume_path(partition->handle, path+9+36);
+}
+
+// The device path of range, resolved on first use. Without lookup, one on a
+// PARTUUID= or PARTTYPE= partition is left for later while tables are still
+// to be read.
+efi_device_path_t *range_path(struct file_range *range, int lookup) {
+    if(range->resolved)
+        return range->device_path;
+    if(!lookup && !partition_ready()
+       && (!strncmp(range->path, "PARTUUID=", 9) || !strncmp(range->path, "PARTTYPE=", 9)))
+        return NULL;
+    range->resolved = 1;
+    efi_device_path_t *path = esp_path(range->path), *node = path;
+    if(!path)
+        return NULL;
+    while(!IsDevicePathEnd(node)) node = NextDevicePathNode(node);
+    uintn_t size = (uint8_t *)node-(uint8_t *)path+END_DEVICE_PATH_LENGTH;
+    if((range->device_path = malloc(size)))
+        memcpy(range->device_path, path, size);
+    return range->device_path;
+}
+
+// Device path of a file on the volume with the given handle, in the arena.
+efi_device_path_t *volume_path(efi_handle_t volume, const char *path) {
+    efi_guid_t dp_guid = EFI_DEVICE_PATH_PROTOCOL_GUID;
+    efi_device_path_t *device, *node;
+    EE(BS->HandleProtocol(volume, &dp_guid, (void **)&device))
+        return NULL;
+    for(node = device; !IsDevicePathEnd(node); node = NextDevicePathNode(node));
+    uintn_t device_size = (uint8_t *)node-(uint8_t *)device;
+
+    // A leading separator is added if missing, '/' is accepted too.
+    uintn_t length = strlen(path)+(*path!='\\' && *path!='/');
+    uintn_t node_size = sizeof(efi_device_path_t)+(length+1)*sizeof(wchar_t);
+    uint8_t *data = arena_alloc(device_size+node_size+END_DEVICE_PATH_LENGTH);
+    if(!data)
+        return NULL;
+    memcpy(data, device, device_size);
+    node = (efi_device_path_t *)(data+device_size);
+    node->Type = MEDIA_DEVICE_PATH, node->SubType = MEDIA_FILEPATH_DP;
+    SetDevicePathNodeLength(node, node_size);
+    wchar_t *name = (wchar_t *)(node+1);
+    if(*path!='\\' && *path!='/')
+        *name++ = '\\';
+    for(; *path; ++path)
+        *name++ = *path=='/' ? '\\' : (uint8_t)*path;
+    *name = 0;
+    node = NextDevicePathNode(node);
+    SetDevicePathEndNode(node);
+    return (efi_device_path_t *)data;
+}
+
+// The initrd is served through LoadFile2 on a VenMedia(LINUX_EFI_INITRD_MEDIA)
+// device path. The EFI stub asks for the size, allocates the final location
+// and has the files read straight into it, so there is neither a copy here
+// nor a relocation in the stub. Compressed initrds are expanded at install
+// time, pinned ones read and checked then, and both copied from memory.
+#define LINUX_EFI_INITRD_MEDIA_GUID { 0x5568e427, 0x68fc, 0x4f3d, {0xac, 0x74, 0xca, 0x55, 0x52, 0x31, 0xcc, 0x68} }
+#define EFI_LOAD_FILE2_PROTOCOL_GUID { 0x4006c0c1, 0xfcb3, 0x403e, {0x99, 0x6d, 0x4a, 0x6c, 0x87, 0x24, 0xe0, 0x6d} }
+
+typedef struct efi_load_file2_s efi_load_file2_t;
+struct efi_load_file2_s {
+    efi_status_t (EFIAPI *LoadFile)(efi_load_file2_t *This, efi_device_path_t *FilePath,
+                                    boolean_t BootPolicy, uintn_t *BufferSize, void *Buffer);
+};
+
+struct {
+    efi_handle_t handle;
+    efi_load_file2_t load_file;
+    struct {
+        efi_device_path_t vendor;
+        efi_guid_t guid;
+        efi_device_path_t end;
+    } __attribute__((packed)) path;
+    int files;
+    efi_file_handle_t *file[INITRD_MAX];
+    uint64_t offset[INITRD_MAX], size[INITRD_MAX], total;
+    uint8_t *data[INITRD_MAX];
+    uintn_t pages[INITRD_MAX];
+} initrd;
+
+static efi_guid_t load_file2_guid = EFI_LOAD_FILE2_PROTOCOL_GUID;
+static efi_guid_t device_path_guid = EFI_DEVICE_PATH_PROTOCOL_GUID;
+
+static efi_status_t EFIAPI initrd_load_file(efi_load_file2_t *This, efi_device_path_t *FilePath,
+                                            boolean_t BootPolicy, uintn_t *BufferSize, void *Buffer) {
+    (void)This, (void)FilePath;
+    if(BootPolicy)
+        return EFI_UNSUPPORTED;
+    if(!BufferSize)
+        return EFI_INVALID_PARAMETER;
+    if(!Buffer || *BufferSize<initrd.total) {
+        *BufferSize = initrd.total;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    uint64_t start = rdtsc();
+    uint8_t *data = Buffer;
+    for(int i = 0; i<initrd.files; ++i) {
+        efi_file_handle_t *file = initrd.file[i];
+        if(initrd.data[i]) {
+            memcpy(data, initrd.data[i], initrd.size[i]);
+            data += initrd.size[i];
+            continue;
+        }
+        EE(file->SetPosition(file, initrd.offset[i]))
+            return ECS;
+        for(uint64_t offset = 0; offset<initrd.size[i];) {
+            uintn_t chunk = min(initrd.size[i]-offset, LOAD_CHUNK);
+            EE(file->Read(file, &chunk, data+offset))
+                return ECS;
+            if(!chunk)
+                return EFI_END_OF_FILE;
+            offset += chunk;
+        }
+        data += initrd.size[i];
+    }
+    *BufferSize = initrd.total;
+    uint64_t us = tsc_to_us(rdtsc()-start);
+    log_printf(LOG_INFO, "initrd: %d bytes read in %d us (%d KB/s)", initrd.total, us,
+               us ? initrd.total/1024*1000000/us : 0);
+    return EFI_SUCCESS;
+}
+
+void initrd_uninstall() {
+    if(initrd.handle) {
+        EE(((efi_uninstall_protocol_interface_t)BS->UninstallProtocolInterface)(
+               initrd.handle, &load_file2_guid, &initrd.load_file)) {}
+        EE(((efi_uninstall_protocol_interface_t)BS->UninstallProtocolInterface)(
+               initrd.handle, &device_path_guid, &initrd.path)) {}
+        initrd.handle = NULL;
+    }
+    while(initrd.files) {
+        int i = --initrd.files;
+        efi_file_handle_t *file = initrd.file[i];
+        file->Close(file);
+        if(initrd.data[i])
+            BS->FreePages((efi_physical_address_t)(uintn_t)initrd.data[i], initrd.pages[i]);
+        initrd.data[i] = NULL;
+    }
+    initrd.total = 0;
+}
+
+// Pinned initrds are checked before they are published. Compressed ones
+// are hashed as they expand, the others read whole and hashed together by
+// mp_run, one file per processor.
+struct initrd_check {
+    const char *path;
+    const uint8_t *pin, *data;
+    uint64_t size;
+    struct sha256 hash;
+};
+
+static void initrd_hash(void *arg, uintn_t i) {
+    struct initrd_check *check = (struct initrd_check *)arg+i;
+    if(check->data)
+        sha256_update_ap(&check->hash, check->data, check->size);
+}
+
+// Open the entry's initrds and publish them, nothing to do without any. A
+// UKI .initrd is served from its place in the image file the same way.
+int initrd_install(struct kernel_entry *entry) {
+    struct initrd_check check[INITRD_MAX];
+    int checks = 0;
+    for(int i = 0; i<entry->initrds; ++i) {
+        struct file_range *range = &entry->initrd[i];
+        efi_device_path_t *path = range_path(range, 1);
+        efi_file_handle_t *file = path ? file_open(path, NULL, NULL) : NULL;
+        if(!file) {
+            log_printf(LOG_ERROR, "initrd: cannot open %s", range->path);
+            return initrd_uninstall(), 0;
+        }
+        uint64_t size = range->size ? range->size : file_size(file);
+        int n = initrd.files++;
+        initrd.file[n] = file;
+        initrd.offset[n] = range->offset;
+        EE(file->SetPosition(file, range->offset))
+            return initrd_uninstall(), 0;
+        // A pin is for a whole file, a UKI section goes with its image.
+        const uint8_t *pin = range->size ? NULL : verify_pin(path);
+        struct sha256 *hash = NULL;
+        if(pin) {
+            check[checks] = (struct initrd_check){ .path = range->path, .pin = pin };
+            hash = &check[checks++].hash;
+            sha256_init(hash);
+        }
+        if(unpack_detect(file)) {
+            if(!(initrd.data[n] = unpack_load(file, &size, &initrd.pages[n], hash))) {
+                log_printf(LOG_ERROR, "initrd: cannot expand %s", range->path);
+                return initrd_uninstall(), 0;
+            }
+        }
+        else if(pin) {
+            if(!(initrd.data[n] = file_load(file, &size, &initrd.pages[n], NULL)))
+                return initrd_uninstall(), 0;
+            check[checks-1].data = initrd.data[n], check[checks-1].size = size;
+        }
+        initrd.size[n] = size;
+        initrd.total += size;
+    }
+    if(checks)
+        mp_run(initrd_hash, check, checks);
+    for(int i = 0; i<checks; ++i)
+        if(!verify_check(&check[i].hash, check[i].pin)) {
+            log_printf(LOG_ERROR, "initrd: %s rejected", check[i].path);
+            return initrd_uninstall(), 0;
+        }
+    if(!initrd.files)
+        return 1;
+
+    efi_guid_t media_guid = LINUX_EFI_INITRD_MEDIA_GUID;
+    initrd.load_file.LoadFile = initrd_load_file;
+    initrd.path.vendor = (efi_device_path_t){ MEDIA_DEVICE_PATH, MEDIA_VENDOR_DP,
+                                              { sizeof(initrd.path)-sizeof(initrd.path.end), 0 } };
+    initrd.path.guid = media_guid;
+    SetDevicePathEndNode(&initrd.path.end);
+    EE(((efi_install_protocol_interface_t)BS->InstallProtocolInterface)(
+           &initrd.handle, &device_path_guid, 0, &initrd.path))
+        return initrd_uninstall(), 0;
+    EE(((efi_install_protocol_interface_t)BS->InstallProtocolInterface)(
+           &initrd.handle, &load_file2_guid, 0, &initrd.load_file)) {
+        EE(((efi_uninstall_protocol_interface_t)BS->UninstallProtocolInterface)(
+               initrd.handle, &device_path_guid, &initrd.path)) {}
+        initrd.handle = NULL;
+        return initrd_uninstall(), 0;
+    }
+    return 1;
+}
+
+// Unified kernel images in \EFI\Linux become kernel entries. Only the PE
+// headers and the small .osrel and .cmdline sections are read here, .linux
+// and .initrd stay in the file and are booted from their offsets, without
+// being extracted first.
+#define UKI_DIR "\\EFI\\Linux"
+
+static int uki_name(const char *name) {
+    size_t length = strlen(name);
+    if(length<4 || name[length-4]!='.')
+        return 0;
+    for(int i = 1; i<4; ++i)
+        if((name[length-4+i] | 0x20)!="efi"[i-1])
+            return 0;
+    return 1;
+}
+
+// Section contents as a NUL terminated string, NULL on failure.
+static char *uki_section(efi_file_handle_t *file, pe_section_t *section) {
+    uintn_t size = min(section->virtual_size, section->raw_size), read = size;
+    char *text = malloc(size+1);
+    if(!text)
+        return NULL;
+    if(EFI_ERROR(file->SetPosition(file, section->raw_offset)) || EFI_ERROR(file->Read(file, &read, text))
+       || read!=size)
+        return free(text), NULL;
+    text[size] = 0;
+    return text;
+}
+
+// PRETTY_NAME from os-release, unquoted, else NAME.
+static char *uki_title(char *osrel) {
+    char *title = NULL, *save, *line = strtok_r(osrel, "\n", &save);
+    for(; line; line = strtok_r(NULL, "\n", &save)) {
+        int pretty = !strncmp(line, "PRETTY_NAME=", 12);
+        if(!pretty && (title || strncmp(line, "NAME=", 5)))
+            continue;
+        char *value = strchr(line, '=')+1;
+        size_t length = strlen(value);
+        if(length>=2 && (*value=='"' || *value=='\'') && value[length-1]==*value)
+            value[length-1] = 0, ++value;
+        title = value;
+        if(pretty)
+            break;
+    }
+    return title;
+}
+
+// Trailing newlines would reach the kernel command line.
+static void uki_trim(char *text) {
+    char *end = text+strlen(text);
+    while(end>text && (end[-1]=='\n' || end[-1]=='\r' || end[-1]==' ')) --end;
+    *end = 0;
+}
+
+static void uki_add(char *path) {
+    efi_device_path_t *file_path = esp_path(path);
+    efi_file_handle_t *file = file_path ? file_open(file_path, NULL, NULL) : NULL;
+    static uint8_t head[4096];
+    uintn_t size = sizeof(head);
+    if(!file || EFI_ERROR(file->Read(file, &size, head))) {
+        if(file)
+            file->Close(file);
+        free(path);
+        return;
+    }
+    pe_section_t *sections;
+    pe_header_t *pe = pe_parse(head, size, &sections);
+    struct kernel_entry entry = { .kernel.path = path };
+    char *osrel = NULL;
+    for(int i = 0; pe && i<pe->sections; ++i) {
+        pe_section_t *section = &sections[i];
+        struct file_range range = {
+            .path = path, .offset = section->raw_offset,
+            .size = min(section->virtual_size, section->raw_size)
+        };
+        if(!strncmp(section->name, ".linux", 8))
+            entry.kernel = range;
+        else if(!strncmp(section->name, ".initrd", 8) && range.size && entry.initrds<INITRD_MAX)
+            entry.initrd[entry.initrds++] = range;
+        else if(!strncmp(section->name, ".cmdline", 8) && !entry.options) {
+            if((entry.options = uki_section(file, section)))
+                uki_trim(entry.options);
+        }
+        else if(!strncmp(section->name, ".osrel", 8) && !osrel)
+            osrel = uki_section(file, section);
+    }
+    file->Close(file);
+
+    if(!entry.kernel.size) {
+        log_printf(LOG_WARN, "uki: %s has no .linux section", path);
+        free(entry.options), free(osrel), free(path);
+        return;
+    }
+    entry.title = osrel ? uki_title(osrel) : NULL;
+    if(!entry.title)
+        entry.title = strrchr(path, '\\')+1;
+    kernel_entries[kernel_entry_count++] = entry;
+}
+
+// Add the images not seen yet, stopping after the one with kernel_id() *id
+// if given. Its index, -1 once the directory is done without a match. The
+// next call goes on where this one stopped.
+int uki_scan(const uint32_t *id) {
+    static DIR *dir;
+    static int done;
+    if(done || (!dir && !(dir = opendir(UKI_DIR)))) {
+        done = 1;
+        return -1;
+    }
+    struct dirent *de;
+    while((de = readdir(dir))) {
+        if(de->d_type==DT_DIR || !uki_name(de->d_name))
+            continue;
+        if(kernel_entry_count==KERNEL_ENTRIES_MAX) {
+            log_printf(LOG_WARN, "uki: more than %d entries", (int64_t)KERNEL_ENTRIES_MAX);
+            break;
+        }
+        char *path = malloc(sizeof(UKI_DIR)+1+strlen(de->d_name));
+        if(!path)
+            break;
+        sprintf(path, UKI_DIR "\\%s", de->d_name);
+        int count = kernel_entry_count;
+        uki_add(path);
+        if(id && kernel_entry_count>count && kernel_id(&kernel_entries[count])==*id)
+            return count;
+    }
+    closedir(dir);
+    dir = NULL, done = 1;
+    return -1;
+}
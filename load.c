@@ -0,0 +1,226 @@
+#include "sefil.h"
+
+static efi_guid_t sfs_guid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
+
+// Join the file path nodes following the volume into one path, NULL if
+// anything else follows.
+static wchar_t *file_path_name(efi_device_path_t *node) {
+    uintn_t size = sizeof(wchar_t);
+    efi_device_path_t *first = node;
+    for(; !IsDevicePathEnd(node); node = NextDevicePathNode(node)) {
+        if(DevicePathType(node)!=MEDIA_DEVICE_PATH || DevicePathSubType(node)!=MEDIA_FILEPATH_DP)
+            return NULL;
+        size += DevicePathNodeLength(node)-sizeof(*node)+sizeof(wchar_t);
+    }
+    if(node==first)
+        return NULL;
+
+    wchar_t *name = malloc(size), *end = name;
+    if(!name)
+        return NULL;
+    for(node = first; !IsDevicePathEnd(node); node = NextDevicePathNode(node)) {
+        // Nodes may or may not carry the separator, and are NUL terminated.
+        const wchar_t *part = (const wchar_t *)(node+1);
+        uintn_t length = (DevicePathNodeLength(node)-sizeof(*node))/sizeof(wchar_t);
+        while(length && !part[length-1]) --length;
+        if(end>name && end[-1]!='\\' && *part!='\\')
+            *end++ = '\\';
+        memcpy(end, part, length*sizeof(wchar_t));
+        end += length;
+    }
+    *end = 0;
+    return name;
+}
+
+// Name of the file a device path points to on its volume, freed by the
+// caller. device and file_path optionally receive the volume handle and the
+// path after it. NULL for paths not ending on a file system, or on a block
+// device the native readers may take.
+wchar_t *file_name(efi_device_path_t *path, efi_handle_t *device_handle,
+                   efi_device_path_t **file_path) {
+    efi_device_path_t *rest = path;
+    efi_handle_t device;
+    if(EFI_ERROR(BS->LocateDevicePath(&sfs_guid, &rest, &device))) {
+        rest = path;
+        if(!block_native || EFI_ERROR(BS->LocateDevicePath(&block_io_guid, &rest, &device)))
+            return NULL;
+    }
+    wchar_t *name = file_path_name(rest);
+    if(name && device_handle)
+        *device_handle = device;
+    if(name && file_path)
+        *file_path = rest;
+    return name;
+}
+
+// Open the file a device path points to, see file_name(), from memory if it
+// was queued for prefetch. Paths not ending on a file system return NULL
+// without logging.
+efi_file_handle_t *file_open(efi_device_path_t *path, efi_handle_t *device_handle,
+                             efi_device_path_t **file_path) {
+    efi_handle_t device;
+    wchar_t *name = file_name(path, &device, file_path);
+    if(!name)
+        return NULL;
+    efi_file_handle_t *fetched = prefetch_open(path);
+    if(fetched) {
+        if(device_handle)
+            *device_handle = device;
+        free(name);
+        return fetched;
+    }
+    if(device_handle)
+        *device_handle = device;
+
+    efi_simple_file_system_protocol_t *sfs;
+    efi_file_handle_t *root, *file = block_open(device, name);
+    // Without SimpleFS only the native readers could have opened it.
+    if(file || EFI_ERROR(BS->HandleProtocol(device, &sfs_guid, (void **)&sfs)))
+        goto exit;
+    EE(sfs->OpenVolume(sfs, &root))
+        goto exit;
+    EE(root->Open(root, &file, name, EFI_FILE_MODE_READ, 0))
+        file = NULL;
+    root->Close(root);
+exit:
+    free(name);
+    return file;
+}
+
+uint64_t file_size(efi_file_handle_t *file) {
+    efi_guid_t info_guid = EFI_FILE_INFO_GUID;
+    efi_file_info_t info;
+    uintn_t size = sizeof(info);
+    EE(file->GetInfo(file, &info_guid, &size, &info))
+        return 0;
+    return info.FileSize;
+}
+
+// Read size bytes from the file position into page-aligned memory in
+// LOAD_CHUNK transfers, freed with FreePages(buffer, *pages). Compressed
+// data is expanded while it is read, size receives the length in memory.
+// hash, if given, takes the bytes as read, before any expansion.
+void *file_load(efi_file_handle_t *file, uint64_t *size, uintn_t *pages, struct sha256 *hash) {
+    if(unpack_detect(file))
+        return unpack_load(file, size, pages, hash);
+    efi_physical_address_t buffer;
+    *pages = EFI_SIZE_TO_PAGES(*size);
+    EE(BS->AllocatePages(AllocateAnyPages, EfiLoaderData, *pages, &buffer))
+        return NULL;
+    uint8_t *data = (uint8_t *)(uintn_t)buffer;
+    uint64_t offset = 0;
+    while(offset<*size) {
+        uintn_t chunk = min(*size-offset, LOAD_CHUNK);
+        EE(file->Read(file, &chunk, data+offset))
+            break;
+        if(!chunk)
+            break;
+        if(hash)
+            sha256_update(hash, data+offset, chunk);
+        offset += chunk;
+    }
+    if(offset==*size)
+        return data;
+    log_printf(LOG_ERROR, "load: short read, %d of %d bytes", offset, *size);
+    BS->FreePages(buffer, *pages);
+    return NULL;
+}
+
+// Firmware LoadImage verifies signatures, the native loader does not.
+int secure_boot() {
+    static int enabled = -1;
+    if(enabled<0) {
+        uintn_t size;
+        uint8_t *value = var_get(L"SecureBoot", &global_guid, &size);
+        enabled = value && size==1 && *value==1;
+        free(value);
+    }
+    return enabled;
+}
+
+// Map the image with the native PE loader, else LoadImage from a buffer
+// sefil read itself, else LoadImage from the device path. Later ones are
+// used for what the earlier cannot handle, the native loader is skipped
+// under Secure Boot. Every path is timed into the log. An image embedded at
+// offset, of a nonzero size, cannot be loaded by the firmware from the path.
+// Neither can one to hash, which is read whole into a buffer.
+efi_handle_t load_image(efi_device_path_t *path, uint64_t offset, uint64_t size, int loader,
+                        struct sha256 *hash) {
+    efi_handle_t image = NULL;
+    int embedded = size!=0 || hash;
+    if(loader==LOADER_NATIVE && !secure_boot() && !hash) {
+        timeline_mark("mapimage");
+        if((image = pe_load(path, offset, size)))
+            return image;
+    }
+    efi_file_handle_t *file = NULL;
+    if(loader!=LOADER_FIRMWARE || embedded)
+        file = file_open(path, NULL, NULL);
+    if(file) {
+        timeline_mark("readimage");
+        uint64_t start = rdtsc();
+        if(!size)
+            size = file_size(file);
+        else EE(file->SetPosition(file, offset))
+            size = 0;
+        uintn_t pages;
+        uint64_t read_size = size;
+        void *buffer = size ? file_load(file, &size, &pages, hash) : NULL;
+        file->Close(file);
+        if(buffer) {
+            uint64_t read = rdtsc();
+            timeline_mark("loadimage");
+            EE(BS->LoadImage(0, IM, path, buffer, size, &image))
+                image = NULL;
+            BS->FreePages((efi_physical_address_t)(uintn_t)buffer, pages);
+            uint64_t read_us = tsc_to_us(read-start);
+            log_printf(LOG_INFO, "load: %d bytes read in %d us (%d KB/s), LoadImage %d us",
+                       read_size, read_us, read_us ? read_size/1024*1000000/read_us : 0,
+                       tsc_to_us(rdtsc()-read));
+            if(image)
+                return image;
+        }
+        if(!embedded)
+            log_printf(LOG_WARN, "load: buffered load failed, using the firmware loader");
+    }
+    if(embedded)
+        return NULL;
+
+    timeline_mark("loadimage");
+    uint64_t start = rdtsc();
+    EE(BS->LoadImage(1, IM, path, NULL, 0, &image))
+        return NULL;
+    log_printf(LOG_INFO, "load: firmware LoadImage %d us", tsc_to_us(rdtsc()-start));
+    return image;
+}
+
+// Boot#### optional data or a kernel command line, as the boot manager
+// would pass it.
+void image_set_options(efi_handle_t image, void *options, uint32_t size) {
+    efi_guid_t loaded_image_guid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
+    efi_loaded_image_protocol_t *loaded;
+    EE(BS->HandleProtocol(image, &loaded_image_guid, (void **)&loaded))
+        return;
+    loaded->LoadOptions = size ? options : NULL;
+    loaded->LoadOptionsSize = size;
+}
+
+typedef efi_status_t (EFIAPI *efi_image_unload_t)(efi_handle_t ImageHandle);
+
+void image_unload(efi_handle_t image) {
+    if(pe_loaded(image))
+        pe_unload();
+    else EE(((efi_image_unload_t)BS->UnloadImage)(image)) {}
+}
+
+efi_status_t image_start(efi_handle_t image) {
+    if(pe_loaded(image))
+        return pe_start(image);
+    EE(BS->StartImage(image, NULL, NULL)) {
+        // Applications that exit successfully are unloaded by the firmware.
+        efi_status_t status = ECS;
+        image_unload(image);
+        return status;
+    }
+    return ECS;
+}
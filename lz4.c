@@ -0,0 +1,260 @@
+#include "sefil.h"
+
+// LZ4 frames, and the legacy format the kernel build uses for lz4 initrds.
+// Every block is taken whole from the input and decoded into the output,
+// independent ones in batches on all processors.
+enum {
+    LZ4_MAGIC = 0x184D2204, LZ4_LEGACY = 0x184C2102,
+    LZ4_LEGACY_BLOCK = 8*1024*1024,
+    // Worst case size of a compressed legacy block.
+    LZ4_LEGACY_BOUND = LZ4_LEGACY_BLOCK+LZ4_LEGACY_BLOCK/255+16,
+};
+
+static inline uint32_t le32(const uint8_t *p) {
+    return p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+static inline int lz4_length(const uint8_t **p, const uint8_t *end, uint32_t *length) {
+    int byte;
+    do {
+        if(*p==end)
+            return 0;
+        byte = *(*p)++;
+        *length += byte;
+    } while(byte==255);
+    return 1;
+}
+
+// Decodes one block of size bytes into out, at most cap bytes, or copies a
+// raw one. Matches may reach window bytes before out. Runs on APs too, so
+// it only computes. The decoded length, -1 for a corrupt block.
+static int64_t lz4_decode(const uint8_t *p, uintn_t size, int raw, uint8_t *out, uint64_t window,
+                          uint64_t cap) {
+    if(raw) {
+        if(size>cap)
+            return -1;
+        memcpy(out, p, size);
+        return size;
+    }
+    const uint8_t *end = p+size;
+    uint64_t length = 0;
+    while(p<end) {
+        int token = *p++;
+        uint32_t literals = token>>4, match = token & 15;
+        if((literals==15 && !lz4_length(&p, end, &literals)) || literals>(uintn_t)(end-p)
+           || literals>cap-length)
+            return -1;
+        memcpy(out+length, p, literals);
+        length += literals, p += literals;
+        // The last sequence has literals only.
+        if(p==end)
+            return length;
+
+        if(end-p<2)
+            return -1;
+        uint32_t offset = p[0] | p[1]<<8;
+        p += 2;
+        if((match==15 && !lz4_length(&p, end, &match)) || !offset || offset>window+length
+           || (match += 4)>cap-length)
+            return -1;
+        uint8_t *to = out+length;
+        const uint8_t *from = to-offset;
+        length += match;
+        if(offset>=match)
+            memcpy(to, from, match);
+        else while(match--)
+            *to++ = *from++;
+    }
+    return -1;
+}
+
+// Legacy blocks and blocks of frames with the independence flag reference
+// nothing before them. They are gathered in a batch and decoded all at once
+// by mp_run, each into a block_max slot of the output, then closed up.
+enum { LZ4_BATCH = 64, LZ4_BATCH_BYTES = 64*1024*1024 };
+struct lz4_stream {
+    uint64_t start, content;
+    uint32_t block_max, capacity, count;
+    uint8_t *data, *to;
+    uint64_t used, room;
+    struct {
+        uint64_t offset;
+        uint32_t size, raw;
+        int64_t length;
+    } block[LZ4_BATCH];
+};
+
+// Output room for count blocks, never past a declared content size.
+static int64_t lz4_space(struct unpack *u, struct lz4_stream *s, uint32_t count) {
+    uint64_t room = min((uint64_t)count*s->block_max, s->content-(u->out_len-s->start));
+    return unpack_space(u, room) ? (int64_t)room : -1;
+}
+
+static int lz4_block(struct unpack *u, struct lz4_stream *s, const uint8_t *p, uint32_t size, int raw,
+                     uint64_t window) {
+    int64_t room = lz4_space(u, s, 1);
+    if(room<0)
+        return 0;
+    int64_t length = lz4_decode(p, size, raw, u->out+u->out_len, window, room);
+    if(length<0)
+        return 0;
+    u->out_len += length;
+    return 1;
+}
+
+// A batch only pays with a few processors to run it. bound is the largest
+// compressed block.
+static void lz4_batch(struct lz4_stream *s, uint32_t bound) {
+    uint32_t capacity = min(min((uint32_t)mp_cpus(), LZ4_BATCH), LZ4_BATCH_BYTES/bound);
+    if(capacity>1 && (s->data = malloc((uint64_t)capacity*bound)))
+        s->capacity = capacity;
+}
+
+static void lz4_batch_block(void *arg, uintn_t i) {
+    struct lz4_stream *s = arg;
+    uint64_t slot = (uint64_t)i*s->block_max;
+    s->block[i].length = slot>=s->room ? -1
+        : lz4_decode(s->data+s->block[i].offset, s->block[i].size, s->block[i].raw, s->to+slot, 0,
+                     min(s->room-slot, s->block_max));
+}
+
+static int lz4_flush(struct unpack *u, struct lz4_stream *s) {
+    uint32_t count = s->count, i;
+    s->count = 0, s->used = 0;
+    if(!count)
+        return 1;
+    int64_t room = lz4_space(u, s, count);
+    if(room<0)
+        return 0;
+    s->to = u->out+u->out_len, s->room = room;
+    mp_run(lz4_batch_block, s, count);
+    for(i = 0; i<count && s->block[i].length>=0; ++i) {
+        memmove(u->out+u->out_len, s->to+(uint64_t)i*s->block_max, s->block[i].length);
+        u->out_len += s->block[i].length;
+    }
+    // A block that did not fit the room taken up front goes again alone,
+    // which also makes a corrupt one fail.
+    for(; i<count; ++i)
+        if(!lz4_block(u, s, s->data+s->block[i].offset, s->block[i].size, s->block[i].raw, 0))
+            return 0;
+    return 1;
+}
+
+// Queues an independent block, or decodes it right away without a batch.
+static int lz4_add(struct unpack *u, struct lz4_stream *s, const uint8_t *p, uint32_t size, int raw) {
+    if(!s->data)
+        return lz4_block(u, s, p, size, raw, 0);
+    if(s->count==s->capacity && !lz4_flush(u, s))
+        return 0;
+    memcpy(s->data+s->used, p, size);
+    s->block[s->count].offset = s->used, s->block[s->count].size = size, s->block[s->count].raw = raw;
+    s->used += size, ++s->count;
+    return 1;
+}
+
+// XXH32 with seed 0 for the frame content checksum.
+static const uint32_t xxh_prime[5] = { 2654435761u, 2246822519u, 3266489917u, 668265263u, 374761393u };
+
+static inline uint32_t rotl32(uint32_t x, int r) {
+    return x<<r | x>>(32-r);
+}
+
+static uint32_t xxh32(const uint8_t *p, uint64_t size) {
+    const uint8_t *end = p+size;
+    uint32_t h;
+    if(size>=16) {
+        uint32_t v[4] = { xxh_prime[0]+xxh_prime[1], xxh_prime[1], 0, -xxh_prime[0] };
+        for(; end-p>=16; p += 16)
+            for(int i = 0; i<4; ++i)
+                v[i] = rotl32(v[i]+le32(p+4*i)*xxh_prime[1], 13)*xxh_prime[0];
+        h = rotl32(v[0], 1)+rotl32(v[1], 7)+rotl32(v[2], 12)+rotl32(v[3], 18);
+    }
+    else h = xxh_prime[4];
+    h += (uint32_t)size;
+    for(; end-p>=4; p += 4)
+        h = rotl32(h+le32(p)*xxh_prime[2], 17)*xxh_prime[3];
+    for(; p<end; ++p)
+        h = rotl32(h+*p*xxh_prime[4], 11)*xxh_prime[0];
+    h = (h ^ h>>15)*xxh_prime[1];
+    h = (h ^ h>>13)*xxh_prime[2];
+    return h ^ h>>16;
+}
+
+// Legacy streams have no end mark, they end with the input, at an
+// implausible block size, which also covers the zstd and lz4 frame magics,
+// or at a gzip header.
+static int lz4_legacy(struct unpack *u, struct lz4_stream *s) {
+    s->block_max = LZ4_LEGACY_BLOCK;
+    lz4_batch(s, LZ4_LEGACY_BOUND);
+    for(;;) {
+        uint8_t bytes[4];
+        int count = 0, c;
+        while(count<4 && (c = unpack_byte(u))>=0)
+            bytes[count++] = c;
+        uint32_t size = le32(bytes);
+        if(count<4 || !size || (size>LZ4_LEGACY_BOUND && size!=LZ4_LEGACY)
+           || (bytes[0]==0x1F && bytes[1]==0x8B)) {
+            unpack_unget(u, count);
+            return lz4_flush(u, s);
+        }
+        if(size==LZ4_LEGACY)
+            continue;
+        const uint8_t *block = unpack_need(u, size);
+        if(!block || !lz4_add(u, s, block, size, 0))
+            return 0;
+    }
+}
+
+static int lz4_blocks(struct unpack *u, struct lz4_stream *s) {
+    const uint8_t *p = unpack_need(u, 2);
+    if(!p)
+        return 0;
+    // Version 01, no dictionary.
+    int flags = p[0];
+    s->block_max = 1<<(2*(p[1]>>4 & 7)+8);
+    if(flags>>6!=1 || flags & 1 || (p[1]>>4 & 7)<4)
+        return 0;
+    if(flags & 8) {
+        if(!(p = unpack_need(u, 8)))
+            return 0;
+        s->content = le32(p) | (uint64_t)le32(p+4)<<32;
+        if(!unpack_space(u, s->content))
+            return 0;
+    }
+    if(!unpack_skip(u, 1))
+        return 0;
+    if(flags & 32)
+        lz4_batch(s, s->block_max);
+
+    for(;;) {
+        if(!(p = unpack_need(u, 4)))
+            return 0;
+        uint32_t size = le32(p) & 0x7FFFFFFF, raw = p[3]>>7;
+        if(!size)
+            break;
+        if(size>s->block_max || !(p = unpack_need(u, size)))
+            return 0;
+        if(!(flags & 32 ? lz4_add(u, s, p, size, raw) : lz4_block(u, s, p, size, raw, u->out_len-s->start)))
+            return 0;
+        if(flags & 16 && !unpack_skip(u, 4))
+            return 0;
+    }
+    if(!lz4_flush(u, s))
+        return 0;
+    if(flags & 4)
+        return (p = unpack_need(u, 4)) && le32(p)==xxh32(u->out+s->start, u->out_len-s->start);
+    return 1;
+}
+
+int lz4_frame(struct unpack *u) {
+    const uint8_t *p = unpack_need(u, 4);
+    if(!p)
+        return 0;
+    uint32_t magic = le32(p);
+    if(magic!=LZ4_LEGACY && magic!=LZ4_MAGIC)
+        return 0;
+    struct lz4_stream s = { .start = u->out_len, .content = ~0ull };
+    int ok = magic==LZ4_LEGACY ? lz4_legacy(u, &s) : lz4_blocks(u, &s);
+    free(s.data);
+    return ok;
+}
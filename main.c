@@ -1,30 +1,372 @@
-#include <uefi.h>
+#include "sefil.h"
 
-#define assert(X) (!(X)                                                         \
-        ? printf("\n%s:%d: Assertion! %s\n", __FILE__, __LINE__, #X),           \
-          printf("Press any key to continue ...\n"),                            \
-          getchar_timeout(), abort()                                            \
-        : (void)0)
+uint16_t getchar_timeout(unsigned timeout) {
+    efi_event_t events[3] = { ST->ConIn->WaitForKey, NULL, con_poll_event() };
+    efi_input_key_t key = {0};
+    uintn_t idx;
 
-static inline uint16_t getchar_timeout() {
-    // TODO: Implement timeout.
-    return getchar();
+    // Not wrapped in EE(), efi_call_log() may pause through here.
+    if(EFI_ERROR(BS->CreateEvent(EVT_TIMER, 0, NULL, NULL, &events[1])))
+        return getchar();
+    BS->SetTimer(events[1], TimerRelative, timeout*10000000ULL);
+    do {
+        BS->WaitForEvent(events[2] ? 3 : 2, events, &idx);
+    } while(idx!=1 && !con_read_key(&key));
+    BS->CloseEvent(events[1]);
+    return key.UnicodeChar ? key.UnicodeChar : key.ScanCode;
 }
 
-// EFI function call error/warning status handling.
-#define EE(F) if((ECS = F) && efi_call_log(__FILE__, __LINE__, #F))
+#ifdef SEFIL_PROFILE
+struct profile_site profile[PROFILE_MAX];
+uint64_t profile_start;
+#endif
 efi_status_t ECS;
-static inline efi_status_t efi_call_log(const char *file, int line, const char *func) {
-    if(EFI_ERROR(ECS))
-        printf("\n%s:%d: EFI error: %s: %d\n", file, line, func, ~EFI_ERROR_MASK&ECS);
-    else // EFI oem_error or warning.
-        printf("\n%s:%d: EFI warning: %s: %d\n", file, line, func, ECS);
-    printf("Press any key to continue ...\n");
-    getchar_timeout();
-    // Discard warnings.
-    return EFI_ERROR(ECS);
+
+efi_guid_t sefil_guid = { 0xc27b3296, 0x0453, 0x4096, {0xb1, 0x37, 0x33, 0x6d, 0x09, 0xd2, 0x66, 0xc9} };
+efi_guid_t global_guid = EFI_GLOBAL_VARIABLE;
+
+int esp_write(const char *path, const void *data, size_t size) {
+    static int dir_ready;
+    if(!dir_ready)
+        mkdir(SEFIL_DIR, 0), dir_ready = 1;
+
+    // fopen does not truncate, drop the previous contents first.
+    remove(path);
+    FILE *f = fopen(path, "w");
+    if(!f)
+        return 0;
+    size_t n = fwrite(data, 1, size, f);
+    fclose(f);
+    block_flush();
+    return n==size;
+}
+
+// Boot-phase timeline, raw TSC stamps. tsc_khz is calibrated against
+// BS->Stall so readers can convert stamps to time since reset.
+enum { TIMELINE_MAX = 16 };
+struct {
+    uint32_t version;
+    uint32_t size;
+    uint64_t tsc_khz;
+    struct {
+        char name[16];
+        uint64_t tsc;
+    } phase[TIMELINE_MAX];
+} timeline = { .version = 1 };
+
+void timeline_mark(const char *name) {
+    if(timeline.size>=TIMELINE_MAX)
+        return;
+    strncpy(timeline.phase[timeline.size].name, name, sizeof(timeline.phase->name)-1);
+    timeline.phase[timeline.size++].tsc = rdtsc();
+}
+
+void timeline_calibrate() {
+    uint64_t start = rdtsc();
+    BS->Stall(1000);
+    timeline.tsc_khz = rdtsc()-start;
+}
+
+uint64_t tsc_to_us(uint64_t tsc) {
+    return timeline.tsc_khz ? tsc*1000/timeline.tsc_khz : 0;
+}
+
+// Persist as the SefilTimeline variable and a text copy on the ESP.
+void timeline_save() {
+    uintn_t size = (uint8_t *)&timeline.phase[timeline.size]-(uint8_t *)&timeline;
+    EE(RT->SetVariable(L"SefilTimeline", &sefil_guid, SEFIL_VAR_ATTR, size, &timeline)) {}
+
+    char text[TIMELINE_MAX*48+1];
+    int len = 0;
+    for(uint32_t i = 0; i<timeline.size; ++i) {
+        uint64_t us = tsc_to_us(timeline.phase[i].tsc);
+        uint64_t delta = i ? us-tsc_to_us(timeline.phase[i-1].tsc) : 0;
+        len += snprintf(text+len, sizeof(text)-len, "%s %d %d\n",
+                        timeline.phase[i].name, us, delta);
+    }
+    esp_write(SEFIL_DIR "\\timeline.txt", text, len);
+}
+
+// In-memory log ring, oldest lines are overwritten.
+enum { LOG_LINES = 64, LOG_LINE_MAX = 120 };
+struct {
+    uint32_t count;
+    uint32_t errors, warnings;
+    struct log_line {
+        uint8_t level;
+        uint64_t tsc;
+        char text[LOG_LINE_MAX];
+    } line[LOG_LINES];
+} log_ring;
+
+void log_printf(int level, const char *fmt, ...) {
+    __builtin_va_list args;
+    va_start(args, fmt);
+    struct log_line *line = &log_ring.line[log_ring.count++%LOG_LINES];
+    line->level = level;
+    line->tsc = rdtsc();
+    vsnprintf(line->text, sizeof(line->text), fmt, args);
+    va_end(args);
+
+    log_ring.errors += level==LOG_ERROR;
+    log_ring.warnings += level==LOG_WARN;
+#ifdef SEFIL_DEBUG
+    con_printf("\r\n%s\r\n", line->text);
+    con_flush();
+#endif
+}
+
+// Log entry i as "<level> <us since reset> <message>", without newline.
+static int log_line(uint32_t i, char *text, int size) {
+    struct log_line *line = &log_ring.line[i%LOG_LINES];
+    return min(snprintf(text, size, "%c %d %s", "EWID"[line->level], tsc_to_us(line->tsc), line->text),
+               size-1);
+}
+
+// Log as text, one line per entry.
+char *log_format(int *len) {
+    static char text[LOG_LINES*(LOG_LINE_MAX+24)];
+    *len = 0;
+    uint32_t i = log_ring.count>LOG_LINES ? log_ring.count-LOG_LINES : 0;
+    for(; i<log_ring.count && *len<(int)sizeof(text)-1; ++i) {
+        *len += log_line(i, text+*len, sizeof(text)-*len-1);
+        text[(*len)++] = '\n';
+    }
+    return text;
+}
+
+// Persist as the SefilLog variable and a text copy on the ESP.
+void log_flush() {
+    int len;
+    char *text = log_format(&len);
+    if(!len)
+        return;
+    EE(RT->SetVariable(L"SefilLog", &sefil_guid, SEFIL_VAR_ATTR, len, text)) {}
+    esp_write(SEFIL_DIR "\\log.txt", text, len);
+}
+
+// Text screens wrap at the console width, at most TEXT_ROW_MAX bytes, and
+// keep the last two rows for the prompt.
+enum { TEXT_ROW_MAX = 511 };
+
+static int text_width() {
+    return min(max(con_cols()-1, 1), TEXT_ROW_MAX);
+}
+
+static int text_rows() {
+    return max(con_rows()-2, 1);
+}
+
+// Bytes of text making up one screen row of width columns, never ending
+// inside a UTF-8 sequence.
+static int text_wrap(const char *text, int length, int width) {
+    int n = min(length, width);
+    while(n<length && n>1 && (text[n] & 0xC0)==0x80) --n;
+    return n;
+}
+
+// Length of the line at text, without its newline.
+static int text_line(const char *text, int length) {
+    int n = 0;
+    while(n<length && text[n]!='\n') ++n;
+    return n;
+}
+
+// Lines of text on a cleared screen from its start, written a row at a time
+// so nothing goes through con_printf()'s buffer whole or relies on a bare
+// LF, clipped above the prompt. Then wait for a key.
+static void text_show(const char *text, int length) {
+    static char row_text[TEXT_ROW_MAX+1];
+    int width = text_width(), rows = text_rows(), row = 0;
+    con_clear(EFI_TEXT_ATTR(EFI_WHITE, EFI_BLACK));
+    while(length>0 && row<rows) {
+        int line = text_line(text, length);
+        for(int at = 0, n; at<line && row<rows; at += n) {
+            n = text_wrap(text+at, line-at, width);
+            memcpy(row_text, text+at, n);
+            row_text[n] = 0;
+            con_goto(0, row++);
+            con_printf("%s", row_text);
+        }
+        line += line<length;
+        text += line, length -= line;
+    }
+    con_goto(0, row);
+    con_printf("Press any key to continue ...");
+    con_flush();
+    getchar_timeout(PAUSE_TIMEOUT);
+}
+
+// The newest entries that fit the screen, wrapped at its width.
+void log_show() {
+    int len, width = text_width(), rows = text_rows(), used = 0;
+    char *text = log_format(&len);
+    int start = len;
+    while(start>0) {
+        // Entries end in a newline, find where the one before start begins.
+        int line = start-1;
+        while(line>0 && text[line-1]!='\n') --line;
+        int need = 0;
+        for(int at = line; at<start-1; ++need)
+            at += text_wrap(text+at, start-1-at, width);
+        if(used+need>rows)
+            break;
+        used += need, start = line;
+    }
+    text_show(text+start, len-start);
+}
+
+// Read a variable into an exactly sized buffer, its size is probed first.
+void *var_get(wchar_t *name, efi_guid_t *guid, uintn_t *size) {
+    void *data;
+    *size = 0;
+    // Plain call, a missing variable is not worth a log line.
+    if(RT->GetVariable(name, guid, NULL, size, NULL)!=EFI_BUFFER_TOO_SMALL
+       || !(data = malloc(*size)))
+        return *size = 0, NULL;
+    EE(RT->GetVariable(name, guid, NULL, size, data))
+        return free(data), *size = 0, NULL;
+    return data;
+}
+
+// sefil configuration, \EFI\sefil\sefil.conf with "key=value" lines and
+// '#' comments. The firmware Timeout variable is used unless overridden.
+enum { TIMEOUT_DEFAULT = 5, TIMEOUT_MENU = 0xFFFF };
+struct {
+    int timeout;
+    int loader;
+} config = { .timeout = -1, .loader = LOADER_BUFFER };
+
+void config_set(char *key, char *value) {
+    if(!strcmp(key, "timeout"))
+        config.timeout = strcmp(value, "menu") ? atoi(value) : TIMEOUT_MENU;
+    else if(!strcmp(key, "loader")) {
+        if(!strcmp(value, "native")) config.loader = LOADER_NATIVE;
+        else if(!strcmp(value, "buffer")) config.loader = LOADER_BUFFER;
+        else if(!strcmp(value, "firmware")) config.loader = LOADER_FIRMWARE;
+        else log_printf(LOG_WARN, "sefil.conf: unknown loader %s", value);
+    }
+    else if(!strcmp(key, "console")) {
+        if(!strcmp(value, "text")) con_select(CON_TEXT);
+        else if(!strcmp(value, "gop")) con_select(CON_GOP);
+        else if(!strcmp(value, "serial")) con_select(CON_SERIAL);
+        else log_printf(LOG_WARN, "sefil.conf: unknown console %s", value);
+    }
+    else if(!strcmp(key, "decompress")) {
+        if(!strcmp(value, "yes")) unpack_enabled = 1;
+        else if(!strcmp(value, "no")) unpack_enabled = 0;
+        else log_printf(LOG_WARN, "sefil.conf: unknown decompress %s", value);
+    }
+    else if(!strcmp(key, "sha256"))
+        verify_config(value);
+    else if(!strcmp(key, "reverify"))
+        verify_reverify = atoi(value);
+    else if(!strcmp(key, "mp")) {
+        if(!strcmp(value, "yes")) mp_enabled = 1;
+        else if(!strcmp(value, "no")) mp_enabled = 0;
+        else log_printf(LOG_WARN, "sefil.conf: unknown mp %s", value);
+    }
+    else if(!strcmp(key, "probe")) {
+        if(!strcmp(value, "yes")) probe_enabled = 1;
+        else if(!strcmp(value, "no")) probe_enabled = 0;
+        else log_printf(LOG_WARN, "sefil.conf: unknown probe %s", value);
+    }
+    else if(!strcmp(key, "prefetch")) {
+        if(!strcmp(value, "yes")) prefetch_enabled = 1;
+        else if(!strcmp(value, "no")) prefetch_enabled = 0;
+        else log_printf(LOG_WARN, "sefil.conf: unknown prefetch %s", value);
+    }
+    else if(!strcmp(key, "fs")) {
+        if(!strcmp(value, "native")) block_native = 1;
+        else if(!strcmp(value, "firmware")) block_native = 0;
+        else log_printf(LOG_WARN, "sefil.conf: unknown fs %s", value);
+    }
+    else if(!strcmp(key, "entry") || !strcmp(key, "linux") || !strcmp(key, "initrd")
+            || !strcmp(key, "options"))
+        kernel_config(key, value);
+    else
+        log_printf(LOG_WARN, "sefil.conf: unknown key %s", key);
+}
+
+void config_load() {
+    FILE *f = fopen(SEFIL_DIR "\\sefil.conf", "r");
+    if(f) {
+        static char text[4096];
+        size_t len = fread(text, 1, sizeof(text)-1, f);
+        fclose(f);
+        text[len] = 0;
+
+        char *save, *line = strtok_r(text, "\r\n", &save);
+        for(; line; line = strtok_r(NULL, "\r\n", &save)) {
+            while(*line==' ' || *line=='\t') ++line;
+            char *value = strchr(line, '=');
+            if(*line=='#' || !value)
+                continue;
+            *value++ = 0;
+            config_set(line, value);
+        }
+    }
+
+    if(config.timeout<0) {
+        uintn_t size;
+        uint16_t *timeout = var_get(L"Timeout", &global_guid, &size);
+        config.timeout = size==sizeof(*timeout) ? *timeout : TIMEOUT_DEFAULT;
+        free(timeout);
+    }
 }
 
+#ifdef SEFIL_PROFILE
+// Call site table as text, one "file:line count total min max call" line per
+// site in TSC cycles, see the tsc_khz header to convert. Decoders used follow
+// as "unpack codec streams in out cycles" lines, multiprocessor dispatch as
+// "mp runs parallel items cycles" and native file system I/O as "block reads
+// bytes hits misses".
+char *profile_format(int *len) {
+    static char text[64+PROFILE_MAX*128+CODEC_COUNT*96];
+    *len = snprintf(text, sizeof(text), "tsc_khz %d\n", timeline.tsc_khz);
+    for(int i = 0; i<PROFILE_MAX && *len<(int)sizeof(text); ++i) {
+        struct profile_site *site = &profile[i];
+        if(!site->count)
+            continue;
+        char func[41];
+        strncpy(func, site->func, sizeof(func)-1);
+        func[sizeof(func)-1] = 0;
+        *len += snprintf(text+*len, sizeof(text)-*len, "%s:%d %d %d %d %d %s\n",
+                         site->file, (int64_t)site->line, (uint64_t)site->count,
+                         site->total, site->min, site->max, func);
+    }
+    for(int i = 0; i<CODEC_COUNT && *len<(int)sizeof(text); ++i) {
+        struct unpack_stats *stats = &unpack_stats[i];
+        if(stats->streams)
+            *len += snprintf(text+*len, sizeof(text)-*len, "unpack %s %d %d %d %d\n", codec_name[i],
+                             (uint64_t)stats->streams, stats->in, stats->out, stats->cycles);
+    }
+    if(mp_stats.runs && *len<(int)sizeof(text))
+        *len += snprintf(text+*len, sizeof(text)-*len, "mp %d %d %d %d\n", (uint64_t)mp_stats.runs,
+                         (uint64_t)mp_stats.parallel, mp_stats.items, mp_stats.cycles);
+    if(block_stats.reads && *len<(int)sizeof(text))
+        *len += snprintf(text+*len, sizeof(text)-*len, "block %d %d %d %d\n", block_stats.reads,
+                         block_stats.bytes, block_stats.hits, block_stats.misses);
+    *len = min(*len, (int)sizeof(text));
+    return text;
+}
+
+void profile_save() {
+    int len;
+    char *text = profile_format(&len);
+    esp_write(SEFIL_DIR "\\profile.txt", text, len);
+}
+
+// Diagnostics screen, as many sites as fit, also refreshes the ESP copy
+// which has them all.
+void profile_show() {
+    int len;
+    char *text = profile_format(&len);
+    esp_write(SEFIL_DIR "\\profile.txt", text, len);
+    text_show(text, len);
+}
+#endif
+
 // https://uefi.org/specs/UEFI/2.10/03_Boot_Manager.html#load-options
 typedef struct {
     uint32_t attributes;
@@ -34,45 +376,397 @@ typedef struct {
     //uint8_t optional_data[];
 } efi_load_option_header_t;
 
-size_t wstrlen(wchar_t *str) {
-    size_t size = 0;
-    while(str[size]) ++size;
-    return size;
-}
-
 void hexdump(const void *data, uintn_t size) {
     assert(data);
 
     char fmt[] = "%00D"; // 16-byte xxd line.
     sprintf(fmt+1, "%02d", min(size/16, 16));
     fmt[3] = 'D';
-    printf(fmt, data);
+    con_printf(fmt, data);
+}
+
+// Load option parsed and bounds checked once at load time. Lengths are in
+// bytes except description_length, which counts characters without the NUL.
+// Kernel entries from sefil.conf are numbered from BOOT_KERNEL, past every
+// Boot####, and have no load option behind them. Neither have the ESPs found
+// while the menu shows, from BOOT_PROBED, which are never persisted.
+enum { BOOT_KERNEL = 0x10000, BOOT_PROBED = 0x20000 };
+typedef struct {
+    uint32_t attributes;
+    uint32_t number;
+    uint16_t description_length;
+    uint16_t file_path_length;
+    uint32_t optional_data_length;
+    wchar_t *description;
+    efi_device_path_t *file_path;
+    uint8_t *optional_data;
+    efi_load_option_header_t *option;
+    struct kernel_entry *kernel;
+} boot_entry_t;
+
+// Bump allocator backing the boot entries and their options, released all
+// at once by boot_entries_free().
+enum { ARENA_CHUNK = 16*1024 };
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used, size;
+    uint8_t data[];
+} *arena;
+
+void *arena_alloc(size_t size) {
+    size = (size+7) & ~7;
+    if(!arena || arena->size-arena->used<size) {
+        size_t chunk_size = max(size, ARENA_CHUNK);
+        struct arena_chunk *chunk = malloc(sizeof(*chunk)+chunk_size);
+        if(!chunk)
+            return NULL;
+        *chunk = (struct arena_chunk){ .next = arena, .size = chunk_size };
+        arena = chunk;
+    }
+    void *data = arena->data+arena->used;
+    arena->used += size;
+    return data;
 }
 
-enum { BOOT_ENTRY_MAX = 15 };
+void arena_release() {
+    while(arena) {
+        struct arena_chunk *next = arena->next;
+        free(arena);
+        arena = next;
+    }
+}
+
+// Grows by doubling inside the arena, stale copies are left behind.
 struct {
-    int size;
-    uint32_t option_size[BOOT_ENTRY_MAX];
-    efi_load_option_header_t *option[BOOT_ENTRY_MAX];
+    int size, capacity;
+    boot_entry_t *entry;
 } boot_entries;
-uint16_t menuselect;
-
-#define ADD_BOOT_ENTRY(OPT, SIZE)                                               \
-    (assert(boot_entries.size<BOOT_ENTRY_MAX),                                  \
-     boot_entries.option_size[boot_entries.size] = SIZE,                        \
-     boot_entries.option[boot_entries.size++] = OPT)
-
-#define GET_BOOT_ENTRY(I)                                                       \
-    ((struct {                                                                  \
-        uint32_t attributes;                                                    \
-        uint16_t file_path_list_length;                                         \
-        wchar_t description[wstrlen(boot_entries.option[I]->description)+1];    \
-        char file_path_list[boot_entries.option[I]->file_path_list_length];     \
-        uint8_t optional_data[boot_entries.option_size[I]-4-2                   \
-                              -wstrlen(boot_entries.option[I]->description)-2   \
-                              -boot_entries.option[I]->file_path_list_length    \
-                             ];                                                 \
-    } *)boot_entries.option[I])
+int menuselect;
+// Entry number persisted as SefilLastBooted, -1 if unknown.
+int last_booted = -1;
+// A kernel entry's kernel_id() from SefilLastBooted, resolved on demand.
+struct {
+    uint32_t id;
+    int pending;
+} last_kernel;
+
+// Find the kernel entry last booted, opening only as many UKIs as it takes.
+// If it is gone, the user picks rather than boot whatever took its place.
+static void last_kernel_resolve() {
+    if(!last_kernel.pending)
+        return;
+    last_kernel.pending = 0;
+    for(int i = 0; i<kernel_entry_count && last_booted<0; ++i)
+        if(kernel_id(&kernel_entries[i])==last_kernel.id)
+            last_booted = BOOT_KERNEL+i;
+    int index;
+    if(last_booted<0 && (index = uki_scan(&last_kernel.id))>=0)
+        last_booted = BOOT_KERNEL+index;
+    if(last_booted<0) {
+        log_printf(LOG_WARN, "SefilLastBooted: kernel entry no longer exists");
+        config.timeout = TIMEOUT_MENU;
+    }
+}
+
+static int boot_entries_grow() {
+    if(boot_entries.size==boot_entries.capacity) {
+        int capacity = max(2*boot_entries.capacity, 16);
+        boot_entry_t *entry = arena_alloc(capacity*sizeof(*entry));
+        if(!entry)
+            return 0;
+        memcpy(entry, boot_entries.entry, boot_entries.size*sizeof(*entry));
+        boot_entries.entry = entry, boot_entries.capacity = capacity;
+    }
+    return 1;
+}
+
+// Parse and validate a load option into the next boot entry, rejecting
+// unterminated descriptions and file paths running past the option.
+int boot_entry_add(uint16_t number, efi_load_option_header_t *option, uintn_t size) {
+    if(!boot_entries_grow())
+        return 0;
+    // The description follows the header without its tail padding.
+    uintn_t header = offsetof(efi_load_option_header_t, description);
+    if(size<header)
+        goto malformed;
+
+    uintn_t max_length = (size-header)/sizeof(wchar_t), length = 0;
+    while(length<max_length && option->description[length]) ++length;
+    if(length==max_length)
+        goto malformed;
+    uintn_t offset = header+(length+1)*sizeof(wchar_t);
+    uint16_t file_path_length = option->file_path_list_length;
+    if(file_path_length>size-offset)
+        goto malformed;
+
+    // The first device path instance has to end inside the list.
+    efi_device_path_t *file_path = (void *)((uint8_t *)option+offset), *node = file_path;
+    for(;;) {
+        uintn_t left = (uint8_t *)file_path+file_path_length-(uint8_t *)node;
+        if(left<sizeof(*node))
+            goto malformed;
+        uintn_t node_length = DevicePathNodeLength(node);
+        if(node_length<sizeof(*node) || node_length>left)
+            goto malformed;
+        if(IsDevicePathEnd(node))
+            break;
+        node = NextDevicePathNode(node);
+    }
+
+    boot_entries.entry[boot_entries.size++] = (boot_entry_t){
+        .attributes = option->attributes,
+        .number = number,
+        .description_length = length,
+        .file_path_length = file_path_length,
+        .optional_data_length = size-offset-file_path_length,
+        .description = option->description,
+        .file_path = file_path,
+        .optional_data = (uint8_t *)file_path+file_path_length,
+        .option = option,
+    };
+    return 1;
+
+malformed:
+    log_printf(LOG_WARN, "Boot%04X: malformed load option", (uint64_t)number);
+    return 0;
+}
+
+static void boot_var_name(wchar_t name[9], uint16_t number) {
+    memcpy(name, L"Boot", 4*sizeof(*name));
+    for(int i = 0; i<4; ++i)
+        name[4+i] = "0123456789ABCDEF"[number>>(12-4*i) & 0xF];
+    name[8] = 0;
+}
+
+// Read Boot#### and add it to the boot entries, 0 if it does not exist.
+int boot_entry_load(uint16_t number) {
+    wchar_t name[9];
+    boot_var_name(name, number);
+
+    uintn_t size = 0;
+    if(RT->GetVariable(name, &global_guid, NULL, &size, NULL)!=EFI_BUFFER_TOO_SMALL)
+        return 0;
+    efi_load_option_header_t *option = arena_alloc(size);
+    if(!option)
+        return 0;
+    EE(RT->GetVariable(name, &global_guid, NULL, &size, option))
+        return 0;
+    return boot_entry_add(number, option, size);
+}
+
+static wchar_t *arena_wcs(const char *str, uintn_t *length) {
+    *length = strlen(str);
+    wchar_t *wcs = arena_alloc((*length+1)*sizeof(wchar_t));
+    if(wcs) {
+        for(uintn_t i = 0; i<=*length; ++i)
+            wcs[i] = (uint8_t)str[i];
+    }
+    return wcs;
+}
+
+// The file path of a kernel entry, NULL while pending. One on a PARTUUID=
+// or PARTTYPE= partition waits for the tables the menu reads in the
+// background, unless lookup asks for them to be read now.
+static efi_device_path_t *boot_entry_resolve(boot_entry_t *entry, int lookup) {
+    struct kernel_entry *kernel = entry->kernel;
+    if(entry->file_path || !kernel || !(entry->file_path = range_path(&kernel->kernel, lookup)))
+        return entry->file_path;
+    // Under Secure Boot a UKI is started whole, its own stub verifies the
+    // sections sefil would otherwise pass on unchecked. A pinned one too, so
+    // the digest covers all of it.
+    if(kernel->kernel.size && (secure_boot() || verify_pin(entry->file_path)))
+        entry->optional_data = NULL, entry->optional_data_length = 0, entry->kernel = NULL;
+    return entry->file_path;
+}
+
+// Complete the pending kernel entries once the tables are read, whether
+// any got its path.
+static int boot_entries_resolve() {
+    int resolved = 0;
+    for(int i = 0; i<boot_entries.size; ++i) {
+        boot_entry_t *entry = &boot_entries.entry[i];
+        if(entry->kernel && !entry->kernel->kernel.resolved && boot_entry_resolve(entry, 0))
+            ++resolved;
+    }
+    return resolved;
+}
+
+// Add kernel entry index, from sefil.conf or a UKI. The command line
+// becomes the UCS-2 LoadOptions the EFI stub expects. Without lookup, an
+// entry whose partition is not known yet is added pending.
+int boot_entry_kernel(int index, int lookup) {
+    if(index>=kernel_entry_count || !boot_entries_grow())
+        return 0;
+    struct kernel_entry *kernel = &kernel_entries[index];
+    if(!kernel->kernel.path) {
+        log_printf(LOG_WARN, "sefil.conf: entry %s has no linux line", kernel->title);
+        return 0;
+    }
+    uintn_t length, options_length = 0;
+    wchar_t *description = arena_wcs(kernel->title, &length);
+    wchar_t *options = kernel->options ? arena_wcs(kernel->options, &options_length) : NULL;
+    if(!description || (kernel->options && !options))
+        return 0;
+    boot_entry_t *entry = &boot_entries.entry[boot_entries.size];
+    *entry = (boot_entry_t){
+        .number = BOOT_KERNEL+index,
+        .description_length = min(length, 0xFFFF),
+        .optional_data_length = options ? (options_length+1)*sizeof(wchar_t) : 0,
+        .description = description,
+        .optional_data = (uint8_t *)options,
+        .kernel = kernel,
+    };
+    if(!boot_entry_resolve(entry, lookup) && kernel->kernel.resolved)
+        return 0;
+    ++boot_entries.size;
+    return 1;
+}
+
+// Add the removable media loader of an ESP found by probe_step(), unless it
+// is sefil's own or a Boot#### already points into the partition.
+#define PROBE_LOADER "\\EFI\\BOOT\\BOOTX64.EFI"
+int boot_entry_probed(struct partition *partition) {
+    if(partition->handle==LIP->DeviceHandle || !boot_entries_grow())
+        return 0;
+    for(int i = 0; i<boot_entries.size; ++i) {
+        efi_device_path_t *node = boot_entries.entry[i].file_path;
+        for(; node && !IsDevicePathEnd(node); node = NextDevicePathNode(node))
+            // HardDrive node: the signature at 24, GPT ones are the GUID.
+            if(DevicePathType(node)==MEDIA_DEVICE_PATH && DevicePathSubType(node)==MEDIA_HARDDRIVE_DP
+               && DevicePathNodeLength(node)>=42 && ((uint8_t *)node)[41]==2
+               && !memcmp((uint8_t *)node+24, &partition->uuid, sizeof(partition->uuid)))
+                return 0;
+    }
+    efi_device_path_t *file_path = volume_path(partition->handle, PROBE_LOADER);
+    efi_file_handle_t *file = file_path ? file_open(file_path, NULL, NULL) : NULL;
+    if(!file)
+        return 0;
+    file->Close(file);
+
+    // The partition's name from the table, its number without one.
+    char number[16];
+    uintn_t length = 0;
+    wchar_t *description = arena_alloc((PARTITION_NAME_MAX+sizeof(number)+sizeof(PROBE_LOADER))*sizeof(wchar_t));
+    if(!description)
+        return 0;
+    for(; length<PARTITION_NAME_MAX && partition->name[length]; ++length)
+        description[length] = partition->name[length];
+    if(length)
+        strcpy(number, " ");
+    else
+        snprintf(number, sizeof(number), "Partition %d ", (int64_t)partition->number);
+    for(const char *p = number; *p; ++p)
+        description[length++] = *p;
+    for(const char *p = PROBE_LOADER; *p; ++p)
+        description[length++] = *p;
+    description[length] = 0;
+    boot_entries.entry[boot_entries.size] = (boot_entry_t){
+        .number = BOOT_PROBED+boot_entries.size,
+        .description_length = length,
+        .description = description,
+        .file_path = file_path,
+    };
+    ++boot_entries.size;
+    log_printf(LOG_INFO, "probe: loader on partition %d", (int64_t)partition->number);
+    return 1;
+}
+
+void boot_entries_free() {
+    // Fetched files are queued by paths in the arena.
+    prefetch_cancel();
+    arena_release();
+    boot_entries.size = boot_entries.capacity = 0;
+    boot_entries.entry = NULL;
+}
+
+static int boot_var_number(const wchar_t *name) {
+    int number = 0;
+    if(memcmp(name, L"Boot", 4*sizeof(*name)) || name[8])
+        return -1;
+    for(int i = 4; i<8; ++i) {
+        wchar_t c = name[i];
+        if(c>='0' && c<='9') number = number<<4 | (c-'0');
+        else if(c>='A' && c<='F') number = number<<4 | (c-'A'+10);
+        else return -1;
+    }
+    return number;
+}
+
+struct boot_var { uint16_t number; uint32_t offset, size; };
+
+static int boot_var_cmp(const void *a, const void *b) {
+    return ((const struct boot_var *)a)->number-((const struct boot_var *)b)->number;
+}
+
+// Collect the Boot#### variables listed in the boot order in a single
+// GetNextVariableName pass. Each size is probed exactly and all options are
+// packed into one contiguous arena allocation, then added in boot order.
+void boot_vars_scan(uint16_t *order, int order_size) {
+    static uint8_t listed[0x10000/8];
+    memset(listed, 0, sizeof(listed));
+    for(int i = 0; i<order_size; ++i)
+        listed[order[i]/8] |= 1<<order[i]%8;
+
+    struct boot_var *found = NULL;
+    int found_size = 0;
+    uintn_t total = 0;
+
+    uintn_t name_max = 64*sizeof(wchar_t), name_size;
+    wchar_t *name = calloc(1, name_max);
+    efi_guid_t guid;
+    for(;;) {
+        name_size = name_max;
+        efi_status_t status = RT->GetNextVariableName(&name_size, name, &guid);
+        if(status==EFI_BUFFER_TOO_SMALL) {
+            // The buffer still holds the previous name, keep it on growth.
+            wchar_t *grown = realloc(name, name_size);
+            if(!grown)
+                break;
+            name = grown, name_max = name_size;
+            continue;
+        }
+        if(EFI_ERROR(status))
+            break;
+
+        int number = boot_var_number(name);
+        if(number<0 || !(listed[number/8] & 1<<number%8)
+           || memcmp(&guid, &global_guid, sizeof(guid)))
+            continue;
+        uintn_t size = 0;
+        if(RT->GetVariable(name, &guid, NULL, &size, NULL)!=EFI_BUFFER_TOO_SMALL)
+            continue;
+        // The variables found so far stay usable if growing fails.
+        if(!(found_size%16)) {
+            struct boot_var *grown = realloc(found, (found_size+16)*sizeof(*found));
+            if(!grown)
+                break;
+            found = grown;
+        }
+        found[found_size].number = number;
+        found[found_size].offset = total;
+        found[found_size++].size = size;
+        // Keep every option header naturally aligned.
+        total += (size+7) & ~7;
+    }
+    free(name);
+
+    uint8_t *options = found_size ? arena_alloc(total) : NULL;
+    if(options) {
+        qsort(found, found_size, sizeof(*found), boot_var_cmp);
+        for(int i = 0; i<order_size; ++i) {
+            struct boot_var key = { .number = order[i] }, *var;
+            if(!(var = bsearch(&key, found, found_size, sizeof(*found), boot_var_cmp)))
+                continue;
+            wchar_t name[9];
+            boot_var_name(name, var->number);
+            uintn_t size = var->size;
+            EE(RT->GetVariable(name, &global_guid, NULL, &size, options+var->offset))
+                continue;
+            boot_entry_add(var->number, (void *)(options+var->offset), size);
+        }
+    }
+    free(found);
+}
 
 enum {
     TEXT_DFLT = EFI_TEXT_ATTR(EFI_WHITE, EFI_BLACK),
@@ -80,112 +774,423 @@ enum {
 };
 
 void boot_menuselect() {
+    if(menuselect>=boot_entries.size)
+        return;
+
     // Setup watchdog timer before loading and starting image.
     wchar_t watchdog_str[] = L"BootMenu StartImage timer.";
     EE(BS->SetWatchdogTimer(300, 0xB00B5, sizeof(watchdog_str), watchdog_str)) {}
 
-    efi_handle_t image;
-    EE(BS->LoadImage(1, IM, (efi_device_path_t *)GET_BOOT_ENTRY(
-                    menuselect)->file_path_list, NULL, 0, &image))
+    boot_entry_t *entry = &boot_entries.entry[menuselect];
+    // A pending entry has the partition tables read now.
+    if(!boot_entry_resolve(entry, 1)) {
+        log_printf(LOG_ERROR, "boot: cannot find %s", entry->kernel->kernel.path);
+        goto exit;
+    }
+    struct file_range *range = entry->kernel ? &entry->kernel->kernel : NULL;
+    const uint8_t *pin = verify_pin(entry->file_path);
+    struct sha256 hash;
+    if(pin && verify_cached(entry->file_path, pin))
+        pin = NULL;
+    if(pin)
+        sha256_init(&hash);
+    efi_handle_t image = load_image(entry->file_path, range ? range->offset : 0,
+                                    range ? range->size : 0, config.loader, pin ? &hash : NULL);
+    if(!image)
         goto exit;
+    // A pinned image is started only if what was read matches.
+    if(pin && !verify_check(&hash, pin)) {
+        log_printf(LOG_ERROR, "verify: image rejected");
+        image_unload(image);
+        goto exit;
+    }
+    // Optional data is passed on as the boot manager would.
+    if(entry->optional_data_length)
+        image_set_options(image, entry->optional_data, entry->optional_data_length);
+    if(entry->kernel && !initrd_install(entry->kernel)) {
+        image_unload(image);
+        goto exit;
+    }
+    timeline_mark("startimage");
+    // Non-volatile, but only written when the selection changes. Boot####
+    // numbers keep the 16-bit form, kernel entries are saved as kernel_id().
+    uint32_t number = entry->number;
+    if(last_booted!=(int)number && number<BOOT_PROBED) {
+        uint32_t id = number<BOOT_KERNEL ? number : kernel_id(&kernel_entries[number-BOOT_KERNEL]);
+        EE(RT->SetVariable(L"SefilLastBooted", &sefil_guid,
+                           EFI_VARIABLE_NON_VOLATILE|SEFIL_VAR_ATTR,
+                           number<BOOT_KERNEL ? sizeof(uint16_t) : sizeof(id), &id)) {}
+        else last_booted = number;
+    }
+    // No probe read may land after the image took over.
+    probe_stop();
+    // The image may never return, persist before handing over.
+    timeline_save();
+    log_flush();
+#ifdef SEFIL_PROFILE
+    profile_save();
+#endif
 
-    typedef efi_status_t (EFIAPI *efi_image_unload_t)(efi_handle_t ImageHandle);
-    EE(BS->StartImage(image, NULL, NULL))
-        EE(((efi_image_unload_t)BS->UnloadImage)(image)) {}
+    con_handover(1);
+    image_start(image);
+    con_handover(0);
+    if(entry->kernel)
+        initrd_uninstall();
+    timeline_mark("returned");
+    timeline_save();
+    log_flush();
 
 exit:
     // Disable BootMenu watchdog timer.
     EE(BS->SetWatchdogTimer(0, 0xB00B5, 0, NULL)) {}
 }
 
+// Scan codes overlap control characters, e.g. SCAN_PAGE_DOWN and LF.
+#define KEY_SCAN(S) (0x10000|(S))
+
+// Menu geometry from the current text mode. Only the visible window of
+// entries starting at top is ever rendered.
+struct {
+    int width, rows, view, top;
+} menu_view;
+
+void menu_layout() {
+    // The last column is kept free too, full rows wrap on some firmware.
+    menu_view.width = min(con_cols()-1, 80);
+    // Title, two borders, status and countdown lines, and the last row is
+    // kept free so the console never scrolls.
+    menu_view.rows = con_rows();
+    menu_view.view = max(menu_view.rows-6, 1);
+}
+
+// Keep the selection inside the visible window.
+void menu_scroll() {
+    if(menuselect<menu_view.top)
+        menu_view.top = menuselect;
+    else if(menuselect>=menu_view.top+menu_view.view)
+        menu_view.top = menuselect-menu_view.view+1;
+}
+
+// What is on screen, so a selection change repaints only the damaged rows.
+struct {
+    int valid;
+    int top, select, size;
+} menu_shadow;
+
+void menu_draw_row(int i) {
+    int inner = menu_view.width-2;
+    con_goto(0, 2+i-menu_view.top);
+    con_putc(BOXDRAW_VERTICAL);
+    if(i<boot_entries.size) {
+        con_attr(i==menuselect ? TEXT_HIGH : TEXT_DFLT);
+        int num = con_printf(" %d. ", (int64_t)i);
+        boot_entry_t *entry = &boot_entries.entry[i];
+        int length = min(entry->description_length, max(inner-num, 0));
+        con_puts(entry->description, length);
+        con_fill(' ', inner-num-length);
+        con_attr(TEXT_DFLT);
+    }
+    else con_fill(' ', inner);
+    con_putc(BOXDRAW_VERTICAL);
+}
+
+// Box borders with scroll arrows and every visible row.
+void menu_draw_list() {
+    int top = menu_view.top, bottom = top+menu_view.view;
+
+    con_goto(0, 1);
+    con_putc(BOXDRAW_DOWN_RIGHT);
+    con_fill(BOXDRAW_HORIZONTAL, menu_view.width-3);
+    con_putc(top>0 ? ARROW_UP : BOXDRAW_HORIZONTAL);
+    con_putc(BOXDRAW_DOWN_LEFT);
+
+    for(int i = top; i<bottom; ++i)
+        menu_draw_row(i);
+
+    con_goto(0, bottom-top+2);
+    con_putc(BOXDRAW_UP_RIGHT);
+    con_fill(BOXDRAW_HORIZONTAL, menu_view.width-3);
+    con_putc(bottom<boot_entries.size ? ARROW_DOWN : BOXDRAW_HORIZONTAL);
+    con_putc(BOXDRAW_UP_LEFT);
+}
+
+// Repaint what changed since the last frame, everything if the shadow is
+// invalid.
+void menu_draw() {
+    menu_scroll();
+    if(!menu_shadow.valid) {
+        con_clear(TEXT_DFLT);
+        con_fill(' ', (menu_view.width-8)/2);
+        con_printf("BootMenu");
+        menu_draw_list();
+        if(log_ring.errors || log_ring.warnings) {
+            con_goto(0, menu_view.view+3);
+            con_printf(" %d errors, %d warnings, press L for the log",
+                       (uint64_t)log_ring.errors, (uint64_t)log_ring.warnings);
+        }
+    }
+    else if(menu_shadow.top!=menu_view.top || menu_shadow.size!=boot_entries.size)
+        menu_draw_list();
+    else if(menu_shadow.select!=menuselect) {
+        menu_draw_row(menu_shadow.select);
+        menu_draw_row(menuselect);
+    }
+    menu_shadow.valid = 1;
+    menu_shadow.top = menu_view.top;
+    menu_shadow.select = menuselect;
+    menu_shadow.size = boot_entries.size;
+}
+
+// Queue the files of the highlighted entry for the idle ticks, the image
+// and the initrds of a Linux entry. Nothing is read for an image the
+// firmware loads by itself.
+static int menu_prefetch() {
+    prefetch_cancel();
+    if(!prefetch_enabled || menuselect>=boot_entries.size)
+        return 0;
+    boot_entry_t *entry = &boot_entries.entry[menuselect];
+    if(config.loader==LOADER_FIRMWARE && !entry->kernel && !verify_pin(entry->file_path))
+        return 0;
+    prefetch_add(entry->file_path);
+    for(int i = 0; entry->kernel && i<entry->kernel->initrds; ++i)
+        prefetch_add(range_path(&entry->kernel->initrd[i], 0));
+    return 1;
+}
+
 void menu() {
     uintn_t idx;
     efi_input_key_t key;
+    int painted = 0;
+
+    // Autoboot countdown on a 1 s periodic timer, any key cancels it.
+    efi_event_t events[5] = { ST->ConIn->WaitForKey }, timer = NULL, probe = NULL, fetch = NULL;
+    int fetched = -1;
+    int countdown = config.timeout;
+    if(countdown==TIMEOUT_MENU || !boot_entries.size)
+        countdown = 0;
+    if(countdown) {
+        EE(BS->CreateEvent(EVT_TIMER, 0, NULL, NULL, &timer))
+            countdown = 0;
+        else EE(BS->SetTimer(timer, TimerPeriodic, 10000000))
+            countdown = 0;
+    }
+    menu_layout();
+    // Backends with input of their own are polled on a timer.
+    efi_event_t poll = con_poll_event();
+    menu_shadow.valid = 0;
+    // Disks are probed on a 10 ms idle timer while the menu shows, entries
+    // found are appended as they turn up.
+    if(probe_enabled && probe_start()) {
+        EE(BS->CreateEvent(EVT_TIMER, 0, NULL, NULL, &probe)) {}
+        else EE(BS->SetTimer(probe, TimerPeriodic, 100000))
+            BS->CloseEvent(probe), probe = NULL;
+    }
+    // The highlighted entry is read ahead on another, restarted whenever
+    // the selection moves.
+    if(prefetch_enabled)
+        EE(BS->CreateEvent(EVT_TIMER, 0, NULL, NULL, &fetch))
+            fetch = NULL;
 
     for(;;) {
-        ST->ConOut->SetAttribute(ST->ConOut, TEXT_DFLT);
-        ST->ConOut->ClearScreen(ST->ConOut);
-
-        printf("                                    BootMenu                                    \n");
-        putchar(BOXDRAW_DOWN_RIGHT);
-        for(int i = 0; i<78; ++i) putchar(BOXDRAW_HORIZONTAL);
-        printf("%c\n", BOXDRAW_DOWN_LEFT);
-
-        for(int i = 0; i<BOOT_ENTRY_MAX; ++i) {
-            if(i<boot_entries.size) {
-                putchar(BOXDRAW_VERTICAL);
-                if(i==menuselect)
-                    ST->ConOut->SetAttribute(ST->ConOut, TEXT_HIGH);
-                int num = printf(" %d. ", i);
-                ST->ConOut->OutputString(ST->ConOut, GET_BOOT_ENTRY(i)->description);
-                int wb = 78-num-wstrlen(GET_BOOT_ENTRY(i)->description);
-                while(wb--) putchar(' ');
-                if(i==menuselect)
-                    ST->ConOut->SetAttribute(ST->ConOut, TEXT_DFLT);
-                printf("%c\n", BOXDRAW_VERTICAL);
-            }
-            else {
-                putchar(BOXDRAW_VERTICAL);
-                for(int i = 0; i<78; ++i) putchar(' ');
-                printf("%c\n", BOXDRAW_VERTICAL);
-            }
+        menu_draw();
+        if(countdown) {
+            con_goto(0, menu_view.view+4);
+            con_printf(" Booting in %d s, press any key to cancel ", (int64_t)countdown);
+        }
+        else if(timer) {
+            BS->CloseEvent(timer), timer = NULL;
+            con_goto(0, menu_view.view+4);
+            con_fill(' ', 42);
+        }
+        con_frame();
+        if(!painted++) {
+            timeline_mark("menu");
+            log_printf(LOG_DEBUG, "menu: first frame took %d firmware calls",
+                       (uint64_t)con_stats.frame_calls);
+        }
+        if(fetch && fetched!=menuselect) {
+            fetched = menuselect;
+            EE(BS->SetTimer(fetch, menu_prefetch() ? TimerPeriodic : TimerCancel, 100000)) {}
         }
-        putchar(BOXDRAW_UP_RIGHT);
-        for(int i = 0; i<78; ++i) putchar(BOXDRAW_HORIZONTAL);
-        printf("%c\n", BOXDRAW_UP_LEFT);
 
-        BS->WaitForEvent(1, &ST->ConIn->WaitForKey, &idx);
-        EE(ST->ConIn->ReadKeyStroke(ST->ConIn, &key))
+    wait:;
+        int count = 1;
+        if(timer) events[count++] = timer;
+        if(poll) events[count++] = poll;
+        if(probe) events[count++] = probe;
+        if(fetch) events[count++] = fetch;
+        BS->WaitForEvent(count, events, &idx);
+        if(events[idx]==fetch) {
+            if(!prefetch_step())
+                EE(BS->SetTimer(fetch, TimerCancel, 0)) {}
+            goto wait;
+        }
+        // Only a new entry needs a frame.
+        if(events[idx]==probe) {
+            struct partition *found;
+            if(!probe_step(&found))
+                BS->CloseEvent(probe), probe = NULL;
+            // Pending entries are read ahead once they have a path.
+            int resolved = partition_ready() && boot_entries_resolve();
+            if(resolved)
+                fetched = -1;
+            if((!found || !boot_entry_probed(found)) && !resolved)
+                goto wait;
             continue;
+        }
+        if(events[idx]==timer) {
+            if(!--countdown)
+                boot_menuselect(), menu_shadow.valid = 0;
+            continue;
+        }
 
-        switch(key.ScanCode|key.UnicodeChar) {
-        case 'K': case 'k': case SCAN_UP:
-            menuselect = max(menuselect-1, 0);
-            break;
-        case 'J': case 'j': case SCAN_DOWN:
-            menuselect = min(menuselect+1, boot_entries.size-1);
-            break;
-        case CHAR_CARRIAGE_RETURN: case CHAR_LINEFEED:
-            //exit_bs();
-            boot_menuselect();
-            break;
-        case 'E': case 'e':
-            hexdump(GET_BOOT_ENTRY(menuselect)->file_path_list, sizeof(efi_device_path_t));
-            hexdump(LIP->FilePath, sizeof(efi_device_path_t));
-            getchar_timeout();
-            break;
-        case 'Q': case 'q':
-            return;
+        // Drain every queued keystroke before repainting, so held J/K repeat
+        // collapses into a single frame. Keys leaving the menu screen stop
+        // the drain.
+        int drain = 1;
+        while(drain && con_read_key(&key)) {
+            // Any key cancels the countdown.
+            countdown = 0;
+            switch(key.UnicodeChar ? key.UnicodeChar : KEY_SCAN(key.ScanCode)) {
+            case 'K': case 'k': case KEY_SCAN(SCAN_UP):
+                menuselect = max(menuselect-1, 0);
+                break;
+            case 'J': case 'j': case KEY_SCAN(SCAN_DOWN):
+                menuselect = max(min(menuselect+1, boot_entries.size-1), 0);
+                break;
+            case KEY_SCAN(SCAN_PAGE_UP):
+                menuselect = max(menuselect-menu_view.view, 0);
+                break;
+            case KEY_SCAN(SCAN_PAGE_DOWN):
+                menuselect = max(min(menuselect+menu_view.view, boot_entries.size-1), 0);
+                break;
+            case KEY_SCAN(SCAN_HOME):
+                menuselect = 0;
+                break;
+            case KEY_SCAN(SCAN_END):
+                menuselect = max(boot_entries.size-1, 0);
+                break;
+            case CHAR_CARRIAGE_RETURN: case CHAR_LINEFEED:
+                //exit_bs();
+                boot_menuselect();
+                menu_shadow.valid = drain = 0;
+                break;
+            case 'E': case 'e':
+                if(boot_entries.size && boot_entries.entry[menuselect].file_path)
+                    hexdump(boot_entries.entry[menuselect].file_path, sizeof(efi_device_path_t));
+                hexdump(LIP->FilePath, sizeof(efi_device_path_t));
+                con_flush();
+                getchar_timeout(PAUSE_TIMEOUT);
+                menu_shadow.valid = drain = 0;
+                break;
+#ifdef SEFIL_PROFILE
+            case 'P': case 'p':
+                profile_show();
+                menu_shadow.valid = drain = 0;
+                break;
+#endif
+            case 'L': case 'l':
+                log_show();
+                menu_shadow.valid = drain = 0;
+                break;
+            case 'Q': case 'q':
+                goto quit;
+            }
         }
     }
+
+quit:
+    // Every event the menu made is closed on the way out.
+    if(timer)
+        BS->CloseEvent(timer);
+    if(probe)
+        BS->CloseEvent(probe);
+    if(fetch)
+        BS->CloseEvent(fetch);
+    probe_stop();
+    log_flush();
+}
+
+// Zero-interaction fast path when the selection is already known, from
+// BootNext or, with a zero timeout, from SefilLastBooted. Only that single
+// Boot#### is read and the menu screen is never set up. Returns only if the
+// boot failed or the image returned.
+void boot_fast() {
+    uintn_t size;
+    int number = -1;
+    uint16_t *next = var_get(L"BootNext", &global_guid, &size);
+    if(next) {
+        if(size==sizeof(*next))
+            number = *next;
+        // BootNext is one-shot, delete it before trying to boot it.
+        EE(RT->SetVariable(L"BootNext", &global_guid, 0, 0, NULL)) {}
+        free(next);
+    }
+    if(number<0 && !config.timeout)
+        last_kernel_resolve();
+    if(number<0 && !config.timeout)
+        number = last_booted;
+    if(number<0 || !(number>=BOOT_KERNEL ? boot_entry_kernel(number-BOOT_KERNEL, 1)
+                                         : boot_entry_load(number)))
+        return;
+    timeline_mark("fastpath");
+
+    menuselect = 0;
+    boot_menuselect();
+    boot_entries_free();
+    // Do not retry the default entry, let the user pick.
+    config.timeout = TIMEOUT_MENU;
 }
 
 int main(int argc, char *argv[]) {
     (void)argc, (void)argv;
+    timeline_mark("entry");
+    timeline_calibrate();
+    config_load();
+
+    uintn_t size;
+    uint8_t *last = var_get(L"SefilLastBooted", &sefil_guid, &size);
+    if(last && size==sizeof(uint16_t))
+        last_booted = *(uint16_t *)last;
+    else if(last && size==sizeof(uint32_t))
+        last_kernel.id = *(uint32_t *)last, last_kernel.pending = 1;
+    free(last);
+
+    // A key held at startup forces the menu.
+    efi_input_key_t key;
+    if(!EFI_ERROR(ST->ConIn->ReadKeyStroke(ST->ConIn, &key)))
+        config.timeout = TIMEOUT_MENU;
+    else
+        boot_fast();
+    // The menu lists every UKI, the fast path only opened those it needed.
+    uki_scan(NULL);
+    timeline_mark("uki");
+    last_kernel_resolve();
 
     /* Get BootOrder list. */
-    /* NOTE: getenv has a bug, we have to explicitly set size before call. */
-    uintn_t size = EFI_MAXIMUM_VARIABLE_SIZE;
-    uint16_t *boot_order = (uint16_t *)getenv("BootOrder", &size);
+    uint16_t *boot_order = var_get(L"BootOrder", &global_guid, &size);
     int boot_entries_size = size/sizeof(*boot_order);
+    timeline_mark("bootorder");
 
-    /* Iterate all Boot#### entries get from BootOrder. */
-    for(int i = 0; i<boot_entries_size; ++i) {
-        char_t option_name[9];
-        sprintf(option_name, "Boot%04d", boot_order[i]);
-
-        size = EFI_MAXIMUM_VARIABLE_SIZE;
-        efi_load_option_header_t *option = (void *)getenv(option_name, &size);
-        if(option)
-            ADD_BOOT_ENTRY(option, size);
-    }
+    /* Kernel entries from sefil.conf first, then all Boot#### entries
+       listed in BootOrder. */
+    for(int i = 0; i<kernel_entry_count; ++i)
+        boot_entry_kernel(i, 0);
+    boot_vars_scan(boot_order, boot_entries_size);
+    for(int i = 0; i<boot_entries.size; ++i)
+        if((int)boot_entries.entry[i].number==last_booted)
+            menuselect = i;
+    timeline_mark("bootvars");
 
     // Disable Firmware BootManager watchdog timer.
     EE(BS->SetWatchdogTimer(0, 0xB00B5, 0, NULL)) {}
+    // Zero timeout boots the default entry without painting the menu,
+    // the menu only shows up if that boot fails.
+    if(!config.timeout && boot_entries.size)
+        boot_menuselect(), config.timeout = TIMEOUT_MENU;
     menu();
 
-    for(int i = 0; i<boot_entries.size; ++i)
-        free(GET_BOOT_ENTRY(i));
+    boot_entries_free();
     free(boot_order);
     RT->ResetSystem(EfiResetShutdown, 0, 0, NULL);
     return 0;
@@ -0,0 +1,84 @@
+#include "sefil.h"
+
+// Chunk-parallel work on the application processors. Every processor
+// claims the next index until none are left. Work runs on APs, which may
+// not call firmware services, log or allocate, only compute on memory.
+// The BSP waits inside a blocking StartupAllAPs: it returns as soon as the
+// last AP does, while the non-blocking form is only polled on a 100 ms
+// timer in EDK2.
+#define EFI_MP_SERVICES_PROTOCOL_GUID { 0x3fdda605, 0xa76e, 0x4f46, {0xad, 0x29, 0x12, 0xf4, 0x53, 0x1b, 0x3d, 0x08} }
+
+typedef void (EFIAPI *efi_ap_procedure_t)(void *ProcedureArgument);
+typedef struct efi_mp_services_s efi_mp_services_t;
+struct efi_mp_services_s {
+    efi_status_t (EFIAPI *GetNumberOfProcessors)(efi_mp_services_t *This, uintn_t *NumberOfProcessors,
+                                                 uintn_t *NumberOfEnabledProcessors);
+    void *GetProcessorInfo;
+    efi_status_t (EFIAPI *StartupAllAPs)(efi_mp_services_t *This, efi_ap_procedure_t Procedure,
+                                         boolean_t SingleThread, efi_event_t WaitEvent,
+                                         uintn_t TimeoutInMicroSeconds, void *ProcedureArgument,
+                                         uintn_t **FailedCpuList);
+    void *StartupThisAP, *SwitchBSP, *EnableDisableAP, *WhoAmI;
+};
+
+int mp_enabled = 1;
+struct mp_stats mp_stats;
+
+struct {
+    efi_mp_services_t *services;
+    int aps;
+    mp_work_t work;
+    void *arg;
+    uintn_t count;
+    uintn_t next;
+} mp;
+
+static void mp_loop() {
+    for(uintn_t i; (i = __atomic_fetch_add(&mp.next, 1, __ATOMIC_RELAXED))<mp.count;)
+        mp.work(mp.arg, i);
+}
+
+static void EFIAPI mp_ap(void *arg) {
+    (void)arg;
+    mp_loop();
+}
+
+static void mp_init() {
+    efi_guid_t guid = EFI_MP_SERVICES_PROTOCOL_GUID;
+    uintn_t total, enabled;
+    if(EFI_ERROR(BS->LocateProtocol(&guid, NULL, (void **)&mp.services))) {
+        log_printf(LOG_INFO, "mp: no MP services, single core");
+        return;
+    }
+    EE(mp.services->GetNumberOfProcessors(mp.services, &total, &enabled))
+        return;
+    mp.aps = enabled-1;
+    log_printf(LOG_INFO, "mp: %d processors, %d enabled", total, enabled);
+}
+
+// Processors work would be spread over. MP services are looked up on
+// first use, a boot that never spreads work never asks.
+int mp_cpus() {
+    static int ready;
+    if(!ready)
+        ready = 1, mp_init();
+    return mp_enabled && mp.aps>1 ? mp.aps : 1;
+}
+
+// work(arg, i) for every i below count, back when all are done. With a
+// single AP the BSP does the work itself, which spares the startup.
+void mp_run(mp_work_t work, void *arg, uintn_t count) {
+    mp.work = work, mp.arg = arg, mp.count = count, mp.next = 0;
+    uint64_t start = rdtsc();
+    int cpus = count>1 ? mp_cpus() : 1;
+    if(cpus>1)
+        EE(mp.services->StartupAllAPs(mp.services, mp_ap, 0, NULL, 0, NULL, NULL))
+            cpus = 1;
+    // Whatever the APs left, all of it if they never started.
+    mp_loop();
+    ++mp_stats.runs;
+    mp_stats.items += count;
+    mp_stats.cycles += rdtsc()-start;
+    if(cpus>1)
+        ++mp_stats.parallel;
+}
@@ -0,0 +1,227 @@
+#include "sefil.h"
+
+// Validate the PE32+ headers in data and find the section table, NULL for
+// anything but an x64 image whose headers fit in data.
+pe_header_t *pe_parse(const uint8_t *data, uintn_t size, pe_section_t **sections) {
+    if(size<0x40 || data[0]!='M' || data[1]!='Z')
+        return NULL;
+    uint32_t offset = *(const uint32_t *)(data+0x3C);
+    if(offset>size || size-offset<sizeof(pe_header_t))
+        return NULL;
+    pe_header_t *pe = (pe_header_t *)(data+offset);
+    if(pe->signature!=PE_SIGNATURE || pe->machine!=PE_MACHINE_X64 || pe->magic!=PE_MAGIC_PE32PLUS
+       || pe->optional_size<PE_OPTIONAL_MIN)
+        return NULL;
+    uintn_t table = offset+PE_OPTIONAL_OFFSET+pe->optional_size;
+    if(table>size || (size-table)/sizeof(pe_section_t)<pe->sections)
+        return NULL;
+    *sections = (pe_section_t *)(data+table);
+    return pe;
+}
+
+// Image mapped by pe_load(), at most one at a time.
+struct {
+    efi_handle_t handle;
+    efi_loaded_image_protocol_t loaded;
+    efi_device_path_t *path;
+    efi_physical_address_t base;
+    uintn_t pages;
+    efi_status_t (EFIAPI *entry)(efi_handle_t image, efi_system_table_t *system);
+} pe_image;
+
+#define EFI_LOADED_IMAGE_DEVICE_PATH_PROTOCOL_GUID { 0xbc62157e, 0x3e33, 0x4fec, {0x99, 0x20, 0x2d, 0x3b, 0x36, 0xd7, 0x50, 0xdf} }
+static efi_guid_t loaded_image_guid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
+static efi_guid_t loaded_image_path_guid = EFI_LOADED_IMAGE_DEVICE_PATH_PROTOCOL_GUID;
+
+// Apply the base relocations in one pass over the .reloc directory. Only
+// DIR64 is meaningful for x64, anything else fails the load. So does an
+// image without relocations, stripped or not, it only runs at its base.
+static int pe_relocate(pe_header_t *pe, uint8_t *image, uint64_t delta) {
+    if(pe->directories<=PE_DIRECTORY_RELOC || !pe->directory[PE_DIRECTORY_RELOC].size)
+        return 0;
+    uint32_t rva = pe->directory[PE_DIRECTORY_RELOC].rva;
+    uint32_t end = rva+pe->directory[PE_DIRECTORY_RELOC].size;
+    if(end<rva || end>pe->image_size)
+        return 0;
+    while(end-rva>=8) {
+        uint32_t page = *(uint32_t *)(image+rva), block = *(uint32_t *)(image+rva+4);
+        if(block<8 || block>end-rva)
+            return 0;
+        uint16_t *fixup = (uint16_t *)(image+rva+8);
+        for(uint32_t i = 0; i<(block-8)/2; ++i) {
+            uint32_t target = page+(fixup[i] & 0xFFF);
+            switch(fixup[i]>>12) {
+            case PE_RELOC_ABSOLUTE:
+                break;
+            case PE_RELOC_DIR64:
+                if(target>pe->image_size-8)
+                    return 0;
+                *(uint64_t *)(image+target) += delta;
+                break;
+            default:
+                log_printf(LOG_WARN, "pe: relocation type %d", (uint64_t)(fixup[i]>>12));
+                return 0;
+            }
+        }
+        rva += block;
+    }
+    return 1;
+}
+
+static int pe_read(efi_file_handle_t *file, uint64_t offset, void *data, uintn_t size) {
+    EE(file->SetPosition(file, offset))
+        return 0;
+    uintn_t read = size;
+    EE(file->Read(file, &read, data))
+        return 0;
+    return read==size;
+}
+
+// Map an EFI application without a second copy: the headers are parsed from
+// the first page, SizeOfImage is allocated at the preferred base if it is
+// free, and every section is read from the file straight to its final
+// address. Returns a handle with LoadedImage installed, NULL if the image
+// has to go through firmware LoadImage instead. A nonzero size maps the
+// image embedded at offset in the file, as a UKI .linux section.
+efi_handle_t pe_load(efi_device_path_t *path, uint64_t offset, uint64_t size) {
+    efi_handle_t device;
+    efi_device_path_t *file_path;
+    efi_file_handle_t *file = file_open(path, &device, &file_path);
+    if(!file)
+        return NULL;
+    if(pe_image.handle)
+        goto close;
+    uint64_t start = rdtsc(), file_bytes = size ? size : file_size(file);
+
+    static uint8_t head[4096];
+    uintn_t head_size = min(file_bytes, sizeof(head));
+    pe_section_t *sections;
+    pe_header_t *pe;
+    if(!pe_read(file, offset, head, head_size) || !(pe = pe_parse(head, head_size, &sections))
+       || pe->subsystem!=PE_SUBSYSTEM_EFI_APPLICATION || pe->section_alignment<EFI_PAGE_SIZE
+       || pe->section_alignment%EFI_PAGE_SIZE || pe->headers_size>pe->image_size) {
+        log_printf(LOG_INFO, "pe: not a mappable x64 EFI application");
+        goto close;
+    }
+
+    // The preferred base is often taken, that is not worth a log line.
+    efi_physical_address_t base = pe->image_base;
+    uintn_t pages = EFI_SIZE_TO_PAGES(pe->image_size);
+    if(pe->image_base%EFI_PAGE_SIZE
+       || EFI_ERROR(BS->AllocatePages(AllocateAddress, EfiLoaderCode, pages, &base)))
+        EE(BS->AllocatePages(AllocateAnyPages, EfiLoaderCode, pages, &base))
+            goto close;
+    uint8_t *image = (uint8_t *)(uintn_t)base;
+
+    // Headers, then each section, zeroing only what the file does not cover.
+    uint32_t headers = min(pe->headers_size, (uint32_t)head_size);
+    memcpy(image, head, headers);
+    uint32_t first = pe->sections ? min(sections[0].virtual_address, pe->image_size) : pe->image_size;
+    if(first>headers)
+        memset(image+headers, 0, first-headers);
+    for(int i = 0; i<pe->sections; ++i) {
+        pe_section_t *section = &sections[i];
+        uint32_t va = section->virtual_address, vs = section->virtual_size;
+        uint32_t raw = min(section->raw_size, vs);
+        uint32_t span = (vs+pe->section_alignment-1) & ~(pe->section_alignment-1);
+        if(va<headers || va>pe->image_size || vs>pe->image_size-va
+           || (raw && (section->raw_offset>file_bytes || raw>file_bytes-section->raw_offset))) {
+            log_printf(LOG_WARN, "pe: section %d out of bounds", (int64_t)i);
+            goto free;
+        }
+        if(raw && !pe_read(file, offset+section->raw_offset, image+va, raw))
+            goto free;
+        memset(image+va+raw, 0, min(span, pe->image_size-va)-raw);
+    }
+    if(base!=pe->image_base && !pe_relocate(pe, image, base-pe->image_base)) {
+        log_printf(LOG_WARN, "pe: cannot relocate to %x", base);
+        goto free;
+    }
+    file->Close(file);
+
+    pe_image.loaded = (efi_loaded_image_protocol_t){
+        .Revision = EFI_LOADED_IMAGE_PROTOCOL_REVISION,
+        .ParentHandle = IM,
+        .SystemTable = ST,
+        .DeviceHandle = device,
+        .FilePath = file_path,
+        .ImageBase = image,
+        .ImageSize = pe->image_size,
+        .ImageCodeType = EfiLoaderCode,
+        .ImageDataType = EfiLoaderData,
+    };
+    pe_image.path = path;
+    pe_image.base = base, pe_image.pages = pages;
+    pe_image.entry = (void *)(image+pe->entry);
+    pe_image.handle = NULL;
+    EE(((efi_install_protocol_interface_t)BS->InstallProtocolInterface)(
+           &pe_image.handle, &loaded_image_guid, 0, &pe_image.loaded)) {
+        BS->FreePages(base, pages);
+        return pe_image.handle = NULL;
+    }
+    EE(((efi_install_protocol_interface_t)BS->InstallProtocolInterface)(
+           &pe_image.handle, &loaded_image_path_guid, 0, path)) {}
+    log_printf(LOG_INFO, "pe: %d bytes mapped at %x in %d us", (uint64_t)pe->image_size,
+               base, tsc_to_us(rdtsc()-start));
+    return pe_image.handle;
+
+free:
+    BS->FreePages(base, pages);
+close:
+    file->Close(file);
+    return NULL;
+}
+
+int pe_loaded(efi_handle_t handle) {
+    return handle && handle==pe_image.handle;
+}
+
+void pe_unload() {
+    if(!pe_image.handle)
+        return;
+    EE(((efi_uninstall_protocol_interface_t)BS->UninstallProtocolInterface)(
+           pe_image.handle, &loaded_image_path_guid, pe_image.path)) {}
+    EE(((efi_uninstall_protocol_interface_t)BS->UninstallProtocolInterface)(
+           pe_image.handle, &loaded_image_guid, &pe_image.loaded)) {}
+    BS->FreePages(pe_image.base, pe_image.pages);
+    pe_image.handle = NULL;
+}
+
+// The firmware only knows its own image handles, so BS->Exit is hooked
+// while a mapped image runs and unwinds back into pe_start(). libuefi has
+// no setjmp, the compiler builtins are enough here.
+static void *pe_exit_jump[5];
+static efi_status_t pe_exit_status;
+static efi_exit_t pe_firmware_exit;
+
+static void pe_patch_exit(efi_exit_t exit) {
+    uint32_t crc = 0;
+    BS->Exit = exit;
+    BS->Hdr.CRC32 = 0;
+    BS->CalculateCrc32(BS, BS->Hdr.HeaderSize, &crc);
+    BS->Hdr.CRC32 = crc;
+}
+
+static efi_status_t EFIAPI pe_exit(efi_handle_t image, efi_status_t status, uintn_t size,
+                                   wchar_t *data) {
+    if(image!=pe_image.handle)
+        return pe_firmware_exit(image, status, size, data);
+    if(data)
+        BS->FreePool(data);
+    pe_exit_status = status;
+    __builtin_longjmp(pe_exit_jump, 1);
+}
+
+// Run the mapped image, it is unloaded once it returns or exits.
+efi_status_t pe_start(efi_handle_t handle) {
+    efi_status_t status;
+    pe_firmware_exit = BS->Exit;
+    pe_patch_exit(pe_exit);
+    if(!__builtin_setjmp(pe_exit_jump))
+        status = pe_image.entry(handle, ST);
+    else
+        status = pe_exit_status;
+    pe_patch_exit(pe_firmware_exit);
+    pe_unload();
+    return status;
+}
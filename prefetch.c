@@ -0,0 +1,234 @@
+#include "sefil.h"
+
+// Files of the highlighted menu entry read into memory while the menu waits
+// for a key, a slice per idle tick, so reading the kernel and initrd
+// overlaps the user's reaction. file_open() then serves them from memory
+// through a read-only EFI_FILE_PROTOCOL, finishing any part not read yet,
+// and every loader, the digest check and the initrd LoadFile2 read them
+// as they would the disk.
+enum {
+    PREFETCH_FILES = 1+INITRD_MAX,
+    PREFETCH_CHUNK = 1024*1024, PREFETCH_SLICE_US = 5000,
+    PREFETCH_MAX = 512*1024*1024,
+};
+enum { PREFETCH_QUEUED, PREFETCH_READING, PREFETCH_DONE, PREFETCH_FAILED };
+
+struct prefetch_file {
+    efi_device_path_t *path;
+    uintn_t path_size;
+    efi_file_handle_t *file;
+    efi_file_info_t info;
+    uint8_t *data;
+    uintn_t pages;
+    uint64_t done, start;
+    int state, served;
+};
+
+// A handle on a fetched file, its own position.
+struct prefetch_handle {
+    efi_file_handle_t file;
+    struct prefetch_file *source;
+    uint64_t position;
+};
+
+int prefetch_enabled = 1;
+
+struct {
+    int count, opening;
+    uint64_t allocated;
+    struct prefetch_file file[PREFETCH_FILES];
+} prefetch;
+
+static uintn_t path_size(efi_device_path_t *path) {
+    efi_device_path_t *node = path;
+    while(!IsDevicePathEnd(node)) node = NextDevicePathNode(node);
+    return (uint8_t *)node-(uint8_t *)path+END_DEVICE_PATH_LENGTH;
+}
+
+static void prefetch_close(struct prefetch_file *f) {
+    if(f->file)
+        f->file->Close(f->file), f->file = NULL;
+}
+
+// Drop every file, read or not.
+void prefetch_cancel() {
+    for(int i = 0; i<prefetch.count; ++i) {
+        struct prefetch_file *f = &prefetch.file[i];
+        prefetch_close(f);
+        if(f->data)
+            BS->FreePages((efi_physical_address_t)(uintn_t)f->data, f->pages);
+    }
+    prefetch.count = 0;
+    prefetch.allocated = 0;
+}
+
+// Queue the file at path, which has to stay valid until prefetch_cancel().
+void prefetch_add(efi_device_path_t *path) {
+    if(!path || prefetch.count==PREFETCH_FILES)
+        return;
+    uintn_t size = path_size(path);
+    for(int i = 0; i<prefetch.count; ++i)
+        if(prefetch.file[i].path_size==size && !memcmp(prefetch.file[i].path, path, size))
+            return;
+    prefetch.file[prefetch.count++] = (struct prefetch_file){
+        .path = path, .path_size = size, .state = PREFETCH_QUEUED
+    };
+}
+
+// Read up to size more bytes of f, opening it first.
+static void prefetch_read(struct prefetch_file *f, uint64_t size) {
+    if(f->state==PREFETCH_QUEUED) {
+        efi_guid_t info_guid = EFI_FILE_INFO_GUID;
+        uintn_t info_size = sizeof(f->info);
+        efi_physical_address_t pages;
+        f->state = PREFETCH_FAILED;
+        f->start = rdtsc();
+        prefetch.opening = 1;
+        f->file = file_open(f->path, NULL, NULL);
+        prefetch.opening = 0;
+        if(f->file && !EFI_ERROR(f->file->GetInfo(f->file, &info_guid, &info_size, &f->info))
+           && f->info.FileSize<=PREFETCH_MAX-prefetch.allocated) {
+            f->pages = EFI_SIZE_TO_PAGES(f->info.FileSize);
+            if(!f->pages)
+                f->state = PREFETCH_DONE;
+            else EE(BS->AllocatePages(AllocateAnyPages, EfiLoaderData, f->pages, &pages)) {}
+            else {
+                f->data = (uint8_t *)(uintn_t)pages;
+                prefetch.allocated += f->info.FileSize;
+                f->state = PREFETCH_READING;
+            }
+        }
+    }
+    while(f->state==PREFETCH_READING && size) {
+        uintn_t chunk = min(min(f->info.FileSize-f->done, LOAD_CHUNK), size);
+        EE(f->file->Read(f->file, &chunk, f->data+f->done))
+            chunk = 0;
+        if(!chunk && f->done<f->info.FileSize) {
+            f->state = PREFETCH_FAILED;
+            break;
+        }
+        f->done += chunk, size -= chunk;
+        if(f->done==f->info.FileSize) {
+            f->state = PREFETCH_DONE;
+            log_printf(LOG_DEBUG, "prefetch: %d bytes in %d us", f->done, tsc_to_us(rdtsc()-f->start));
+        }
+    }
+    if(f->state!=PREFETCH_READING)
+        prefetch_close(f);
+}
+
+// One idle tick: read for PREFETCH_SLICE_US at most, in PREFETCH_CHUNK
+// transfers. 0 once nothing is left.
+int prefetch_step() {
+    uint64_t start = rdtsc();
+    for(int i = 0; i<prefetch.count; ++i) {
+        struct prefetch_file *f = &prefetch.file[i];
+        while((f->state==PREFETCH_QUEUED || f->state==PREFETCH_READING)
+              && tsc_to_us(rdtsc()-start)<PREFETCH_SLICE_US)
+            prefetch_read(f, PREFETCH_CHUNK);
+        if(f->state==PREFETCH_QUEUED || f->state==PREFETCH_READING)
+            return 1;
+    }
+    return 0;
+}
+
+static efi_status_t EFIAPI prefetch_file_open(efi_file_handle_t *This, efi_file_handle_t **NewHandle,
+                                              wchar_t *FileName, uint64_t OpenMode, uint64_t Attributes) {
+    (void)This, (void)NewHandle, (void)FileName, (void)OpenMode, (void)Attributes;
+    return EFI_UNSUPPORTED;
+}
+
+static efi_status_t EFIAPI prefetch_file_close(efi_file_handle_t *This) {
+    free(This);
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI prefetch_file_delete(efi_file_handle_t *This) {
+    free(This);
+    return EFI_WARN_DELETE_FAILURE;
+}
+
+static efi_status_t EFIAPI prefetch_file_read(efi_file_handle_t *This, uintn_t *BufferSize, void *Buffer) {
+    struct prefetch_handle *handle = (struct prefetch_handle *)This;
+    uint64_t size = handle->source->info.FileSize;
+    uintn_t length = handle->position<size ? min(*BufferSize, size-handle->position) : 0;
+    memcpy(Buffer, handle->source->data+handle->position, length);
+    handle->position += length;
+    *BufferSize = length;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI prefetch_file_write(efi_file_handle_t *This, uintn_t *BufferSize, void *Buffer) {
+    (void)This, (void)BufferSize, (void)Buffer;
+    return EFI_WRITE_PROTECTED;
+}
+
+static efi_status_t EFIAPI prefetch_file_get_position(efi_file_handle_t *This, uint64_t *Position) {
+    *Position = ((struct prefetch_handle *)This)->position;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI prefetch_file_set_position(efi_file_handle_t *This, uint64_t Position) {
+    struct prefetch_handle *handle = (struct prefetch_handle *)This;
+    handle->position = Position==~0ull ? handle->source->info.FileSize : Position;
+    return EFI_SUCCESS;
+}
+
+// The information of the file on disk, so the digest cache sees the same
+// identity.
+static efi_status_t EFIAPI prefetch_file_get_info(efi_file_handle_t *This, efi_guid_t *InformationType,
+                                                  uintn_t *BufferSize, void *Buffer) {
+    struct prefetch_file *f = ((struct prefetch_handle *)This)->source;
+    efi_guid_t info_guid = EFI_FILE_INFO_GUID;
+    if(memcmp(InformationType, &info_guid, sizeof(info_guid)))
+        return EFI_UNSUPPORTED;
+    uintn_t size = min(f->info.Size, sizeof(f->info));
+    if(*BufferSize<size) {
+        *BufferSize = size;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+    memcpy(Buffer, &f->info, size);
+    *BufferSize = size;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI prefetch_file_set_info(efi_file_handle_t *This, efi_guid_t *InformationType,
+                                                  uintn_t BufferSize, void *Buffer) {
+    (void)This, (void)InformationType, (void)BufferSize, (void)Buffer;
+    return EFI_WRITE_PROTECTED;
+}
+
+static efi_status_t EFIAPI prefetch_file_flush(efi_file_handle_t *This) {
+    (void)This;
+    return EFI_SUCCESS;
+}
+
+// The fetched file at path, read to the end first if the idle ticks did not
+// get that far. NULL for files not queued or that could not be read.
+efi_file_handle_t *prefetch_open(efi_device_path_t *path) {
+    if(prefetch.opening || !prefetch.count)
+        return NULL;
+    uintn_t size = path_size(path);
+    struct prefetch_file *f = NULL;
+    for(int i = 0; i<prefetch.count && !f; ++i)
+        if(prefetch.file[i].path_size==size && !memcmp(prefetch.file[i].path, path, size))
+            f = &prefetch.file[i];
+    if(!f)
+        return NULL;
+    uint64_t ahead = f->done;
+    prefetch_read(f, ~0ull);
+    struct prefetch_handle *handle = f->state==PREFETCH_DONE ? malloc(sizeof(*handle)) : NULL;
+    if(!handle)
+        return NULL;
+    *handle = (struct prefetch_handle){
+        .file = {
+            EFI_FILE_PROTOCOL_REVISION, prefetch_file_open, prefetch_file_close, prefetch_file_delete,
+            prefetch_file_read, prefetch_file_write, prefetch_file_get_position, prefetch_file_set_position,
+            prefetch_file_get_info, prefetch_file_set_info, prefetch_file_flush
+        },
+        .source = f,
+    };
+    if(!f->served++)
+        log_printf(LOG_INFO, "prefetch: %d of %d bytes read ahead", ahead, f->info.FileSize);
+    return &handle->file;
+}
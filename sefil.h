@@ -0,0 +1,469 @@
+#ifndef _SEFIL_H_
+#define _SEFIL_H_
+
+#include <uefi.h>
+
+// uefi.h has no stddef.h.
+#ifndef offsetof
+#define offsetof(T, M) __builtin_offsetof(T, M)
+#endif
+
+// libuefi's memcpy, memmove and memset go a byte at a time. The string
+// instructions take the fast string path on any x86-64 with ERMS instead.
+// Small constant sizes are left to the compiler, which inlines moves.
+static inline void *sefil_memcpy(void *to, const void *from, size_t size) {
+    if(__builtin_constant_p(size) && size<=64)
+        return __builtin_memcpy(to, from, size);
+    void *dest = to;
+    __asm__ __volatile__("rep movsb" : "+D"(to), "+S"(from), "+c"(size) : : "memory");
+    return dest;
+}
+
+// Forwards unless the destination overlaps the end of the source.
+static inline void *sefil_memmove(void *to, const void *from, size_t size) {
+    if((uint8_t *)to<=(const uint8_t *)from || (uint8_t *)to>=(const uint8_t *)from+size)
+        return sefil_memcpy(to, from, size);
+    uint8_t *last = (uint8_t *)to+size-1;
+    const uint8_t *source = (const uint8_t *)from+size-1;
+    __asm__ __volatile__("std; rep movsb; cld" : "+D"(last), "+S"(source), "+c"(size) : : "memory");
+    return to;
+}
+
+static inline void *sefil_memset(void *to, int c, size_t size) {
+    if(__builtin_constant_p(size) && size<=64)
+        return __builtin_memset(to, c, size);
+    void *dest = to;
+    __asm__ __volatile__("rep stosb" : "+D"(to), "+c"(size) : "a"(c) : "memory");
+    return dest;
+}
+
+// Variadic, so compound literal arguments pass through.
+#define memcpy(...) sefil_memcpy(__VA_ARGS__)
+#define memmove(...) sefil_memmove(__VA_ARGS__)
+#define memset(...) sefil_memset(__VA_ARGS__)
+
+/*** Console ***/
+// Buffered console output, text and attribute changes are collected and
+// flushed with one OutputString per attribute run.
+struct con_stats {
+    uint32_t calls;         // firmware calls since con_init()
+    uint32_t frame_calls;   // firmware calls of the last finished frame
+};
+extern struct con_stats con_stats;
+
+// Output backends, con.c keeps the buffering and cursor tracking. str has
+// room for a terminating NUL at str[len]. read_key is for backends with
+// input of their own, which is polled on a timer.
+struct con_backend {
+    int (*init)(int *cols, int *rows, int *col, int *row);
+    void (*clear)(int attr);
+    void (*position)(int col, int row);
+    void (*output)(int attr, wchar_t *str, int len);
+    void (*present)();
+    int (*read_key)(efi_input_key_t *key);
+    // Give back what was taken from the firmware console before an image
+    // starts, take it again once it returned.
+    void (*handover)(int leaving);
+};
+extern struct con_backend con_text, con_gop, con_serial;
+enum { CON_TEXT, CON_GOP, CON_SERIAL };
+
+void con_select(int backend);
+int con_read_key(efi_input_key_t *key);
+efi_event_t con_poll_event();
+void con_handover(int leaving);
+
+void con_init();
+void con_clear(int attr);
+void con_attr(int attr);
+void con_goto(int col, int row);
+void con_putc(wchar_t c);
+void con_fill(wchar_t c, int n);
+void con_puts(const wchar_t *str, int n);
+int con_printf(const char *fmt, ...);
+void con_flush();
+void con_frame();
+int con_cols();
+int con_rows();
+
+/*** Logging and EFI status handling ***/
+// Log severities, everything is recorded in the log ring. Only SEFIL_DEBUG
+// builds echo to the console and wait for a key.
+enum { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG };
+void log_printf(int level, const char *fmt, ...);
+void log_flush();
+
+// Wait for a key stroke for up to timeout seconds, 0 on timeout.
+enum { PAUSE_TIMEOUT = 30 };
+uint16_t getchar_timeout(unsigned timeout);
+
+#ifdef SEFIL_DEBUG
+#define DEBUG_PAUSE() (con_printf("Press any key to continue ...\r\n"),        \
+                       con_flush(), getchar_timeout(PAUSE_TIMEOUT))
+#else
+#define DEBUG_PAUSE() (void)0
+#endif
+
+#define assert(X) (!(X)                                                         \
+        ? log_printf(LOG_ERROR, "%s:%d: Assertion! %s", __FILE__, __LINE__, #X),\
+          log_flush(), DEBUG_PAUSE(), abort()                                   \
+        : (void)0)
+
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return (uint64_t)hi<<32 | lo;
+}
+
+// EFI function call error/warning status handling.
+#ifndef SEFIL_PROFILE
+#define EE(F) if((ECS = F) && efi_call_log(__FILE__, __LINE__, #F))
+#else
+#define EE(F) if((profile_start = rdtsc(), ECS = F,                            \
+                  profile_call(__FILE__, __LINE__, #F), ECS)                    \
+                 && efi_call_log(__FILE__, __LINE__, #F))
+
+// Per call site firmware latency in TSC cycles, keyed by __FILE__:__LINE__.
+enum { PROFILE_MAX = 64 };
+struct profile_site {
+    const char *file;
+    const char *func;
+    int line;
+    uint32_t count;
+    uint64_t total, min, max;
+};
+extern struct profile_site profile[PROFILE_MAX];
+extern uint64_t profile_start;
+
+static inline void profile_call(const char *file, int line, const char *func) {
+    uint64_t cycles = rdtsc()-profile_start;
+    // Open addressing on the line number, sites beyond PROFILE_MAX are dropped.
+    for(int n = 0, h = line%PROFILE_MAX; n<PROFILE_MAX; ++n, h = (h+1)%PROFILE_MAX) {
+        struct profile_site *site = &profile[h];
+        if(!site->count) {
+            site->file = file, site->line = line, site->func = func;
+            site->min = cycles;
+        }
+        else if(site->line!=line || (site->file!=file && strcmp(site->file, file)))
+            continue;
+        ++site->count;
+        site->total += cycles;
+        site->min = min(site->min, cycles);
+        site->max = max(site->max, cycles);
+        return;
+    }
+}
+#endif
+extern efi_status_t ECS;
+static inline efi_status_t efi_call_log(const char *file, int line, const char *func) {
+    if(EFI_ERROR(ECS))
+        log_printf(LOG_ERROR, "%s:%d: EFI error: %s: %d", file, (int64_t)line,
+                   func, ~EFI_ERROR_MASK&ECS);
+    else // EFI oem_error or warning.
+        log_printf(LOG_WARN, "%s:%d: EFI warning: %s: %d", file, (int64_t)line,
+                   func, ECS);
+    DEBUG_PAUSE();
+    // Discard warnings.
+    return EFI_ERROR(ECS);
+}
+
+/*** Timeline ***/
+void timeline_mark(const char *name);
+uint64_t tsc_to_us(uint64_t tsc);
+
+/*** Variables and ESP files ***/
+// sefil variables are volatile but runtime accessible, so the OS can collect
+// them through efivarfs without wearing out NVRAM on every boot.
+extern efi_guid_t sefil_guid;
+extern efi_guid_t global_guid;
+enum { SEFIL_VAR_ATTR = EFI_VARIABLE_BOOTSERVICE_ACCESS|EFI_VARIABLE_RUNTIME_ACCESS };
+#define SEFIL_DIR "\\EFI\\sefil"
+
+void *var_get(wchar_t *name, efi_guid_t *guid, uintn_t *size);
+void *arena_alloc(size_t size);
+int esp_write(const char *path, const void *data, size_t size);
+
+/*** Image verification ***/
+// SHA-256 over the bytes read from disk, checked against digests pinned by
+// path in sefil.conf.
+enum { SHA256_SIZE = 32, SHA256_BLOCK = 64, PINS_MAX = 32 };
+struct sha256 {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t buffer[SHA256_BLOCK];
+};
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *data, uintn_t size);
+void sha256_update_ap(struct sha256 *ctx, const void *data, uintn_t size);
+void sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_SIZE]);
+
+void verify_config(char *value);
+const uint8_t *verify_pin(efi_device_path_t *path);
+int verify_cached(efi_device_path_t *path, const uint8_t *pin);
+int verify_check(struct sha256 *hash, const uint8_t *pin);
+extern int verify_reverify;
+
+/*** Image and file loading ***/
+// Media device path nodes, not defined in uefi.h.
+enum { MEDIA_DEVICE_PATH = 4 };
+enum { MEDIA_HARDDRIVE_DP = 1, MEDIA_VENDOR_DP = 3, MEDIA_FILEPATH_DP = 4 };
+
+// Both are ms_abi but declared void * in uefi.h.
+typedef efi_status_t (EFIAPI *efi_install_protocol_interface_t)(efi_handle_t *Handle,
+    efi_guid_t *Protocol, int InterfaceType, void *Interface);
+typedef efi_status_t (EFIAPI *efi_uninstall_protocol_interface_t)(efi_handle_t Handle,
+    efi_guid_t *Protocol, void *Interface);
+
+enum { LOADER_NATIVE, LOADER_BUFFER, LOADER_FIRMWARE };
+enum { LOAD_CHUNK = 16*1024*1024 };
+wchar_t *file_name(efi_device_path_t *path, efi_handle_t *device, efi_device_path_t **file_path);
+efi_file_handle_t *file_open(efi_device_path_t *path, efi_handle_t *device,
+                             efi_device_path_t **file_path);
+uint64_t file_size(efi_file_handle_t *file);
+void *file_load(efi_file_handle_t *file, uint64_t *size, uintn_t *pages, struct sha256 *hash);
+int secure_boot();
+efi_handle_t load_image(efi_device_path_t *path, uint64_t offset, uint64_t size, int loader,
+                        struct sha256 *hash);
+void image_set_options(efi_handle_t image, void *options, uint32_t size);
+efi_status_t image_start(efi_handle_t image);
+void image_unload(efi_handle_t image);
+
+extern int prefetch_enabled;
+void prefetch_add(efi_device_path_t *path);
+int prefetch_step();
+void prefetch_cancel();
+efi_file_handle_t *prefetch_open(efi_device_path_t *path);
+
+/*** Native file systems ***/
+// Volumes sefil reads through BlockIo itself, file_open() falls back to the
+// firmware's SimpleFS for anything else. ext4 volumes usually have no
+// SimpleFS, files on them are found through the partition's BlockIo.
+extern efi_guid_t block_io_guid;
+enum { BLOCK_DEVS_MAX = 64, BLOCK_UNIT = 4096, BLOCK_UNITS = 64, BLOCK_BOUNCE = 1024*1024 };
+enum { FS_UNKNOWN, FS_NONE, FS_FAT, FS_EXT4 };
+// Disk offset of a run that is not stored and reads as zeros.
+#define BLOCK_HOLE (~0ull)
+struct block_dev {
+    efi_handle_t handle;
+    efi_block_io_t *bio;
+    uint32_t media_id, block_size, io_align;
+    uint64_t size;
+    int fs;
+    void *fs_data;
+};
+struct block_stats {
+    uint64_t reads, bytes, hits, misses;
+};
+extern struct block_stats block_stats;
+extern int block_native;
+
+// Open files, followed by the file system's own state. map gives the disk
+// offset of the byte at pos and how many bytes from there are contiguous
+// on disk, up to at least max when the layout allows.
+struct block_file {
+    efi_file_handle_t file;
+    struct block_dev *dev;
+    uint64_t size, position;
+    efi_time_t ctime, mtime;
+    int (*map)(struct block_file *file, uint64_t pos, uint64_t max, uint64_t *disk, uint64_t *length);
+    uint32_t reads;
+    uint64_t bytes;
+    wchar_t name[256];
+};
+
+struct block_dev *block_get(efi_handle_t handle);
+int block_read(struct block_dev *dev, uint64_t offset, uint64_t size, void *buffer);
+const void *block_cached(struct block_dev *dev, uint64_t offset, uintn_t size);
+struct block_file *block_file_new(struct block_dev *dev, uintn_t size);
+efi_file_handle_t *block_open(efi_handle_t volume, const wchar_t *name);
+void block_flush();
+
+int fat_mount(struct block_dev *dev);
+void fat_unmount(struct block_dev *dev);
+struct block_file *fat_open(struct block_dev *dev, const wchar_t *name);
+int ext4_mount(struct block_dev *dev);
+void ext4_unmount(struct block_dev *dev);
+struct block_file *ext4_open(struct block_dev *dev, const wchar_t *name);
+
+/*** GPT ***/
+// An entry of a disk's partition table, with the firmware's handle for the
+// partition if it made one.
+enum { PARTITION_NAME_MAX = 36 };
+struct partition {
+    efi_guid_t type, uuid;
+    efi_handle_t disk, handle;
+    uint64_t first, last;
+    uint32_t number;
+    wchar_t name[PARTITION_NAME_MAX+1];
+    struct partition *next_uuid, *next_type;
+};
+extern int probe_enabled;
+
+struct partition *partition_find(const efi_guid_t *uuid);
+struct partition *partition_type(const efi_guid_t *type, struct partition *after);
+int partition_ready();
+int probe_start();
+int probe_step(struct partition **found);
+void probe_stop();
+
+/*** PE32+ ***/
+// https://learn.microsoft.com/en-us/windows/win32/debug/pe-format
+// Signature, COFF and optional header as they follow each other in a PE32+
+// image.
+typedef struct {
+    uint32_t signature;
+    uint16_t machine;
+    uint16_t sections;
+    uint32_t timestamp;
+    uint32_t symbol_table;
+    uint32_t symbols;
+    uint16_t optional_size;
+    uint16_t characteristics;
+    uint16_t magic;
+    uint8_t linker_major, linker_minor;
+    uint32_t code_size, data_size, bss_size;
+    uint32_t entry;
+    uint32_t code_base;
+    uint64_t image_base;
+    uint32_t section_alignment, file_alignment;
+    uint16_t os_major, os_minor, image_major, image_minor;
+    uint16_t subsystem_major, subsystem_minor;
+    uint32_t win32_version;
+    uint32_t image_size;
+    uint32_t headers_size;
+    uint32_t checksum;
+    uint16_t subsystem;
+    uint16_t dll_characteristics;
+    uint64_t stack_reserve, stack_commit, heap_reserve, heap_commit;
+    uint32_t loader_flags;
+    uint32_t directories;
+    struct { uint32_t rva, size; } directory[16];
+} __attribute__((packed)) pe_header_t;
+
+typedef struct {
+    char name[8];
+    uint32_t virtual_size;
+    uint32_t virtual_address;
+    uint32_t raw_size;
+    uint32_t raw_offset;
+    uint32_t relocations, line_numbers;
+    uint16_t relocation_count, line_number_count;
+    uint32_t characteristics;
+} pe_section_t;
+
+enum {
+    PE_SIGNATURE = 0x00004550,
+    PE_MACHINE_X64 = 0x8664,
+    PE_MAGIC_PE32PLUS = 0x20B,
+    PE_SUBSYSTEM_EFI_APPLICATION = 10,
+    PE_DIRECTORY_RELOC = 5,
+    PE_RELOC_ABSOLUTE = 0,
+    PE_RELOC_DIR64 = 10,
+    // Optional header offset and its size up to the data directories.
+    PE_OPTIONAL_OFFSET = 24,
+    PE_OPTIONAL_MIN = 112,
+};
+
+pe_header_t *pe_parse(const uint8_t *data, uintn_t size, pe_section_t **sections);
+efi_handle_t pe_load(efi_device_path_t *path, uint64_t offset, uint64_t size);
+int pe_loaded(efi_handle_t handle);
+efi_status_t pe_start(efi_handle_t handle);
+void pe_unload();
+
+/*** Multiprocessing ***/
+// Work spread over the processors with EFI_MP_SERVICES_PROTOCOL, on the BSP
+// alone without it. work(arg, index) runs on APs and may only compute.
+typedef void (*mp_work_t)(void *arg, uintn_t index);
+struct mp_stats {
+    uint32_t runs, parallel;
+    uint64_t items, cycles;
+};
+extern struct mp_stats mp_stats;
+extern int mp_enabled;
+
+int mp_cpus();
+void mp_run(mp_work_t work, void *arg, uintn_t count);
+
+/*** Decompression ***/
+// Streaming decoders for compressed kernels and initrds. Input is pulled
+// from the read loop a chunk at a time, output goes to one buffer holding
+// the whole payload, which also serves as the back reference window.
+enum { CODEC_NONE, CODEC_GZIP, CODEC_ZSTD, CODEC_LZ4, CODEC_COUNT };
+// Bytes of the previous chunk kept in front of the current one, so up to
+// that many bytes just taken can always be given back.
+enum { UNPACK_CHUNK = 4*1024*1024, UNPACK_HEAD = 8 };
+struct unpack {
+    const uint8_t *in, *in_end;
+    uint8_t *out;
+    uint64_t out_len, out_cap;
+    struct unpack_reader *reader;
+};
+struct unpack_stats {
+    uint32_t streams;
+    uint64_t in, out, cycles;
+};
+extern struct unpack_stats unpack_stats[CODEC_COUNT];
+extern int unpack_enabled;
+extern const char *codec_name[CODEC_COUNT];
+
+int unpack_refill(struct unpack *u);
+const uint8_t *unpack_need(struct unpack *u, uintn_t size);
+int unpack_skip(struct unpack *u, uint64_t size);
+int unpack_copy(struct unpack *u, uint64_t size);
+int unpack_grow(struct unpack *u, uint64_t size);
+uint32_t unpack_crc32(const void *data, uintn_t size);
+
+// Next input byte, -1 at the end.
+static inline int unpack_byte(struct unpack *u) {
+    if(u->in==u->in_end && !unpack_refill(u))
+        return -1;
+    return *u->in++;
+}
+
+static inline void unpack_unget(struct unpack *u, int count) {
+    u->in -= count;
+}
+
+// Room for size more output bytes, u->out may move.
+static inline int unpack_space(struct unpack *u, uint64_t size) {
+    return u->out_cap-u->out_len>=size || unpack_grow(u, size);
+}
+
+int inflate_gzip(struct unpack *u);
+int zstd_frame(struct unpack *u);
+int lz4_frame(struct unpack *u);
+int unpack_detect(efi_file_handle_t *file);
+void *unpack_load(efi_file_handle_t *file, uint64_t *size, uintn_t *pages, struct sha256 *hash);
+
+/*** Linux direct boot ***/
+enum { KERNEL_ENTRIES_MAX = 32, INITRD_MAX = 4 };
+// A file on sefil's ESP or a PARTUUID= partition, see esp_path(), or with a
+// size only that part of it, as for the sections of a unified kernel image.
+// Its device path is resolved once by range_path(), kept out of the arena
+// since kernel entries outlive boot entries.
+struct file_range {
+    char *path;
+    uint64_t offset, size;
+    efi_device_path_t *device_path;
+    int resolved;
+};
+struct kernel_entry {
+    char *title;
+    char *options;
+    struct file_range kernel;
+    int initrds;
+    struct file_range initrd[INITRD_MAX];
+};
+extern struct kernel_entry kernel_entries[KERNEL_ENTRIES_MAX];
+extern int kernel_entry_count;
+
+void kernel_config(const char *key, char *value);
+efi_device_path_t *esp_path(const char *path);
+efi_device_path_t *volume_path(efi_handle_t volume, const char *path);
+efi_device_path_t *range_path(struct file_range *range, int lookup);
+int initrd_install(struct kernel_entry *entry);
+void initrd_uninstall();
+uint32_t kernel_id(const struct kernel_entry *kernel);
+int uki_scan(const uint32_t *id);
+
+#endif /* _SEFIL_H_ */
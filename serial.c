@@ -0,0 +1,202 @@
+#include "sefil.h"
+
+// Direct UART console for serial-over-LAN, bypassing the firmware terminal
+// emulation. Output is collected as VT100/ANSI sequences and each frame is
+// handed to the UART with a single Write.
+enum { SERIAL_COLS = 80, SERIAL_ROWS = 24, SERIAL_BUF = 16*1024 };
+struct {
+    efi_serial_io_protocol_t *io;
+    efi_handle_t handle;
+    int attr;
+    int len;
+    uint8_t out[SERIAL_BUF];
+    int in_len, in_stale;
+    uint8_t in[16];
+} serial;
+
+// Plain calls, a failing UART must not recurse through the debug log echo.
+static void serial_write() {
+    uint8_t *data = serial.out;
+    uintn_t left = serial.len;
+    while(left) {
+        uintn_t size = left;
+        ++con_stats.calls;
+        if(EFI_ERROR(serial.io->Write(serial.io, &size, data)) || !size)
+            break;
+        data += size, left -= size;
+    }
+    serial.len = 0;
+}
+
+static void serial_byte(uint8_t c) {
+    if(serial.len==SERIAL_BUF)
+        serial_write();
+    serial.out[serial.len++] = c;
+}
+
+static void serial_printf(const char *fmt, ...) {
+    char text[32];
+    __builtin_va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    for(int i = 0; i<len && text[i]; ++i)
+        serial_byte(text[i]);
+}
+
+// EFI colors are BGR ordered, ANSI ones RGB.
+static int serial_color(int efi) {
+    return (efi & 1)<<2 | (efi & 2) | (efi & 4)>>2;
+}
+
+static void serial_sgr(int attr) {
+    if(attr==serial.attr)
+        return;
+    serial_printf("\x1b[0;%d;%dm", (int64_t)((attr & 8 ? 90 : 30)+serial_color(attr & 7)),
+                  (int64_t)(40+serial_color(attr>>4 & 7)));
+    serial.attr = attr;
+}
+
+// The firmware terminal driver polls the same UART for ConIn, it is
+// disconnected while sefil reads the keys itself.
+static void serial_handover(int leaving) {
+    if(!serial.handle)
+        return;
+    if(leaving)
+        BS->ConnectController(serial.handle, NULL, NULL, 1);
+    else
+        BS->DisconnectController(serial.handle, NULL, NULL);
+}
+
+static int serial_init(int *cols, int *rows, int *col, int *row) {
+    efi_guid_t guid = EFI_SERIAL_IO_PROTOCOL_GUID;
+    efi_handle_t *handles;
+    uintn_t count;
+    // Plain calls, a missing UART only selects the text backend and the
+    // console is not up yet to log anything.
+    if(EFI_ERROR(BS->LocateHandleBuffer(ByProtocol, &guid, NULL, &count, &handles)))
+        return 0;
+    if(count && !EFI_ERROR(BS->HandleProtocol(handles[0], &guid, (void **)&serial.io)))
+        serial.handle = handles[0];
+    BS->FreePool(handles);
+    if(!serial.handle)
+        return 0;
+    serial_handover(0);
+    serial.attr = -1;
+    *cols = SERIAL_COLS, *rows = SERIAL_ROWS;
+    *col = *row = 0;
+    return 1;
+}
+
+static void serial_clear(int attr) {
+    serial.attr = -1;
+    serial_sgr(attr);
+    serial_printf("\x1b[2J\x1b[H");
+}
+
+static void serial_position(int col, int row) {
+    serial_printf("\x1b[%d;%dH", (int64_t)row+1, (int64_t)col+1);
+}
+
+// Box drawing as ASCII, SOL consoles mangle the UTF-8 forms too often.
+static void serial_output(int attr, wchar_t *str, int len) {
+    serial_sgr(attr);
+    for(int i = 0; i<len; ++i) {
+        wchar_t c = str[i];
+        switch(c) {
+        case BOXDRAW_HORIZONTAL: c = '-'; break;
+        case BOXDRAW_VERTICAL: c = '|'; break;
+        case BOXDRAW_DOWN_RIGHT: case BOXDRAW_DOWN_LEFT:
+        case BOXDRAW_UP_RIGHT: case BOXDRAW_UP_LEFT:
+        case BOXDRAW_VERTICAL_RIGHT: case BOXDRAW_VERTICAL_LEFT:
+        case BOXDRAW_DOWN_HORIZONTAL: case BOXDRAW_UP_HORIZONTAL:
+        case BOXDRAW_VERTICAL_HORIZONTAL: c = '+'; break;
+        case ARROW_UP: c = '^'; break;
+        case ARROW_DOWN: c = 'v'; break;
+        }
+        if(c<0x80)
+            serial_byte(c);
+        else if(c<0x800)
+            serial_byte(0xC0 | c>>6), serial_byte(0x80 | (c & 0x3F));
+        else
+            serial_byte(0xE0 | c>>12), serial_byte(0x80 | (c>>6 & 0x3F)),
+            serial_byte(0x80 | (c & 0x3F));
+    }
+}
+
+static void serial_present() {
+    if(serial.len)
+        serial_write();
+}
+
+// Non-blocking, bytes are only read while the receive buffer is not empty
+// and one at a time, so the UART read timeout never applies. Cursor keys
+// arrive as CSI or SS3 sequences, a sequence still incomplete after two
+// polls is taken as a lone ESC. A CSI sequence runs through its final byte,
+// unknown ones are dropped whole.
+static int serial_read_key(efi_input_key_t *key) {
+    uint32_t control;
+    while(serial.in_len<(int)sizeof(serial.in)
+          && !EFI_ERROR(serial.io->GetControl(serial.io, &control))
+          && !(control & EFI_SERIAL_INPUT_BUFFER_EMPTY)) {
+        uintn_t size = 1;
+        if(EFI_ERROR(serial.io->Read(serial.io, &size, serial.in+serial.in_len)) || !size)
+            break;
+        serial.in_len += size;
+        serial.in_stale = 0;
+    }
+    if(!serial.in_len)
+        return 0;
+
+    uint8_t *in = serial.in;
+    int n = serial.in_len, used = 1;
+    *key = (efi_input_key_t){0};
+    if(in[0]==0x1B) {
+        // Index of the final byte, 0 for anything but CSI and SS3.
+        int end = 0;
+        if(n>1 && in[1]=='[')
+            for(end = 2; end<n && (in[end]<0x40 || in[end]>0x7E); ++end);
+        else if(n>1 && in[1]=='O')
+            end = 2;
+        // A full buffer never completes, its sequence is dropped.
+        int partial = n==1 || end>=n;
+        if(partial && n==(int)sizeof(serial.in))
+            end = n-1, partial = 0;
+        if(partial && serial.in_stale++<2)
+            return 0;
+        if(partial || !end)
+            key->ScanCode = SCAN_ESC;
+        else {
+            used = end+1;
+            switch(in[end]) {
+            case 'A': key->ScanCode = SCAN_UP; break;
+            case 'B': key->ScanCode = SCAN_DOWN; break;
+            case 'C': key->ScanCode = SCAN_RIGHT; break;
+            case 'D': key->ScanCode = SCAN_LEFT; break;
+            case 'H': key->ScanCode = SCAN_HOME; break;
+            case 'F': key->ScanCode = SCAN_END; break;
+            case '~':
+                if(end!=3)
+                    break;
+                switch(in[2]) {
+                case '1': key->ScanCode = SCAN_HOME; break;
+                case '4': key->ScanCode = SCAN_END; break;
+                case '5': key->ScanCode = SCAN_PAGE_UP; break;
+                case '6': key->ScanCode = SCAN_PAGE_DOWN; break;
+                }
+                break;
+            }
+        }
+    }
+    else key->UnicodeChar = in[0]=='\n' ? CHAR_CARRIAGE_RETURN : in[0];
+
+    memmove(in, in+used, n-used);
+    serial.in_len -= used;
+    serial.in_stale = 0;
+    return key->ScanCode || key->UnicodeChar;
+}
+
+struct con_backend con_serial = {
+    serial_init, serial_clear, serial_position, serial_output, serial_present,
+    serial_read_key, serial_handover
+};
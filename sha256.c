@@ -0,0 +1,228 @@
+#include "sefil.h"
+#include <cpuid.h>
+// mm_malloc.h would pull in the host stdlib.h, which clashes with uefi.h.
+#define _MM_MALLOC_H_INCLUDED
+#include <immintrin.h>
+
+// SHA-256 (FIPS 180-4). The block function is picked on first use from
+// CPUID: SHA-NI, else an AVX2 message schedule for two blocks at once with
+// BMI2 rotates in the rounds, else an SSSE3 schedule, else plain C. AVX2
+// also needs the firmware to have enabled the YMM state, many do not.
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) ((x)>>(n) | (x)<<(32-(n)))
+#define S0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define S1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define s0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ (x)>>3)
+#define s1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ (x)>>10)
+
+// The 64 rounds on a schedule with the constants already added.
+static inline __attribute__((always_inline)) void sha256_rounds(uint32_t state[8], const uint32_t *wk) {
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for(int t = 0; t<64; ++t) {
+        uint32_t t1 = h+S1(e)+(g ^ (e & (f ^ g)))+wk[t];
+        uint32_t t2 = S0(a)+((a & b) | (c & (a | b)));
+        h = g, g = f, f = e, e = d+t1;
+        d = c, c = b, b = a, a = t1+t2;
+    }
+    state[0] += a, state[1] += b, state[2] += c, state[3] += d;
+    state[4] += e, state[5] += f, state[6] += g, state[7] += h;
+}
+
+static void sha256_scalar(uint32_t state[8], const uint8_t *data, uintn_t blocks) {
+    uint32_t w[64], wk[64];
+    for(; blocks--; data += SHA256_BLOCK) {
+        for(int t = 0; t<16; ++t)
+            w[t] = (uint32_t)data[4*t]<<24 | data[4*t+1]<<16 | data[4*t+2]<<8 | data[4*t+3];
+        for(int t = 16; t<64; ++t)
+            w[t] = s1(w[t-2])+w[t-7]+s0(w[t-15])+w[t-16];
+        for(int t = 0; t<64; ++t)
+            wk[t] = w[t]+sha256_k[t];
+        sha256_rounds(state, wk);
+    }
+}
+
+// Four schedule words per step from the last sixteen in x0..x3, oldest
+// first. s1 of the upper two depends on the lower two of the same step.
+#define VROTR(x, n) _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32-(n)))
+#define VS0(x) _mm_xor_si128(_mm_xor_si128(VROTR(x, 7), VROTR(x, 18)), _mm_srli_epi32(x, 3))
+#define VS1(x) _mm_xor_si128(_mm_xor_si128(VROTR(x, 17), VROTR(x, 19)), _mm_srli_epi32(x, 10))
+
+static __attribute__((target("ssse3"))) void sha256_ssse3(uint32_t state[8], const uint8_t *data, uintn_t blocks) {
+    const __m128i swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    uint32_t wk[64];
+    for(; blocks--; data += SHA256_BLOCK) {
+        __m128i x[4];
+        for(int t = 0; t<64; t += 4) {
+            __m128i w;
+            if(t<16)
+                w = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data+4*t)), swap);
+            else {
+                w = _mm_add_epi32(_mm_add_epi32(x[0], VS0(_mm_alignr_epi8(x[1], x[0], 4))),
+                                  _mm_alignr_epi8(x[3], x[2], 4));
+                w = _mm_add_epi32(w, VS1(_mm_srli_si128(x[3], 8)));
+                w = _mm_add_epi32(w, VS1(_mm_slli_si128(w, 8)));
+                x[0] = x[1], x[1] = x[2], x[2] = x[3];
+            }
+            x[t<16 ? t/4 : 3] = w;
+            _mm_storeu_si128((__m128i *)&wk[t], _mm_add_epi32(w, _mm_loadu_si128((const __m128i *)&sha256_k[t])));
+        }
+        sha256_rounds(state, wk);
+    }
+}
+
+#define YROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32-(n)))
+#define YS0(x) _mm256_xor_si256(_mm256_xor_si256(YROTR(x, 7), YROTR(x, 18)), _mm256_srli_epi32(x, 3))
+#define YS1(x) _mm256_xor_si256(_mm256_xor_si256(YROTR(x, 17), YROTR(x, 19)), _mm256_srli_epi32(x, 10))
+
+// The same schedule with one block per 128-bit lane, the lane-wise shifts
+// and alignr keep the two apart.
+static __attribute__((target("avx2,bmi2"))) void sha256_avx2(uint32_t state[8], const uint8_t *data, uintn_t blocks) {
+    const __m256i swap = _mm256_broadcastsi128_si256(
+        _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3));
+    uint32_t wk[2][64];
+    for(; blocks>=2; blocks -= 2, data += 2*SHA256_BLOCK) {
+        __m256i x[4];
+        for(int t = 0; t<64; t += 4) {
+            __m256i w;
+            if(t<16) {
+                __m128i lo = _mm_loadu_si128((const __m128i *)(data+4*t));
+                __m128i hi = _mm_loadu_si128((const __m128i *)(data+SHA256_BLOCK+4*t));
+                w = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), swap);
+            }
+            else {
+                w = _mm256_add_epi32(_mm256_add_epi32(x[0], YS0(_mm256_alignr_epi8(x[1], x[0], 4))),
+                                     _mm256_alignr_epi8(x[3], x[2], 4));
+                w = _mm256_add_epi32(w, YS1(_mm256_srli_si256(x[3], 8)));
+                w = _mm256_add_epi32(w, YS1(_mm256_slli_si256(w, 8)));
+                x[0] = x[1], x[1] = x[2], x[2] = x[3];
+            }
+            x[t<16 ? t/4 : 3] = w;
+            w = _mm256_add_epi32(w, _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)&sha256_k[t])));
+            _mm_storeu_si128((__m128i *)&wk[0][t], _mm256_castsi256_si128(w));
+            _mm_storeu_si128((__m128i *)&wk[1][t], _mm256_extracti128_si256(w, 1));
+        }
+        sha256_rounds(state, wk[0]);
+        sha256_rounds(state, wk[1]);
+    }
+    if(blocks)
+        sha256_ssse3(state, data, blocks);
+}
+
+// Two rounds per sha256rnds2 on the state split into ABEF and CDGH.
+static __attribute__((target("sha,sse4.1"))) void sha256_shani(uint32_t state[8], const uint8_t *data, uintn_t blocks) {
+    const __m128i swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m128i dcba = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+    __m128i abef = _mm_alignr_epi8(dcba, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, dcba, 0xF0);
+    for(; blocks--; data += SHA256_BLOCK) {
+        __m128i abef_save = abef, cdgh_save = cdgh, m[4];
+        for(int i = 0; i<16; ++i) {
+            if(i<4)
+                m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data+16*i)), swap);
+            else {
+                __m128i w = _mm_add_epi32(_mm_sha256msg1_epu32(m[i & 3], m[(i+1) & 3]),
+                                          _mm_alignr_epi8(m[(i+3) & 3], m[(i+2) & 3], 4));
+                m[i & 3] = _mm_sha256msg2_epu32(w, m[(i+3) & 3]);
+            }
+            __m128i wk = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4*i]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0E));
+        }
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+
+typedef void (*sha256_blocks_t)(uint32_t state[8], const uint8_t *data, uintn_t blocks);
+static sha256_blocks_t sha256_blocks, sha256_ap_blocks;
+static const char *sha256_name;
+
+static void sha256_select() {
+    unsigned a, b, c, d, ecx1 = 0, ebx7 = 0;
+    if(__get_cpuid(1, &a, &b, &c, &d))
+        ecx1 = c;
+    if(__get_cpuid_max(0, NULL)>=7) {
+        __cpuid_count(7, 0, a, b, c, d);
+        ebx7 = b;
+    }
+    // YMM state has to be enabled in XCR0, which needs OSXSAVE.
+    int ymm = 0;
+    if(ecx1 & bit_OSXSAVE) {
+        uint32_t lo, hi;
+        __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        ymm = (lo & 6)==6;
+    }
+    if(ebx7 & bit_SHA && ecx1 & bit_SSE4_1)
+        sha256_blocks = sha256_shani, sha256_name = "sha-ni";
+    else if(ebx7 & bit_AVX2 && ebx7 & bit_BMI2 && ymm)
+        sha256_blocks = sha256_avx2, sha256_name = "avx2";
+    else if(ecx1 & bit_SSSE3)
+        sha256_blocks = sha256_ssse3, sha256_name = "ssse3";
+    else
+        sha256_blocks = sha256_scalar, sha256_name = "scalar";
+    // APs may not have the YMM state enabled that the BSP has.
+    sha256_ap_blocks = sha256_blocks==sha256_avx2 ? sha256_ssse3 : sha256_blocks;
+    log_printf(LOG_INFO, "sha256: %s", sha256_name);
+}
+
+void sha256_init(struct sha256 *ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    if(!sha256_blocks)
+        sha256_select();
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->length = 0;
+}
+
+static void sha256_feed(struct sha256 *ctx, const void *data, uintn_t size, sha256_blocks_t blocks) {
+    const uint8_t *p = data;
+    uintn_t used = ctx->length%SHA256_BLOCK;
+    ctx->length += size;
+    if(used) {
+        uintn_t part = min(size, SHA256_BLOCK-used);
+        memcpy(ctx->buffer+used, p, part);
+        p += part, size -= part;
+        if(used+part<SHA256_BLOCK)
+            return;
+        blocks(ctx->state, ctx->buffer, 1);
+    }
+    blocks(ctx->state, p, size/SHA256_BLOCK);
+    memcpy(ctx->buffer, p+size/SHA256_BLOCK*SHA256_BLOCK, size%SHA256_BLOCK);
+}
+
+void sha256_update(struct sha256 *ctx, const void *data, uintn_t size) {
+    sha256_feed(ctx, data, size, sha256_blocks);
+}
+
+// The same from mp_run work, without AVX2.
+void sha256_update_ap(struct sha256 *ctx, const void *data, uintn_t size) {
+    sha256_feed(ctx, data, size, sha256_ap_blocks);
+}
+
+void sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_SIZE]) {
+    uint64_t bits = ctx->length*8;
+    uint8_t pad[SHA256_BLOCK+8] = { 0x80 };
+    uintn_t size = SHA256_BLOCK-(ctx->length+8)%SHA256_BLOCK;
+    for(int i = 0; i<8; ++i)
+        pad[size+i] = bits>>(56-8*i);
+    sha256_update(ctx, pad, size+8);
+    for(int i = 0; i<SHA256_SIZE; ++i)
+        digest[i] = ctx->state[i/4]>>(24-8*(i%4));
+}
@@ -0,0 +1,297 @@
+#include "sefil.h"
+
+// Compressed payloads are expanded while they are read. The file is read
+// in UNPACK_CHUNK pieces into two buffers; with EFI_FILE_PROTOCOL revision 2
+// the next piece is requested with ReadEx while the decoder works on the
+// current one, so decoding overlaps the disk. Memory is the two chunks, a
+// scratch area for blocks straddling them, and the output.
+int unpack_enabled = 1;
+struct unpack_stats unpack_stats[CODEC_COUNT];
+
+const char *codec_name[CODEC_COUNT] = { "raw", "gzip", "zstd", "lz4" };
+
+typedef struct {
+    efi_event_t Event;
+    efi_status_t Status;
+    uintn_t BufferSize;
+    void *Buffer;
+} efi_file_io_token_t;
+
+typedef struct {
+    efi_file_handle_t file;
+    void *OpenEx;
+    efi_status_t (EFIAPI *ReadEx)(efi_file_handle_t *File, efi_file_io_token_t *Token);
+    void *WriteEx, *FlushEx;
+} efi_file_handle2_t;
+
+enum { EFI_FILE_PROTOCOL_REVISION2 = 0x00020000 };
+
+struct unpack_reader {
+    efi_file_handle_t *file;
+    // Bytes not yet requested, and taken by the decoder before the current
+    // chunk.
+    uint64_t left, done;
+    uint8_t *chunk[2];
+    int current, pending, async;
+    efi_file_io_token_t token;
+    uint8_t *scratch;
+    uintn_t scratch_size;
+    uint64_t estimate, wait;
+    efi_physical_address_t pages;
+    struct sha256 *hash;
+};
+
+static void unpack_request(struct unpack_reader *r) {
+    uint8_t *next = r->chunk[!r->current]+UNPACK_HEAD;
+    uintn_t size = min(r->left, UNPACK_CHUNK);
+    if(!r->async || !size)
+        return;
+    r->token = (efi_file_io_token_t){ .Event = r->token.Event, .BufferSize = size, .Buffer = next };
+    EE(((efi_file_handle2_t *)r->file)->ReadEx(r->file, &r->token)) {
+        r->async = 0;
+        return;
+    }
+    r->pending = 1;
+    r->left -= size;
+}
+
+// Move to the next chunk, keeping the last UNPACK_HEAD bytes in front of it.
+int unpack_refill(struct unpack *u) {
+    struct unpack_reader *r = u->reader;
+    uint8_t *next = r->chunk[!r->current];
+    uintn_t size;
+    uint64_t start = rdtsc();
+    if(r->pending) {
+        uintn_t index;
+        r->pending = 0;
+        EE(BS->WaitForEvent(1, &r->token.Event, &index))
+            return 0;
+        if(EFI_ERROR(r->token.Status))
+            return 0;
+        size = r->token.BufferSize;
+    }
+    else {
+        size = min(r->left, UNPACK_CHUNK);
+        if(!size)
+            return 0;
+        EE(r->file->Read(r->file, &size, next+UNPACK_HEAD))
+            return 0;
+        r->left -= size;
+    }
+    r->wait += rdtsc()-start;
+    if(!size)
+        return 0;
+
+    memcpy(next, u->in_end-UNPACK_HEAD, UNPACK_HEAD);
+    r->done += u->in_end-(r->chunk[r->current]+UNPACK_HEAD);
+    r->current = !r->current;
+    u->in = next+UNPACK_HEAD, u->in_end = u->in+size;
+    // Hashed while the next chunk is on its way.
+    unpack_request(r);
+    if(r->hash)
+        sha256_update(r->hash, u->in, size);
+    return 1;
+}
+
+// Input bytes taken so far.
+static uint64_t unpack_tell(struct unpack *u) {
+    struct unpack_reader *r = u->reader;
+    return r->done+(u->in-(r->chunk[r->current]+UNPACK_HEAD));
+}
+
+// size contiguous input bytes, in the chunk if they are there, else in the
+// scratch area. NULL if the input ends first.
+const uint8_t *unpack_need(struct unpack *u, uintn_t size) {
+    if((uintn_t)(u->in_end-u->in)>=size) {
+        const uint8_t *data = u->in;
+        u->in += size;
+        return data;
+    }
+    struct unpack_reader *r = u->reader;
+    if(r->scratch_size<size) {
+        free(r->scratch);
+        if(!(r->scratch = malloc(size)))
+            return r->scratch_size = 0, NULL;
+        r->scratch_size = size;
+    }
+    for(uintn_t have = 0; have<size;) {
+        if(u->in==u->in_end && !unpack_refill(u))
+            return NULL;
+        uintn_t part = min(size-have, (uintn_t)(u->in_end-u->in));
+        memcpy(r->scratch+have, u->in, part);
+        u->in += part, have += part;
+    }
+    return r->scratch;
+}
+
+int unpack_skip(struct unpack *u, uint64_t size) {
+    while(size) {
+        if(u->in==u->in_end && !unpack_refill(u))
+            return 0;
+        uintn_t part = min(size, (uint64_t)(u->in_end-u->in));
+        u->in += part, size -= part;
+    }
+    return 1;
+}
+
+// Stored data straight from the input to the output.
+int unpack_copy(struct unpack *u, uint64_t size) {
+    if(!unpack_space(u, size))
+        return 0;
+    while(size) {
+        if(u->in==u->in_end && !unpack_refill(u))
+            return 0;
+        uintn_t part = min(size, (uint64_t)(u->in_end-u->in));
+        memcpy(u->out+u->out_len, u->in, part);
+        u->in += part, u->out_len += part, size -= part;
+    }
+    return 1;
+}
+
+// The first allocation takes the size estimate, later ones double. The old
+// contents move along, which frame content sizes mostly avoid.
+int unpack_grow(struct unpack *u, uint64_t size) {
+    struct unpack_reader *r = u->reader;
+    uint64_t capacity = max(u->out_len+size, u->out_cap ? 2*u->out_cap : r->estimate);
+    efi_physical_address_t pages;
+    EE(BS->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(capacity), &pages))
+        return 0;
+    if(u->out) {
+        memcpy((void *)(uintn_t)pages, u->out, u->out_len);
+        BS->FreePages(r->pages, EFI_SIZE_TO_PAGES(u->out_cap));
+    }
+    u->out = (uint8_t *)(uintn_t)pages, u->out_cap = capacity;
+    r->pages = pages;
+    return 1;
+}
+
+uint32_t unpack_crc32(const void *data, uintn_t size) {
+    uint32_t crc = 0;
+    EE(BS->CalculateCrc32((void *)data, size, &crc)) {}
+    return crc;
+}
+
+static int unpack_codec(const uint8_t *magic) {
+    if(magic[0]==0x1F && magic[1]==0x8B && magic[2]==8)
+        return CODEC_GZIP;
+    if((magic[0]==0x28 && magic[1]==0xB5 && magic[2]==0x2F && magic[3]==0xFD)
+       || ((magic[0] & 0xF0)==0x50 && magic[1]==0x2A && magic[2]==0x4D && magic[3]==0x18))
+        return CODEC_ZSTD;
+    if((magic[0]==0x04 && magic[1]==0x22 && magic[2]==0x4D && magic[3]==0x18)
+       || (magic[0]==0x02 && magic[1]==0x21 && magic[2]==0x4C && magic[3]==0x18))
+        return CODEC_LZ4;
+    return CODEC_NONE;
+}
+
+// Codec of the data at the file position, which is kept. CODEC_NONE when
+// decompression is off.
+int unpack_detect(efi_file_handle_t *file) {
+    uint64_t position;
+    uint8_t magic[4];
+    uintn_t size = sizeof(magic);
+    if(!unpack_enabled || EFI_ERROR(file->GetPosition(file, &position)))
+        return CODEC_NONE;
+    EE(file->Read(file, &size, magic))
+        size = 0;
+    EE(file->SetPosition(file, position))
+        return CODEC_NONE;
+    return size==sizeof(magic) ? unpack_codec(magic) : CODEC_NONE;
+}
+
+// Decode every stream in turn. Whatever follows the last one is passed on
+// as it is, as initramfs allows uncompressed data after compressed.
+static int unpack_run(struct unpack *u) {
+    struct unpack_reader *r = u->reader;
+    for(;;) {
+        uint8_t magic[4];
+        int count = 0, c;
+        while(count<4 && (c = unpack_byte(u))>=0)
+            magic[count++] = c;
+        unpack_unget(u, count);
+        int codec = count==4 ? unpack_codec(magic) : CODEC_NONE;
+
+        uint64_t start = rdtsc(), wait = r->wait, in = unpack_tell(u), out = u->out_len;
+        int ok = 1;
+        switch(codec) {
+        case CODEC_GZIP: ok = inflate_gzip(u); break;
+        case CODEC_ZSTD: ok = zstd_frame(u); break;
+        case CODEC_LZ4: ok = lz4_frame(u); break;
+        default:
+            while(ok && (u->in<u->in_end || unpack_refill(u)))
+                ok = unpack_copy(u, u->in_end-u->in);
+        }
+        struct unpack_stats *stats = &unpack_stats[codec];
+        ++stats->streams;
+        stats->in += unpack_tell(u)-in;
+        stats->out += u->out_len-out;
+        stats->cycles += rdtsc()-start-(r->wait-wait);
+        if(!ok) {
+            log_printf(LOG_ERROR, "unpack: corrupt %s stream at %d", codec_name[codec], in);
+            return 0;
+        }
+        if(codec==CODEC_NONE)
+            return 1;
+    }
+}
+
+// Read size bytes from the file position and expand them into page
+// allocated memory, freed with FreePages(buffer, *pages). size receives
+// the expanded length, hash takes the compressed bytes.
+void *unpack_load(efi_file_handle_t *file, uint64_t *size, uintn_t *pages, struct sha256 *hash) {
+    static struct unpack_reader r;
+    struct unpack_stats before[CODEC_COUNT];
+    memcpy(before, unpack_stats, sizeof(before));
+    uint64_t start = rdtsc();
+
+    // A gzip member ends with its length, a good first guess for a single
+    // one. Frames with a content size reserve it themselves.
+    uint64_t position;
+    uint32_t isize = 0;
+    uintn_t length = sizeof(isize);
+    if(unpack_detect(file)==CODEC_GZIP && *size>=18 && !EFI_ERROR(file->GetPosition(file, &position))) {
+        EE(file->SetPosition(file, position+*size-4)) {}
+        else EE(file->Read(file, &length, &isize))
+            isize = 0;
+        EE(file->SetPosition(file, position))
+            return NULL;
+    }
+
+    r = (struct unpack_reader){ .file = file, .left = *size, .token.Event = r.token.Event, .hash = hash };
+    r.estimate = isize>=*size && isize/64<=*size ? isize : 4*max(*size, EFI_PAGE_SIZE);
+    r.async = file->Revision>=EFI_FILE_PROTOCOL_REVISION2;
+    if(r.async && !r.token.Event && EFI_ERROR(BS->CreateEvent(0, 0, NULL, NULL, &r.token.Event)))
+        r.async = 0;
+    uint8_t *chunks = calloc(2, UNPACK_HEAD+UNPACK_CHUNK);
+    struct unpack u = { .reader = &r };
+    if(!chunks)
+        return NULL;
+    r.chunk[0] = chunks, r.chunk[1] = chunks+UNPACK_HEAD+UNPACK_CHUNK;
+    u.in = u.in_end = r.chunk[0]+UNPACK_HEAD;
+
+    int ok = unpack_run(&u);
+    if(r.pending) {
+        uintn_t index;
+        BS->WaitForEvent(1, &r.token.Event, &index);
+    }
+    free(chunks);
+    free(r.scratch);
+    if(!ok || !u.out) {
+        if(u.out)
+            BS->FreePages(r.pages, EFI_SIZE_TO_PAGES(u.out_cap));
+        return NULL;
+    }
+
+    uint64_t us = tsc_to_us(rdtsc()-start);
+    for(int i = 0; i<CODEC_COUNT; ++i) {
+        struct unpack_stats *stats = &unpack_stats[i];
+        uint64_t out = stats->out-before[i].out, decode = tsc_to_us(stats->cycles-before[i].cycles);
+        if(stats->streams!=before[i].streams)
+            log_printf(LOG_INFO, "unpack: %s %d -> %d bytes, decode %d us (%d KB/s)", codec_name[i],
+                       stats->in-before[i].in, out, decode, decode ? out/1024*1000000/decode : 0);
+    }
+    log_printf(LOG_INFO, "unpack: %d -> %d bytes in %d us, %d us waiting for reads%s", *size,
+               u.out_len, us, tsc_to_us(r.wait), r.async ? ", overlapped" : "");
+    *size = u.out_len;
+    *pages = EFI_SIZE_TO_PAGES(u.out_cap);
+    return u.out;
+}
@@ -0,0 +1,249 @@
+#include "sefil.h"
+
+// Pinned image digests from sefil.conf, in sha256sum format:
+//   sha256=<64 hex digits> \EFI\vendor\grubx64.efi
+// The path is matched against the file part of a boot entry's device path,
+// ignoring case and the separator style, on whatever volume it is.
+struct {
+    int count;
+    struct {
+        char *path;
+        uint8_t digest[SHA256_SIZE];
+    } pin[PINS_MAX];
+} pins;
+
+static int hex_digit(char c) {
+    if(c>='0' && c<='9') return c-'0';
+    if(c>='a' && c<='f') return c-'a'+10;
+    if(c>='A' && c<='F') return c-'A'+10;
+    return -1;
+}
+
+void verify_config(char *value) {
+    if(pins.count==PINS_MAX) {
+        log_printf(LOG_WARN, "sefil.conf: more than %d sha256 pins", (int64_t)PINS_MAX);
+        return;
+    }
+    uint8_t *digest = pins.pin[pins.count].digest;
+    for(int i = 0; i<2*SHA256_SIZE; ++i) {
+        int digit = hex_digit(value[i]);
+        if(digit<0) {
+            log_printf(LOG_WARN, "sefil.conf: malformed sha256 %s", value);
+            return;
+        }
+        digest[i/2] = digest[i/2]<<4 | digit;
+    }
+    char *path = value+2*SHA256_SIZE;
+    if(*path!=' ' && *path!='\t') {
+        log_printf(LOG_WARN, "sefil.conf: sha256 %s needs a path after the digest", value);
+        return;
+    }
+    // sha256sum marks binary mode with '*'.
+    while(*path==' ' || *path=='\t' || *path=='*') ++path;
+    pins.pin[pins.count++].path = path;
+}
+
+static int path_char(int c) {
+    c = c=='/' ? '\\' : c;
+    return c>='A' && c<='Z' ? c-'A'+'a' : c;
+}
+
+// Digest pinned for the file a device path points to, NULL if none.
+const uint8_t *verify_pin(efi_device_path_t *path) {
+    if(!pins.count)
+        return NULL;
+    wchar_t *name = file_name(path, NULL, NULL);
+    const uint8_t *digest = NULL;
+    if(!name)
+        return NULL;
+    for(int i = 0; i<pins.count && !digest; ++i) {
+        const char *pin = pins.pin[i].path;
+        const wchar_t *file = name;
+        while(*pin=='\\' || *pin=='/') ++pin;
+        while(*file=='\\') ++file;
+        while(*pin && path_char((uint8_t)*pin)==path_char(*file)) ++pin, ++file;
+        if(!*pin && !*file)
+            digest = pins.pin[i].digest;
+    }
+    free(name);
+    return digest;
+}
+
+// Digests of images that matched their pin, keyed by file identity: the
+// device path, size and modification time. Any change misses, and an
+// unchanged image is started without being hashed. The variable is boot
+// services only, so the OS cannot rewrite it, and the CRC32 in front only
+// catches torn or corrupt writes. It is written on misses alone, a digest
+// older than reverify days is recomputed. reverify=0 or a firmware without
+// a clock leave the cache alone and hash every boot.
+enum { DIGEST_CACHE_MAX = 16 };
+struct digest_entry {
+    uint8_t path[16];   // leading bytes of the device path's SHA-256
+    uint64_t size;
+    efi_time_t mtime;
+    uint32_t day;       // of the last full hash, in days since 1970
+    uint8_t digest[SHA256_SIZE];
+};
+struct digest_cache {
+    uint32_t crc;
+    uint32_t count;
+    struct digest_entry entry[DIGEST_CACHE_MAX];
+};
+
+int verify_reverify = 30;
+
+struct {
+    int loaded;
+    uint32_t today;
+    struct digest_cache data;
+    // Identity of the image being booted, from verify_cached().
+    int pending;
+    struct digest_entry key;
+} cache;
+
+static uint32_t efi_day(const efi_time_t *time) {
+    int year = time->Year-(time->Month<=2), month = time->Month;
+    int day_of_year = (153*(month>2 ? month-3 : month+9)+2)/5+time->Day-1;
+    return year*365+year/4-year/100+year/400+day_of_year-719468;
+}
+
+static uint32_t cache_crc(struct digest_cache *data) {
+    uint32_t crc = 0;
+    EE(BS->CalculateCrc32(&data->count, sizeof(data->count)+data->count*sizeof(data->entry[0]), &crc)) {}
+    return crc;
+}
+
+static void cache_load() {
+    if(cache.loaded++)
+        return;
+    efi_time_t now;
+    cache.today = EFI_ERROR(RT->GetTime(&now, NULL)) ? 0 : efi_day(&now);
+    uintn_t size;
+    struct digest_cache *data = var_get(L"SefilDigests", &sefil_guid, &size);
+    if(data && size>=2*sizeof(uint32_t) && data->count<=DIGEST_CACHE_MAX
+       && size==2*sizeof(uint32_t)+data->count*sizeof(data->entry[0]) && data->crc==cache_crc(data))
+        memcpy(&cache.data, data, size);
+    else if(data)
+        log_printf(LOG_WARN, "verify: digest cache corrupt, dropped");
+    free(data);
+}
+
+static void cache_save() {
+    cache.data.crc = cache_crc(&cache.data);
+    EE(RT->SetVariable(L"SefilDigests", &sefil_guid,
+                       EFI_VARIABLE_NON_VOLATILE|EFI_VARIABLE_BOOTSERVICE_ACCESS,
+                       2*sizeof(uint32_t)+cache.data.count*sizeof(cache.data.entry[0]), &cache.data)) {}
+}
+
+static struct digest_entry *cache_find(const struct digest_entry *key) {
+    for(uint32_t i = 0; i<cache.data.count; ++i) {
+        struct digest_entry *entry = &cache.data.entry[i];
+        if(!memcmp(entry->path, key->path, sizeof(key->path)) && entry->size==key->size
+           && !memcmp(&entry->mtime, &key->mtime, sizeof(key->mtime)))
+            return entry;
+    }
+    return NULL;
+}
+
+// Whether the image at path matched pin before and is unchanged since, so
+// it need not be hashed. Its identity is kept for verify_check() either way.
+int verify_cached(efi_device_path_t *path, const uint8_t *pin) {
+    cache.pending = 0;
+    // Without a clock no digest has an age.
+    if(!verify_reverify)
+        return 0;
+    cache_load();
+    if(!cache.today)
+        return 0;
+    efi_file_handle_t *file = file_open(path, NULL, NULL);
+    if(!file)
+        return 0;
+    efi_guid_t info_guid = EFI_FILE_INFO_GUID;
+    efi_file_info_t info;
+    uintn_t size = sizeof(info);
+    efi_status_t status = file->GetInfo(file, &info_guid, &size, &info);
+    file->Close(file);
+    if(EFI_ERROR(status))
+        return 0;
+
+    struct digest_entry *key = &cache.key;
+    struct sha256 hash;
+    uint8_t digest[SHA256_SIZE];
+    efi_device_path_t *end = path;
+    while(!IsDevicePathEnd(end)) end = NextDevicePathNode(end);
+    sha256_init(&hash);
+    sha256_update(&hash, path, (uint8_t *)end-(uint8_t *)path);
+    sha256_final(&hash, digest);
+    memset(key, 0, sizeof(*key));
+    memcpy(key->path, digest, sizeof(key->path));
+    key->size = info.FileSize;
+    key->mtime = info.ModificationTime;
+    key->mtime.Pad1 = key->mtime.Pad2 = 0;
+    cache.pending = 1;
+
+    struct digest_entry *entry = cache_find(key);
+    if(!entry || memcmp(entry->digest, pin, SHA256_SIZE))
+        return 0;
+    if(cache.today-entry->day>=(uint32_t)verify_reverify) {
+        log_printf(LOG_INFO, "verify: cached digest is %d days old, hashing again",
+                   (uint64_t)(cache.today-entry->day));
+        return 0;
+    }
+    log_printf(LOG_INFO, "verify: unchanged since day %d, hash skipped", (uint64_t)entry->day);
+    cache.pending = 0;
+    return 1;
+}
+
+// Record the verified digest, replacing the oldest entry when full. An
+// entry that already says the same is not written again, NVRAM wears.
+static void cache_store(const uint8_t *digest) {
+    struct digest_entry *entry = cache_find(&cache.key);
+    if(entry && entry->day==cache.today && !memcmp(entry->digest, digest, SHA256_SIZE))
+        return;
+    if(!entry && cache.data.count<DIGEST_CACHE_MAX)
+        entry = &cache.data.entry[cache.data.count++];
+    else if(!entry) {
+        entry = &cache.data.entry[0];
+        for(uint32_t i = 1; i<cache.data.count; ++i)
+            if(cache.data.entry[i].day<entry->day)
+                entry = &cache.data.entry[i];
+    }
+    *entry = cache.key;
+    entry->day = cache.today;
+    memcpy(entry->digest, digest, SHA256_SIZE);
+    cache_save();
+}
+
+static void cache_drop() {
+    struct digest_entry *entry = cache_find(&cache.key);
+    if(!entry)
+        return;
+    *entry = cache.data.entry[--cache.data.count];
+    cache_save();
+}
+
+// Finish the hash of what was read and compare it with the pin. A match is
+// cached if verify_cached() was asked first, a mismatch is logged as an
+// error, which the menu reports.
+int verify_check(struct sha256 *hash, const uint8_t *pin) {
+    uint8_t digest[SHA256_SIZE];
+    int pending = cache.pending;
+    cache.pending = 0;
+    sha256_final(hash, digest);
+    if(!memcmp(digest, pin, SHA256_SIZE)) {
+        log_printf(LOG_INFO, "verify: %d bytes match the pinned sha256", hash->length);
+        if(pending)
+            cache_store(digest);
+        return 1;
+    }
+    char hex[2*SHA256_SIZE+1];
+    for(int i = 0; i<SHA256_SIZE; ++i) {
+        hex[2*i] = "0123456789abcdef"[digest[i]>>4];
+        hex[2*i+1] = "0123456789abcdef"[digest[i] & 15];
+    }
+    hex[2*SHA256_SIZE] = 0;
+    log_printf(LOG_ERROR, "verify: sha256 %s does not match the pin", hex);
+    if(pending)
+        cache_drop();
+    return 0;
+}
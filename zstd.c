@@ -0,0 +1,614 @@
+#include "sefil.h"
+
+// Zstandard frames (RFC 8878) without dictionaries. Compressed blocks are
+// taken whole from the input, at most ZSTD_BLOCK bytes, and their sequences
+// executed straight into the output.
+enum {
+    ZSTD_MAGIC = 0xFD2FB528, ZSTD_SKIPPABLE = 0x184D2A50, ZSTD_BLOCK = 128*1024,
+    ZSTD_LL_MAX = 35, ZSTD_ML_MAX = 52, ZSTD_OF_MAX = 31,
+    ZSTD_LL_LOG = 9, ZSTD_ML_LOG = 9, ZSTD_OF_LOG = 8, ZSTD_HUF_LOG = 11,
+};
+
+// Bits read backwards from the end of a buffer, pos counts those left.
+// Reads past the start return zeros and make pos negative.
+struct zstd_bits {
+    const uint8_t *data;
+    uintn_t size;
+    int64_t pos;
+};
+
+struct zstd_fse {
+    int log;
+    struct { uint8_t symbol, bits; uint16_t base; } state[1<<ZSTD_LL_LOG];
+};
+
+struct zstd_huffman {
+    int log;
+    struct { uint8_t symbol, bits; } entry[1<<ZSTD_HUF_LOG];
+};
+
+// Frame state, tables and repeat offsets carry over between blocks.
+struct zstd {
+    struct unpack *u;
+    uint64_t start;
+    uint32_t rep[3];
+    int have_huffman;
+    struct zstd_huffman huffman;
+    struct zstd_fse ll, of, ml, weights;
+    int have_ll, have_of, have_ml;
+    const uint8_t *literals;
+    uint8_t literal_buffer[ZSTD_BLOCK];
+};
+
+static const uint32_t ll_base[ZSTD_LL_MAX+1] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096,
+    8192, 16384, 32768, 65536
+};
+static const uint8_t ll_bits[ZSTD_LL_MAX+1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16
+};
+static const uint32_t ml_base[ZSTD_ML_MAX+1] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+    19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+    35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051,
+    4099, 8195, 16387, 32771, 65539
+};
+static const uint8_t ml_bits[ZSTD_ML_MAX+1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16
+};
+static const int16_t ll_default[ZSTD_LL_MAX+1] = {
+    4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1, -1, -1, -1, -1
+};
+static const int16_t ml_default[ZSTD_ML_MAX+1] = {
+    1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1, -1, -1
+};
+static const int16_t of_default[29] = {
+    1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1
+};
+
+static inline int highbit(uint32_t value) {
+    return 31-__builtin_clz(value);
+}
+
+static inline uint32_t le32(const uint8_t *p) {
+    return p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+static inline uint64_t le64(const uint8_t *p) {
+    return le32(p) | (uint64_t)le32(p+4)<<32;
+}
+
+static int zstd_bits_init(struct zstd_bits *b, const uint8_t *data, uintn_t size) {
+    if(!size || !data[size-1])
+        return 0;
+    b->data = data, b->size = size;
+    b->pos = (int64_t)size*8-8+highbit(data[size-1]);
+    return 1;
+}
+
+// Up to 32 bits below pos.
+static inline uint32_t zstd_peek(const struct zstd_bits *b, int n) {
+    int64_t low = b->pos-n;
+    uint64_t word = 0;
+    if(low>=0) {
+        uintn_t byte = low>>3;
+        if(byte+8<=b->size)
+            memcpy(&word, b->data+byte, 8);
+        else for(uintn_t i = byte; i<b->size; ++i)
+            word |= (uint64_t)b->data[i]<<8*(i-byte);
+        return word>>(low & 7) & ((1ull<<n)-1);
+    }
+    if(b->pos<=0)
+        return 0;
+    for(uintn_t i = 0; i<b->size && i<8; ++i)
+        word |= (uint64_t)b->data[i]<<8*i;
+    return (word & ((1ull<<b->pos)-1))<<-low;
+}
+
+static inline uint32_t zstd_read(struct zstd_bits *b, int n) {
+    uint32_t value = zstd_peek(b, n);
+    b->pos -= n;
+    return value;
+}
+
+static int zstd_fse_build(struct zstd_fse *t, const int16_t *norm, int symbols, int log) {
+    uint16_t next[ZSTD_ML_MAX+1];
+    int size = 1<<log, high = size-1;
+    for(int s = 0; s<symbols; ++s) {
+        if(norm[s]==-1)
+            t->state[high--].symbol = s, next[s] = 1;
+        else
+            next[s] = norm[s];
+    }
+    int step = (size>>1)+(size>>3)+3, pos = 0;
+    for(int s = 0; s<symbols; ++s)
+        for(int i = 0; i<norm[s]; ++i) {
+            t->state[pos].symbol = s;
+            do pos = (pos+step) & (size-1);
+            while(pos>high);
+        }
+    if(pos)
+        return 0;
+    for(int i = 0; i<size; ++i) {
+        int n = next[t->state[i].symbol]++;
+        t->state[i].bits = log-highbit(n);
+        t->state[i].base = (n<<t->state[i].bits)-size;
+    }
+    t->log = log;
+    return 1;
+}
+
+static void zstd_fse_rle(struct zstd_fse *t, int symbol) {
+    t->log = 0;
+    t->state[0].symbol = symbol, t->state[0].bits = 0, t->state[0].base = 0;
+}
+
+// Up to 32 bits at bit, forward and LSB first as in the table headers.
+static inline uint32_t zstd_forward(const uint8_t *data, uintn_t size, uint64_t bit, int n) {
+    uintn_t byte = bit>>3;
+    uint64_t word = 0;
+    if(byte+8<=size)
+        word = le64(data+byte);
+    else for(uintn_t i = byte; i<size; ++i)
+        word |= (uint64_t)data[i]<<8*(i-byte);
+    return word>>(bit & 7) & ((1ull<<n)-1);
+}
+
+// Normalized counts read forward, returns the bytes used or 0.
+static uintn_t zstd_fse_read(struct zstd_fse *t, const uint8_t *data, uintn_t size,
+                             int max_symbol, int max_log) {
+    int16_t norm[ZSTD_ML_MAX+1];
+    if(!size)
+        return 0;
+    int log = (data[0] & 15)+5;
+    uint64_t bit = 4;
+    if(log>max_log)
+        return 0;
+    int remaining = (1<<log)+1, threshold = 1<<log, bits = log+1, symbol = 0, zero = 0;
+    while(remaining>1 && symbol<=max_symbol) {
+        if(zero) {
+            int end = symbol;
+            for(int repeat = 3; repeat==3; end += repeat) {
+                repeat = zstd_forward(data, size, bit, 2);
+                bit += 2;
+            }
+            if(end>max_symbol)
+                return 0;
+            while(symbol<end)
+                norm[symbol++] = 0;
+        }
+        int max = 2*threshold-1-remaining, count;
+        uint32_t value = zstd_forward(data, size, bit, bits);
+        if((int)(value & (threshold-1))<max)
+            count = value & (threshold-1), bit += bits-1;
+        else {
+            count = value & (2*threshold-1), bit += bits;
+            if(count>=threshold)
+                count -= max;
+        }
+        --count;
+        remaining -= count<0 ? -count : count;
+        norm[symbol++] = count;
+        zero = !count;
+        if(remaining<1)
+            return 0;
+        while(remaining<threshold)
+            --bits, threshold >>= 1;
+    }
+    if(remaining!=1 || bit>size*8 || !zstd_fse_build(t, norm, symbol, log))
+        return 0;
+    return (bit+7)>>3;
+}
+
+static inline int zstd_fse_symbol(const struct zstd_fse *t, uint32_t state) {
+    return t->state[state].symbol;
+}
+
+static inline uint32_t zstd_fse_next(const struct zstd_fse *t, uint32_t state, struct zstd_bits *b) {
+    return t->state[state].base+zstd_read(b, t->state[state].bits);
+}
+
+// Huffman tree description, returns the bytes used or 0. Weights are
+// either FSE compressed with two interleaved states or packed 4-bit.
+static uintn_t zstd_huffman_read(struct zstd *z, const uint8_t *data, uintn_t size) {
+    uint8_t weight[256];
+    int count = 0;
+    uintn_t used;
+    if(!size)
+        return 0;
+    if(data[0]>=128) {
+        count = data[0]-127;
+        used = 1+(count+1)/2;
+        if(used>size)
+            return 0;
+        for(int i = 0; i<count; ++i)
+            weight[i] = i & 1 ? data[1+i/2] & 15 : data[1+i/2]>>4;
+    }
+    else {
+        used = 1+data[0];
+        uintn_t header;
+        struct zstd_bits b;
+        if(used>size || !(header = zstd_fse_read(&z->weights, data+1, data[0], 12, 6))
+           || !zstd_bits_init(&b, data+1+header, data[0]-header))
+            return 0;
+        const struct zstd_fse *t = &z->weights;
+        uint32_t s1 = zstd_read(&b, t->log), s2 = zstd_read(&b, t->log);
+        for(;;) {
+            if(count>=254)
+                return 0;
+            weight[count++] = zstd_fse_symbol(t, s1);
+            s1 = zstd_fse_next(t, s1, &b);
+            if(b.pos<0) {
+                weight[count++] = zstd_fse_symbol(t, s2);
+                break;
+            }
+            weight[count++] = zstd_fse_symbol(t, s2);
+            s2 = zstd_fse_next(t, s2, &b);
+            if(b.pos<0) {
+                weight[count++] = zstd_fse_symbol(t, s1);
+                break;
+            }
+        }
+    }
+
+    // The last weight is implied by the total reaching a power of two.
+    uint32_t total = 0;
+    for(int i = 0; i<count; ++i) {
+        if(weight[i]>ZSTD_HUF_LOG)
+            return 0;
+        if(weight[i])
+            total += 1<<(weight[i]-1);
+    }
+    if(!total || count>=256)
+        return 0;
+    int log = highbit(total)+1;
+    uint32_t left = (1<<log)-total;
+    if(log>ZSTD_HUF_LOG || left & (left-1))
+        return 0;
+    weight[count++] = highbit(left)+1;
+
+    // Lowest weights take the first, longest codes.
+    struct zstd_huffman *h = &z->huffman;
+    uint32_t pos = 0;
+    for(int w = 1; w<=log; ++w)
+        for(int s = 0; s<count; ++s) {
+            if(weight[s]!=w)
+                continue;
+            for(uint32_t i = 0; i<1u<<(w-1); ++i)
+                h->entry[pos+i].symbol = s, h->entry[pos+i].bits = log+1-w;
+            pos += 1<<(w-1);
+        }
+    h->log = log;
+    z->have_huffman = 1;
+    return used;
+}
+
+static int zstd_huffman_stream(const struct zstd_huffman *h, uint8_t *out, uintn_t count,
+                               const uint8_t *data, uintn_t size) {
+    struct zstd_bits b;
+    if(!zstd_bits_init(&b, data, size))
+        return 0;
+    for(uintn_t i = 0; i<count; ++i) {
+        uint32_t index = zstd_peek(&b, h->log);
+        out[i] = h->entry[index].symbol;
+        b.pos -= h->entry[index].bits;
+    }
+    return b.pos==0;
+}
+
+// Literals section, z->literals receives the view, returns the bytes used
+// or 0.
+static uintn_t zstd_literals(struct zstd *z, const uint8_t *data, uintn_t size, uintn_t *count) {
+    if(!size)
+        return 0;
+    int type = data[0] & 3, format = data[0]>>2 & 3;
+    uintn_t header, length;
+    if(type<2) {
+        header = format==1 ? 2 : format==3 ? 3 : 1;
+        if(header>size)
+            return 0;
+        length = header==1 ? data[0]>>3 : header==2 ? (data[0]>>4 | data[1]<<4)
+                                                    : (data[0]>>4 | data[1]<<4 | data[2]<<12);
+        *count = length;
+        if(type==0) {
+            // Raw literals stay in the block.
+            if(header+length>size)
+                return 0;
+            z->literals = data+header;
+            return header+length;
+        }
+        if(header+1>size || length>ZSTD_BLOCK)
+            return 0;
+        memset(z->literal_buffer, data[header], length);
+        z->literals = z->literal_buffer;
+        return header+1;
+    }
+
+    header = format<2 ? 3 : format+2;
+    if(header>size)
+        return 0;
+    uint64_t bits = 0;
+    for(uintn_t i = 0; i<header; ++i)
+        bits |= (uint64_t)data[i]<<8*i;
+    int width = format<2 ? 10 : format==2 ? 14 : 18;
+    length = bits>>4 & ((1<<width)-1);
+    uintn_t compressed = bits>>(4+width) & ((1<<width)-1);
+    uintn_t used = header+compressed;
+    if(length>ZSTD_BLOCK || used>size)
+        return 0;
+    const uint8_t *stream = data+header;
+    if(type==2) {
+        uintn_t tree = zstd_huffman_read(z, stream, compressed);
+        if(!tree)
+            return 0;
+        stream += tree, compressed -= tree;
+    }
+    else if(!z->have_huffman)
+        return 0;
+
+    uint8_t *out = z->literal_buffer;
+    if(!format) {
+        if(!zstd_huffman_stream(&z->huffman, out, length, stream, compressed))
+            return 0;
+    }
+    else {
+        if(compressed<6)
+            return 0;
+        uintn_t sizes[4] = { stream[0] | stream[1]<<8, stream[2] | stream[3]<<8,
+                             stream[4] | stream[5]<<8 };
+        if(sizes[0]+sizes[1]+sizes[2]>compressed-6)
+            return 0;
+        sizes[3] = compressed-6-sizes[0]-sizes[1]-sizes[2];
+        uintn_t segment = (length+3)/4;
+        if(3*segment>length)
+            return 0;
+        stream += 6;
+        for(int i = 0; i<4; ++i) {
+            uintn_t part = i<3 ? segment : length-3*segment;
+            if(!zstd_huffman_stream(&z->huffman, out, part, stream, sizes[i]))
+                return 0;
+            out += part, stream += sizes[i];
+        }
+    }
+    z->literals = z->literal_buffer;
+    *count = length;
+    return used;
+}
+
+// One of the three sequence tables by its mode, predefined, RLE, FSE
+// compressed or repeated from the previous block.
+static int zstd_table(struct zstd_fse *t, int *have, int mode, const uint8_t **data,
+                      const uint8_t *end, const int16_t *norm, int symbols, int log,
+                      int max_symbol, int max_log) {
+    uintn_t used;
+    switch(mode) {
+    case 0:
+        return *have = zstd_fse_build(t, norm, symbols, log);
+    case 1:
+        if(*data==end || **data>max_symbol)
+            return *have = 0;
+        zstd_fse_rle(t, *(*data)++);
+        return *have = 1;
+    case 2:
+        if(!(used = zstd_fse_read(t, *data, end-*data, max_symbol, max_log)))
+            return *have = 0;
+        *data += used;
+        return *have = 1;
+    default:
+        return *have;
+    }
+}
+
+static int zstd_sequences(struct zstd *z, const uint8_t *data, uintn_t size, uintn_t literals) {
+    struct unpack *u = z->u;
+    const uint8_t *end = data+size, *lit = z->literals;
+    if(!size)
+        return 0;
+    uint32_t count = data[0];
+    if(count>=128) {
+        if(count<255) {
+            if(size<2)
+                return 0;
+            count = (count-128)<<8 | data[1], ++data;
+        }
+        else {
+            if(size<3)
+                return 0;
+            count = (data[1] | data[2]<<8)+0x7F00, data += 2;
+        }
+    }
+    ++data;
+
+    if(count) {
+        if(data==end || *data & 3)
+            return 0;
+        int modes = *data++;
+        if(!zstd_table(&z->ll, &z->have_ll, modes>>6, &data, end, ll_default, ZSTD_LL_MAX+1, 6,
+                       ZSTD_LL_MAX, ZSTD_LL_LOG)
+           || !zstd_table(&z->of, &z->have_of, modes>>4 & 3, &data, end, of_default, 29, 5,
+                          ZSTD_OF_MAX, ZSTD_OF_LOG)
+           || !zstd_table(&z->ml, &z->have_ml, modes>>2 & 3, &data, end, ml_default, ZSTD_ML_MAX+1, 6,
+                          ZSTD_ML_MAX, ZSTD_ML_LOG))
+            return 0;
+
+        struct zstd_bits b;
+        if(!zstd_bits_init(&b, data, end-data))
+            return 0;
+        uint32_t ll_state = zstd_read(&b, z->ll.log), of_state = zstd_read(&b, z->of.log);
+        uint32_t ml_state = zstd_read(&b, z->ml.log);
+        for(uint32_t i = 0; i<count; ++i) {
+            int of_code = zstd_fse_symbol(&z->of, of_state), ll_code = zstd_fse_symbol(&z->ll, ll_state);
+            int ml_code = zstd_fse_symbol(&z->ml, ml_state);
+            if(of_code>ZSTD_OF_MAX)
+                return 0;
+            uint32_t offset = (1u<<of_code)+zstd_read(&b, of_code);
+            uint32_t match = ml_base[ml_code]+zstd_read(&b, ml_bits[ml_code]);
+            uint32_t length = ll_base[ll_code]+zstd_read(&b, ll_bits[ll_code]);
+            if(i+1<count) {
+                ll_state = zstd_fse_next(&z->ll, ll_state, &b);
+                ml_state = zstd_fse_next(&z->ml, ml_state, &b);
+                of_state = zstd_fse_next(&z->of, of_state, &b);
+            }
+
+            // Offsets 1-3 name the repeat history, shifted by one without
+            // literals.
+            if(offset>3) {
+                z->rep[2] = z->rep[1], z->rep[1] = z->rep[0];
+                z->rep[0] = offset-3;
+            }
+            else {
+                int index = offset-1+!length;
+                if(index==1)
+                    offset = z->rep[1], z->rep[1] = z->rep[0], z->rep[0] = offset;
+                else if(index>1) {
+                    offset = index==2 ? z->rep[2] : z->rep[0]-1;
+                    z->rep[2] = z->rep[1], z->rep[1] = z->rep[0];
+                    z->rep[0] = offset;
+                }
+            }
+            offset = z->rep[0];
+
+            if(length>literals || !offset || offset>u->out_len+length-z->start
+               || !unpack_space(u, (uint64_t)length+match))
+                return 0;
+            uint8_t *out = u->out+u->out_len;
+            memcpy(out, lit, length);
+            lit += length, literals -= length, out += length;
+            const uint8_t *from = out-offset;
+            u->out_len += length+match;
+            if(offset>=match)
+                memcpy(out, from, match);
+            else while(match--)
+                *out++ = *from++;
+        }
+        if(b.pos)
+            return 0;
+    }
+
+    if(!unpack_space(u, literals))
+        return 0;
+    memcpy(u->out+u->out_len, lit, literals);
+    u->out_len += literals;
+    return 1;
+}
+
+static int zstd_block(struct zstd *z, const uint8_t *data, uintn_t size) {
+    uintn_t literals, used = zstd_literals(z, data, size, &literals);
+    return used && zstd_sequences(z, data+used, size-used, literals);
+}
+
+// XXH64 with seed 0, the frame checksum keeps its low 32 bits.
+static const uint64_t xxh_prime[5] = {
+    11400714785074694791ull, 14029467366897019727ull, 1609587929392839161ull,
+    9650029242287828579ull, 2870177450012600261ull
+};
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return x<<r | x>>(64-r);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    return rotl64(acc+input*xxh_prime[1], 31)*xxh_prime[0];
+}
+
+static uint64_t xxh64(const uint8_t *p, uint64_t size) {
+    const uint8_t *end = p+size;
+    uint64_t h;
+    if(size>=32) {
+        uint64_t v[4] = { xxh_prime[0]+xxh_prime[1], xxh_prime[1], 0, -xxh_prime[0] };
+        for(; end-p>=32; p += 32)
+            for(int i = 0; i<4; ++i)
+                v[i] = xxh64_round(v[i], le64(p+8*i));
+        h = rotl64(v[0], 1)+rotl64(v[1], 7)+rotl64(v[2], 12)+rotl64(v[3], 18);
+        for(int i = 0; i<4; ++i)
+            h = (h ^ xxh64_round(0, v[i]))*xxh_prime[0]+xxh_prime[3];
+    }
+    else h = xxh_prime[4];
+    h += size;
+    for(; end-p>=8; p += 8)
+        h = rotl64(h ^ xxh64_round(0, le64(p)), 27)*xxh_prime[0]+xxh_prime[3];
+    if(end-p>=4)
+        h = rotl64(h ^ le32(p)*xxh_prime[0], 23)*xxh_prime[1]+xxh_prime[2], p += 4;
+    for(; p<end; ++p)
+        h = rotl64(h ^ *p*xxh_prime[4], 11)*xxh_prime[0];
+    h = (h ^ h>>33)*xxh_prime[1];
+    h = (h ^ h>>29)*xxh_prime[2];
+    return h ^ h>>32;
+}
+
+// One frame, or a skippable frame which produces nothing.
+int zstd_frame(struct unpack *u) {
+    static struct zstd z;
+    const uint8_t *p = unpack_need(u, 5);
+    if(!p)
+        return 0;
+    uint32_t magic = le32(p);
+    if((magic & 0xFFFFFFF0)==ZSTD_SKIPPABLE) {
+        unpack_unget(u, 1);
+        return (p = unpack_need(u, 4)) && unpack_skip(u, le32(p));
+    }
+    int descriptor = p[4];
+    if(magic!=ZSTD_MAGIC || descriptor & 8)
+        return 0;
+    z.u = u, z.start = u->out_len;
+    z.rep[0] = 1, z.rep[1] = 4, z.rep[2] = 8;
+    z.have_huffman = z.have_ll = z.have_of = z.have_ml = 0;
+
+    // Window size is of no concern with the whole output in memory.
+    int single = descriptor>>5 & 1, dictionary = descriptor & 3, size_flag = descriptor>>6;
+    static const uint8_t dictionary_bytes[4] = { 0, 1, 2, 4 }, size_bytes[4] = { 0, 2, 4, 8 };
+    int content_bytes = size_flag ? size_bytes[size_flag] : single;
+    int header = !single+dictionary_bytes[dictionary]+content_bytes;
+    if(header && !(p = unpack_need(u, header)))
+        return 0;
+    p += !single;
+    for(int i = 0; i<dictionary_bytes[dictionary]; ++i)
+        if(*p++)
+            return 0;
+    uint64_t content = 0;
+    for(int i = 0; i<content_bytes; ++i)
+        content |= (uint64_t)p[i]<<8*i;
+    content += size_flag==1 ? 256 : 0;
+    if(content_bytes && !unpack_space(u, content))
+        return 0;
+
+    for(int last = 0; !last;) {
+        if(!(p = unpack_need(u, 3)))
+            return 0;
+        uint32_t block = p[0] | p[1]<<8 | p[2]<<16, size = block>>3;
+        last = block & 1;
+        switch(block>>1 & 3) {
+        case 0:
+            if(!unpack_copy(u, size))
+                return 0;
+            break;
+        case 1:
+            if(size>ZSTD_BLOCK || !(p = unpack_need(u, 1)) || !unpack_space(u, size))
+                return 0;
+            memset(u->out+u->out_len, *p, size);
+            u->out_len += size;
+            break;
+        case 2:
+            if(size>ZSTD_BLOCK || !(p = unpack_need(u, size)) || !zstd_block(&z, p, size))
+                return 0;
+            break;
+        default:
+            return 0;
+        }
+    }
+
+    uint64_t length = u->out_len-z.start;
+    if(content_bytes && length!=content)
+        return 0;
+    if(descriptor & 4)
+        return (p = unpack_need(u, 4)) && le32(p)==(uint32_t)xxh64(u->out+z.start, length);
+    return 1;
+}